@@ -0,0 +1,181 @@
+/** @file arenabench.cc
+ * @brief Benchmark allocating request temporaries from the heap or an arena.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <ctype.h>
+#include <new>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "server/arena.h"
+#include <string>
+#include <time.h>
+#include <vector>
+
+/// The number of heap allocations made with operator new by this thread.
+static __thread long long heap_allocations = 0;
+
+// Count allocations, leaving the standard operator delete to free them.
+// Dynamic exception specifications were removed in C++17, so the
+// replacement only declares one for the standards which expect it.
+void *
+#if __cplusplus >= 201103L
+operator new(size_t size)
+#else
+operator new(size_t size) throw(std::bad_alloc)
+#endif
+{
+    ++heap_allocations;
+    void * result = malloc(size == 0 ? 1 : size);
+    if (result == NULL)
+	throw std::bad_alloc();
+    return result;
+}
+
+static long long
+now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// A search request, of the sort a worker parses and answers.
+static const char * PAYLOAD =
+	"title:Xapian AND (search OR engine) author:olly NEAR server "
+	"date:2010..2011 lang:en sort:-date offset:0 limit:20 fields:title,"
+	"author,date,summary collapse:thread facet:lang facet:author";
+
+/** Handle a request, with temporaries allocated by `alloc`.
+ *
+ *  This splits the payload into terms, normalises them, and formats a
+ *  response listing twenty results: much the same temporaries as a search
+ *  worker makes.
+ */
+template<class Alloc>
+static size_t
+handle_request(const Alloc & alloc)
+{
+    typedef typename Alloc::template rebind<char>::other CharAlloc;
+    typedef std::basic_string<char, std::char_traits<char>, CharAlloc> String;
+    typedef typename Alloc::template rebind<String>::other StringAlloc;
+
+    CharAlloc char_alloc(alloc);
+    std::vector<String, StringAlloc> terms((StringAlloc(alloc)));
+    String term(char_alloc);
+    for (const char * p = PAYLOAD; ; ++p) {
+	if (*p == ' ' || *p == '\0') {
+	    if (!term.empty())
+		terms.push_back(term);
+	    term.clear();
+	    if (*p == '\0')
+		break;
+	} else {
+	    term += char(tolower(*p));
+	}
+    }
+
+    String response(char_alloc);
+    response += "{\"ok\":1,\"results\":[";
+    for (int i = 0; i != 20; ++i) {
+	String result(char_alloc);
+	char docid[32];
+	snprintf(docid, sizeof(docid), "{\"docid\":%d,\"terms\":[", i * 7919);
+	result += docid;
+	for (size_t j = i % 3; j < terms.size(); j += 3) {
+	    result += '"';
+	    result += terms[j];
+	    result += "\",";
+	}
+	result += "]},";
+	response += result;
+    }
+    response += "]}";
+    return response.size();
+}
+
+/// The state of a worker thread.
+struct WorkerArg {
+    bool use_arena;
+    int requests;
+    size_t total;
+    long long allocations;
+};
+
+static void *
+run_worker(void * arg_ptr)
+{
+    WorkerArg * arg = static_cast<WorkerArg *>(arg_ptr);
+    Arena arena;
+    long long start_allocations = heap_allocations;
+    for (int i = 0; i != arg->requests; ++i) {
+	if (arg->use_arena) {
+	    arg->total += handle_request(ArenaAllocator<char>(arena));
+	    arena.reset();
+	} else {
+	    arg->total += handle_request(std::allocator<char>());
+	}
+    }
+    arg->allocations = heap_allocations - start_allocations;
+    return NULL;
+}
+
+/// Handle requests in a number of threads, allocating from the heap or from
+/// an arena for each thread.
+static void
+bench_requests(bool use_arena, int threads, int requests)
+{
+    std::vector<pthread_t> ids(threads);
+    std::vector<WorkerArg> args(threads);
+    long long start = now_nsec();
+    for (int i = 0; i != threads; ++i) {
+	args[i].use_arena = use_arena;
+	args[i].requests = requests;
+	args[i].total = 0;
+	pthread_create(&ids[i], NULL, run_worker, &args[i]);
+    }
+    long long allocations = 0;
+    for (int i = 0; i != threads; ++i) {
+	pthread_join(ids[i], NULL);
+	allocations += args[i].allocations;
+    }
+    double elapsed = (now_nsec() - start) * 1e-9;
+    printf("%-5s %2d threads: %9.0f requests/s, %6.2f heap allocations "
+	   "per request\n", use_arena ? "arena" : "heap", threads,
+	   threads * double(requests) / elapsed,
+	   double(allocations) / (threads * double(requests)));
+}
+
+int main(int argc, char ** argv) {
+    int requests = 100000;
+    if (argc > 1)
+	requests = atoi(argv[1]);
+    for (int threads = 1; threads <= 32; threads *= 2) {
+	bench_requests(false, threads, requests);
+	bench_requests(true, threads, requests);
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/** @file deadlinebench.cc
+ * @brief Benchmark how many requests with deadlines finish in time.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <deque>
+#include <functional>
+#include <math.h>
+#include <queue>
+#include "server/deadlinequeue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+/** A request in the simulation.  Times are in microseconds.
+ */
+struct Request {
+    long long arrival;
+    long long deadline;
+    long long service;
+};
+
+/// Requests taken in the order they arrived.
+class FifoQueue {
+    std::deque<size_t> items;
+  public:
+    FifoQueue() : items() {}
+    void push(long long deadline, size_t item) {
+	(void) deadline;
+	items.push_back(item);
+    }
+    bool pop(size_t & item) {
+	if (items.empty())
+	    return false;
+	item = items.front();
+	items.pop_front();
+	return true;
+    }
+};
+
+/// Requests taken earliest deadline first.
+class EdfQueue {
+    DeadlineQueue<size_t> items;
+  public:
+    EdfQueue() : items() {}
+    void push(long long deadline, size_t item) { items.push(deadline, item); }
+    bool pop(size_t & item) { return items.pop(item); }
+};
+
+/// A uniform random number in (0, 1), from a fixed seed.
+static double
+uniform(unsigned long long & state)
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ((state * 2685821657736338717ULL >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/** Make requests arriving at random at a given load.
+ *
+ *  Half the requests have a tight deadline and half a loose one; service
+ *  times are exponentially distributed.
+ */
+static void
+make_requests(std::vector<Request> & requests, int count, int workers,
+	      double load, long long mean_service, long long tight,
+	      long long loose)
+{
+    unsigned long long state = 88172645463325252ULL;
+    double mean_gap = mean_service / (load * workers);
+    double now = 0;
+    requests.clear();
+    for (int i = 0; i != count; ++i) {
+	now += -log(uniform(state)) * mean_gap;
+	Request request;
+	request.arrival = (long long)now;
+	request.deadline = request.arrival +
+		(uniform(state) < 0.5 ? tight : loose);
+	request.service = 1 + (long long)(-log(uniform(state)) * mean_service);
+	requests.push_back(request);
+    }
+}
+
+/** Run the requests through a number of workers sharing one queue, in
+ *  simulated time, and count those finished by their deadlines.
+ *
+ *  @param drop True to drop requests whose deadline has passed when a
+ *  worker takes them, as the server does.
+ */
+template<class Queue>
+static int
+simulate(const std::vector<Request> & requests, int workers, bool drop,
+	 int & dropped)
+{
+    Queue queue;
+    std::priority_queue<long long, std::vector<long long>,
+			std::greater<long long> > free_at;
+    for (int i = 0; i != workers; ++i)
+	free_at.push(0);
+    size_t next = 0;
+    size_t queued = 0;
+    int on_time = 0;
+    dropped = 0;
+    while (next != requests.size() || queued != 0) {
+	long long now = free_at.top();
+	free_at.pop();
+	while (next != requests.size() && requests[next].arrival <= now) {
+	    queue.push(requests[next].deadline, next);
+	    ++next;
+	    ++queued;
+	}
+	size_t item;
+	if (!queue.pop(item)) {
+	    // Idle until the next request arrives.
+	    free_at.push(requests[next].arrival);
+	    continue;
+	}
+	--queued;
+	const Request & request = requests[item];
+	if (drop && now >= request.deadline) {
+	    ++dropped;
+	    free_at.push(now);
+	    continue;
+	}
+	long long finished = now + request.service;
+	if (finished <= request.deadline)
+	    ++on_time;
+	free_at.push(finished);
+    }
+    return on_time;
+}
+
+int main(int argc, char ** argv) {
+    int count = 200000;
+    if (argc > 1)
+	count = atoi(argv[1]);
+    const int workers = 4;
+    const long long mean_service = 1000;
+    const long long tight = 5000;
+    const long long loose = 500000;
+    printf("%d workers, mean service %lldus, deadlines %lldus and %lldus\n",
+	   workers, mean_service, tight, loose);
+    const double loads[] = { 0.5, 0.8, 0.95, 1.1, 1.5 };
+    std::vector<Request> requests;
+    for (size_t i = 0; i != sizeof(loads) / sizeof(loads[0]); ++i) {
+	make_requests(requests, count, workers, loads[i], mean_service,
+		      tight, loose);
+	int dropped_fifo, dropped_nodrop, dropped_edf;
+	int nodrop = simulate<FifoQueue>(requests, workers, false,
+					 dropped_nodrop);
+	int fifo = simulate<FifoQueue>(requests, workers, true, dropped_fifo);
+	int edf = simulate<EdfQueue>(requests, workers, true, dropped_edf);
+	printf("load %4.2f: in time: fifo %5.1f%%, fifo+drop %5.1f%% "
+	       "(%4.1f%% dropped), edf+drop %5.1f%% (%4.1f%% dropped)\n",
+	       loads[i], 100.0 * nodrop / count, 100.0 * fifo / count,
+	       100.0 * dropped_fifo / count, 100.0 * edf / count,
+	       100.0 * dropped_edf / count);
+    }
+    return 0;
+}
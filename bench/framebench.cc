@@ -0,0 +1,181 @@
+/** @file framebench.cc
+ * @brief Benchmark finding the parts of pipelined protocol frames.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "server/framescan.h"
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// The parts of a frame found by a scan.
+struct FrameParts {
+    size_t msgid_end;
+    size_t target_end;
+    size_t end;
+};
+
+/** Build a buffer of `count` pipelined frames, with targets of roughly
+ *  `target_len` bytes.
+ */
+static std::string
+make_frames(int count, size_t target_len)
+{
+    std::string result;
+    for (int i = 0; i != count; ++i) {
+	char msgid[32];
+	snprintf(msgid, sizeof(msgid), "%d;qos=batch", i);
+	std::string target("Gdb/products/default/");
+	while (target.size() < target_len)
+	    target += char('a' + (i + target.size()) % 26);
+	std::string body = std::string(msgid) + " " + target + " {}";
+	char len[16];
+	snprintf(len, sizeof(len), "%d ", int(body.size()));
+	result += len;
+	result += body;
+	if (i % 4 == 0)
+	    result += "\r\n";
+    }
+    return result;
+}
+
+/// The scan previously used by the dispatcher.
+static size_t
+legacy_scan(const std::string & buf, std::vector<FrameParts> & parts)
+{
+    size_t pos = 0, size = buf.size();
+    while (true) {
+	while (pos < size && isspace(buf[pos]))
+	    ++pos;
+	size_t msglen = 0;
+	while (pos < size && isdigit(buf[pos]))
+	    msglen = msglen * 10 + (buf[pos++] - '0');
+	if (pos >= size || buf[pos] != ' ')
+	    break;
+	++pos;
+	size_t end = pos + msglen;
+	FrameParts p;
+	p.target_end = buf.find(' ', pos);
+	p.msgid_end = buf.find(';', pos);
+	if (p.msgid_end > p.target_end)
+	    p.msgid_end = p.target_end;
+	p.target_end = buf.find(' ', p.target_end + 1);
+	p.end = end;
+	parts.push_back(p);
+	pos = end;
+    }
+    return parts.size();
+}
+
+/// The scan used by the dispatcher now.
+static size_t
+scanner_scan(const FrameScanner & scanner, const std::string & buf,
+	     std::vector<FrameParts> & parts)
+{
+    const char * data = buf.data();
+    size_t pos = 0, size = buf.size();
+    while (true) {
+	pos = scanner.skip_space(data + pos, data + size) - data;
+	size_t msglen = 0;
+	while (pos < size && isdigit(buf[pos]))
+	    msglen = msglen * 10 + (buf[pos++] - '0');
+	if (pos >= size || buf[pos] != ' ')
+	    break;
+	++pos;
+	size_t end = pos + msglen;
+	FrameHeader header;
+	scanner.scan_header(data + pos, data + end, header);
+	FrameParts p;
+	p.msgid_end = header.msgid_end - data;
+	p.target_end = header.target_end - data;
+	p.end = end;
+	parts.push_back(p);
+	pos = end;
+    }
+    return parts.size();
+}
+
+static void
+bench(size_t target_len, int iterations)
+{
+    int count = 1000;
+    std::string buf = make_frames(count, target_len);
+    std::vector<FrameParts> expected, parts;
+    legacy_scan(buf, expected);
+    parts.reserve(count);
+
+    printf("%d frames, %3d byte targets (%d bytes):\n", count,
+	   int(target_len), int(buf.size()));
+    double start = now();
+    for (int n = 0; n != iterations; ++n) {
+	parts.clear();
+	legacy_scan(buf, parts);
+    }
+    double elapsed = now() - start;
+    printf("  legacy: %7.1f ns/frame\n",
+	   elapsed * 1e9 / (double(iterations) * count));
+
+    std::vector<const FrameScanner *> scanners = get_frame_scanners();
+    for (size_t i = 0; i != scanners.size(); ++i) {
+	start = now();
+	for (int n = 0; n != iterations; ++n) {
+	    parts.clear();
+	    scanner_scan(*scanners[i], buf, parts);
+	}
+	elapsed = now() - start;
+	bool ok = parts.size() == expected.size();
+	for (size_t j = 0; ok && j != parts.size(); ++j) {
+	    ok = parts[j].msgid_end == expected[j].msgid_end &&
+		    parts[j].target_end == expected[j].target_end &&
+		    parts[j].end == expected[j].end;
+	}
+	printf("  %-6s: %7.1f ns/frame%s\n", scanners[i]->name,
+	       elapsed * 1e9 / (double(iterations) * count),
+	       ok ? "" : " (MISMATCH)");
+	if (!ok)
+	    exit(1);
+    }
+}
+
+int main(int argc, char ** argv) {
+    int iterations = 2000;
+    if (argc > 1)
+	iterations = atoi(argv[1]);
+    bench(24, iterations);
+    bench(64, iterations);
+    bench(256, iterations);
+    return 0;
+}
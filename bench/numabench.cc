@@ -0,0 +1,184 @@
+/** @file numabench.cc
+ * @brief Benchmark passing messages between threads across NUMA nodes.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "server/runqueue.h"
+#include "server/stats.h"
+#include "server/topology.h"
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// State shared by the threads of one run.
+struct Run {
+    const CpuTopology * topology;
+    RunQueue * queue;
+    bool pinned;
+};
+
+/// The state of a worker thread, padded to avoid sharing cache lines.
+struct WorkerArg {
+    Run * run;
+    int slot;
+
+    /// Messages handled, and those which crossed between nodes.
+    int handled;
+    int cross_node;
+
+    char padding[64];
+};
+
+static void *
+worker_thread(void * arg_ptr)
+{
+    WorkerArg * arg = static_cast<WorkerArg *>(arg_ptr);
+    Run & run = *arg->run;
+    if (run.pinned)
+	(void) bind_thread_to_cpus(run.queue->get_cpus());
+    Message msg;
+    while (run.queue->pop(arg->slot, msg, 0) == RunQueue::POP_MESSAGE) {
+	if (run.topology->node_of_cpu(msg.queued_cpu) !=
+	    run.topology->node_of_cpu(get_current_cpu()))
+	    (void) __sync_fetch_and_add(&arg->cross_node, 1);
+	(void) __sync_fetch_and_add(&arg->handled, 1);
+    }
+    return NULL;
+}
+
+/** Pass messages from this thread to a group of workers.
+ *
+ *  @param pinned If true, this thread and the workers are bound to their
+ *  CPUs, and the queue is placed on the workers' node.
+ */
+static void
+bench_run(const CpuTopology & topology, const std::vector<int> & producer_cpus,
+	  const std::vector<int> & worker_cpus, bool pinned, int messages)
+{
+    Stats stats;
+    int node = pinned ? topology.node_of_cpus(worker_cpus) : -1;
+    std::vector<int> no_cpus;
+    RunQueue queue(worker_cpus.size(), messages, &stats,
+		   pinned ? worker_cpus : no_cpus, node);
+    Run run;
+    run.topology = &topology;
+    run.queue = &queue;
+    run.pinned = pinned;
+
+    std::vector<int> allowed = topology.allowed_cpus();
+    if (pinned)
+	(void) bind_thread_to_cpus(producer_cpus);
+
+    double start = now();
+    std::vector<pthread_t> threads(worker_cpus.size());
+    std::vector<WorkerArg> args(worker_cpus.size());
+    for (size_t i = 0; i != threads.size(); ++i) {
+	args[i].run = &run;
+	args[i].slot = queue.add_worker();
+	args[i].handled = 0;
+	args[i].cross_node = 0;
+	pthread_create(&threads[i], NULL, worker_thread, &args[i]);
+    }
+    Message msg(0), rejected;
+    msg.msgid = "1";
+    msg.target = "Gdb/products/default/12345";
+    for (int i = 0; i != messages; ++i) {
+	msg.queued_cpu = get_current_cpu();
+	(void) queue.push(msg, rejected);
+    }
+    // Wait for the workers to handle every message before stopping them.
+    int handled = 0, cross_node = 0;
+    while (true) {
+	handled = 0;
+	for (size_t i = 0; i != args.size(); ++i) {
+	    handled += __sync_fetch_and_add(&args[i].handled, 0);
+	}
+	if (handled == messages)
+	    break;
+	sched_yield();
+    }
+    for (size_t i = 0; i != threads.size(); ++i) {
+	queue.stop(args[i].slot);
+    }
+    for (size_t i = 0; i != threads.size(); ++i) {
+	pthread_join(threads[i], NULL);
+	cross_node += args[i].cross_node;
+    }
+    double elapsed = now() - start;
+    if (pinned && !allowed.empty())
+	(void) bind_thread_to_cpus(allowed);
+
+    printf("%-8s %8.0f msgs/s, %6.2f%% crossed nodes (%d of %d)\n",
+	   pinned ? "pinned:" : "unpinned:", handled / elapsed,
+	   cross_node * 100.0 / handled, cross_node, handled);
+}
+
+int main(int argc, char ** argv) {
+    CpuTopology topology;
+    topology.load("/sys/devices/system/node");
+
+    // By default, keep everything on the node of the first allowed CPU.
+    std::vector<int> producer_cpus, worker_cpus;
+    if (argc > 2) {
+	if (!parse_cpu_list(argv[1], producer_cpus) ||
+	    !parse_cpu_list(argv[2], worker_cpus) ||
+	    producer_cpus.empty() || worker_cpus.empty()) {
+	    fprintf(stderr, "Usage: %s [PRODUCER_CPUS WORKER_CPUS]\n", argv[0]);
+	    return 1;
+	}
+    } else {
+	const std::vector<int> & allowed = topology.allowed_cpus();
+	int node = allowed.empty() ? 0 : topology.node_of_cpu(allowed[0]);
+	for (size_t i = 0; i != allowed.size(); ++i) {
+	    if (topology.node_of_cpu(allowed[i]) == node)
+		worker_cpus.push_back(allowed[i]);
+	}
+	if (worker_cpus.empty())
+	    worker_cpus.push_back(0);
+	producer_cpus.push_back(worker_cpus[0]);
+    }
+    int messages = 200000;
+    if (argc > 3)
+	messages = atoi(argv[3]);
+
+    printf("%d NUMA node(s); producer on CPUs %s, %d workers on CPUs %s\n",
+	   topology.node_count(), format_cpu_list(producer_cpus).c_str(),
+	   int(worker_cpus.size()), format_cpu_list(worker_cpus).c_str());
+    bench_run(topology, producer_cpus, worker_cpus, false, messages);
+    bench_run(topology, producer_cpus, worker_cpus, true, messages);
+    return 0;
+}
@@ -0,0 +1,201 @@
+/** @file queuebench.cc
+ * @brief Benchmark handing messages from one thread to a group of workers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <deque>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "server/eventcount.h"
+#include "server/mpmcqueue.h"
+#include <time.h>
+#include <vector>
+
+/// The most items each queue holds.
+static const size_t CAPACITY = 1024;
+
+static long long
+now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** A queue protected by a mutex, with consumers waiting on a condition
+ *  variable: the scheme workers used before the lock-free queue.
+ */
+class LockedQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<long long> items;
+    bool done;
+  public:
+    LockedQueue() : items(), done(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+    }
+    ~LockedQueue() {
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+    }
+    bool push(long long item) {
+	pthread_mutex_lock(&mutex);
+	bool ok = (items.size() < CAPACITY);
+	if (ok) {
+	    items.push_back(item);
+	    pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return ok;
+    }
+    bool pop(long long & item) {
+	pthread_mutex_lock(&mutex);
+	while (items.empty() && !done)
+	    pthread_cond_wait(&cond, &mutex);
+	bool ok = !items.empty();
+	if (ok) {
+	    item = items.front();
+	    items.pop_front();
+	}
+	pthread_mutex_unlock(&mutex);
+	return ok;
+    }
+    void finish() {
+	pthread_mutex_lock(&mutex);
+	done = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+    }
+};
+
+/** The lock-free queue, with consumers parked on an EventCount.
+ */
+class LockFreeQueue {
+    MpmcQueue<long long> items;
+    EventCount events;
+    volatile int done;
+  public:
+    LockFreeQueue() : items(CAPACITY), events(), done(0) {}
+    bool push(long long item) {
+	if (!items.push(item))
+	    return false;
+	events.notify_one();
+	return true;
+    }
+    bool pop(long long & item) {
+	while (true) {
+	    if (items.pop(item))
+		return true;
+	    if (done)
+		return items.pop(item);
+	    unsigned int key = events.prepare_wait();
+	    if (!items.empty() || done) {
+		events.cancel_wait();
+		continue;
+	    }
+	    (void) events.wait(key, 0);
+	}
+    }
+    void finish() {
+	__sync_synchronize();
+	done = 1;
+	events.notify_all();
+    }
+};
+
+/// The totals for a consumer, padded to avoid sharing cache lines.
+struct Consumer {
+    void * queue;
+    long long count;
+    long long total_latency;
+    long long max_latency;
+    char padding[64];
+};
+
+template<class Queue>
+static void *
+consume(void * arg)
+{
+    Consumer * consumer = static_cast<Consumer *>(arg);
+    Queue * queue = static_cast<Queue *>(consumer->queue);
+    long long sent = 0;
+    while (queue->pop(sent)) {
+	long long latency = now_nsec() - sent;
+	++consumer->count;
+	consumer->total_latency += latency;
+	if (latency > consumer->max_latency)
+	    consumer->max_latency = latency;
+    }
+    return NULL;
+}
+
+/// Hand a number of items from this thread to a number of consumers.
+template<class Queue>
+static void
+bench_queue(const char * name, int threads, int messages)
+{
+    Queue queue;
+    std::vector<pthread_t> ids(threads);
+    std::vector<Consumer> consumers(threads);
+    for (int i = 0; i != threads; ++i) {
+	consumers[i].queue = &queue;
+	consumers[i].count = 0;
+	consumers[i].total_latency = 0;
+	consumers[i].max_latency = 0;
+	pthread_create(&ids[i], NULL, consume<Queue>, &consumers[i]);
+    }
+    long long start = now_nsec();
+    for (int i = 0; i != messages; ++i) {
+	while (!queue.push(now_nsec()))
+	    sched_yield();
+    }
+    queue.finish();
+    long long count = 0, total_latency = 0, max_latency = 0;
+    for (int i = 0; i != threads; ++i) {
+	pthread_join(ids[i], NULL);
+	count += consumers[i].count;
+	total_latency += consumers[i].total_latency;
+	if (consumers[i].max_latency > max_latency)
+	    max_latency = consumers[i].max_latency;
+    }
+    double elapsed = (now_nsec() - start) * 1e-9;
+    printf("%-9s %2d threads: %9.0f msgs/s, handoff mean %8.1f us, "
+	   "max %8.1f us\n", name, threads, count / elapsed,
+	   total_latency * 1e-3 / count, max_latency * 1e-3);
+}
+
+int main(int argc, char ** argv) {
+    int messages = 100000;
+    if (argc > 1)
+	messages = atoi(argv[1]);
+    for (int threads = 1; threads <= 64; threads *= 2) {
+	bench_queue<LockedQueue>("mutex", threads, messages);
+	bench_queue<LockFreeQueue>("lock-free", threads, messages);
+    }
+    return 0;
+}
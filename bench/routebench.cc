@@ -0,0 +1,160 @@
+/** @file routebench.cc
+ * @brief Benchmark matching of message targets against the route table.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "server/router.h"
+#include <string>
+#include <sys/time.h>
+#include <vector>
+
+/// The shape of the route table used by the xappy dispatcher.
+static const RouteSpec base_routes[] = {
+    { 'G', "version", 0 },
+    { 'C', "{msgid}", 1 },
+    { 'G', "db/{name}", 2 },
+    { 'G', "db/{name}/_schema", 2 },
+    { 'G', "db/{name}/{type}/{docid}", 2 },
+    { 'U', "db/{name}/_schema", 3 },
+    { 'U', "db/{name}/{type}/{docid}", 3 },
+    { 'P', "db/{name}/{type}/", 3 },
+    { 'D', "db/{name}/{type}/{docid}", 3 },
+};
+
+/// Targets to match, including the method character.
+static const char * targets[] = {
+    "Gversion",
+    "Gdb/products/_schema",
+    "Gdb/products/default/12345",
+    "Udb/products/default/12345",
+    "Pdb/products/default/",
+    "Gdb/products/_endpoint37",
+    "Gdb/products/missing/1/2",
+};
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// The routing previously used: split the path, then compare components.
+static int
+legacy_route(const std::string & target)
+{
+    std::string path = target.substr(1);
+    std::vector<std::string> components;
+    std::string::size_type i = 0, j;
+    while (true) {
+	j = path.find('/', i);
+	if (j == path.npos) {
+	    components.push_back(path.substr(i));
+	    break;
+	}
+	components.push_back(path.substr(i, j - i));
+	i = j + 1;
+    }
+    switch (target[0]) {
+	case 'G':
+	    if (path == "version")
+		return 0;
+	    if (components.size() >= 2 && components[0] == "db")
+		return 2;
+	    break;
+	case 'U':
+	    if (components.size() >= 2 && components[0] == "db")
+		return 3;
+	    break;
+    }
+    return -1;
+}
+
+/** Time matching the targets with a route table padded with `extra`
+ *  additional endpoints.
+ */
+static void
+bench_router(int extra, int iterations)
+{
+    Router router;
+    router.add(base_routes, sizeof(base_routes) / sizeof(base_routes[0]));
+    std::vector<std::string> patterns;
+    for (int i = 0; i != extra; ++i) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "db/{name}/_endpoint%d", i);
+	patterns.push_back(buf);
+    }
+    for (int i = 0; i != extra; ++i) {
+	RouteSpec spec = { 'G', patterns[i].c_str(), 100 + i };
+	router.add(spec);
+    }
+
+    size_t ntargets = sizeof(targets) / sizeof(targets[0]);
+    std::vector<std::string> strs(targets, targets + ntargets);
+    int found = 0;
+    double start = now();
+    for (int n = 0; n != iterations; ++n) {
+	for (size_t i = 0; i != ntargets; ++i) {
+	    RouteMatch match;
+	    if (router.match(strs[i][0], strs[i], 1, match))
+		found += match.route_id;
+	}
+    }
+    double elapsed = now() - start;
+    printf("router, %3d extra routes: %7.1f ns/match (%d)\n", extra,
+	   elapsed * 1e9 / (double(iterations) * ntargets), found);
+}
+
+static void
+bench_legacy(int iterations)
+{
+    size_t ntargets = sizeof(targets) / sizeof(targets[0]);
+    std::vector<std::string> strs(targets, targets + ntargets);
+    int found = 0;
+    double start = now();
+    for (int n = 0; n != iterations; ++n) {
+	for (size_t i = 0; i != ntargets; ++i) {
+	    found += legacy_route(strs[i]);
+	}
+    }
+    double elapsed = now() - start;
+    printf("split_target and switch:    %7.1f ns/match (%d)\n",
+	   elapsed * 1e9 / (double(iterations) * ntargets), found);
+}
+
+int main(int argc, char ** argv) {
+    int iterations = 1000000;
+    if (argc > 1)
+	iterations = atoi(argv[1]);
+    bench_legacy(iterations);
+    bench_router(0, iterations);
+    bench_router(10, iterations);
+    bench_router(50, iterations);
+    bench_router(200, iterations);
+    return 0;
+}
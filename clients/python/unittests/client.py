@@ -29,6 +29,43 @@ class TestClient(unittest.TestCase):
         c = xaprun.Client(timeout=5)
         self.assertEqual(c.version(), '0.1')
 
+    def test_stats(self):
+        c = xaprun.Client(timeout=5)
+        stats = c.stats()
+        self.assertTrue('reads_in_flight' in stats)
+        self.assertTrue('ok' not in stats)
+
+    def test_coalesced_reads(self):
+        c = xaprun.LocalConnection()
+        r = []
+        def cb(result):
+            r.append(result)
+        # Send both reads in one write, so that the second arrives while the
+        # first is still being handled.
+        written = []
+        c._write = written.append
+        c.send(c.GET, 'db/foo', 'same', cb)
+        c.send(c.GET, 'db/foo', 'same', cb)
+        del c._write
+        c._write(''.join(written))
+        for i in range(10):
+            if len(r) == 2:
+                break
+            c.check(1.0)
+        self.assertEqual(r, [{'ok': 1, 'msg': 'same'}] * 2)
+        self.assertEqual(c.pending, {})
+        stats = c.sendwait(c.GET, 'stats', '')
+        self.assertEqual(stats['reads_executed'], 1)
+        self.assertEqual(stats['reads_coalesced'], 1)
+
+    def test_queue_stats(self):
+        c = xaprun.Client(timeout=5)
+        c._get(c.db('test1').qname)
+        stats = c.stats()
+        wait = stats['queue_wait_us']
+        self.assertTrue(wait['count'] >= 1)
+        self.assertTrue(wait['p50'] <= wait['p99'] <= wait['max'])
+
     def test_insert(self):
         c = xaprun.Client(timeout=5)
         db = c.db('test1')
@@ -43,3 +43,101 @@ class TestConnections(unittest.TestCase):
         c = xaprun.LocalConnection()
         self.assertEqual(c.sendwait(c.GET, 'version', ''),
                          {'msg': '0.1', 'ok': 1})
+
+    def test_qos(self):
+        c = xaprun.LocalConnection()
+        for qos in (c.INTERACTIVE, c.NORMAL, c.BATCH):
+            self.assertEqual(c.sendwait(c.GET, 'version', '', qos=qos),
+                             {'msg': '0.1', 'ok': 1})
+
+    def test_deadline(self):
+        c = xaprun.LocalConnection()
+        # A read which is handled in time is answered as usual.
+        self.assertEqual(c.sendwait(c.GET, 'db/foo', 'hello', deadline=5000),
+                         {'ok': 1, 'msg': 'hello'})
+
+        # A deadline of 0 has passed by the time a worker takes the read.
+        self.assertEqual(c.sendwait(c.GET, 'db/foo', 'late', deadline=0),
+                         {'ok': 0, 'msg': 'Deadline exceeded'})
+
+        stats = c.sendwait(c.GET, 'stats', '')
+        self.assertEqual(stats['messages_expired'], 1)
+
+    def test_compression(self):
+        c = xaprun.LocalConnection()
+        self.assertEqual(c.enable_compression(),
+                         {'ok': 1, 'encoding': 'deflate'})
+
+        # The search worker echoes the payload of reads, so the request and
+        # the response are both large enough to be compressed.
+        payload = 'compressible ' * 400
+        self.assertEqual(c.sendwait(c.GET, 'db/foo', payload),
+                         {'ok': 1, 'msg': payload})
+
+        # Small responses are sent uncompressed.
+        self.assertEqual(c.sendwait(c.GET, 'version', ''),
+                         {'msg': '0.1', 'ok': 1})
+
+        # Payloads may not decompress to more than the stream threshold.
+        self.assertEqual(c.sendwait(c.GET, 'db/foo', ' ' * (2 << 20)),
+                         {'ok': 0, 'msg': 'Message too large'})
+
+        stats = c.sendwait(c.GET, 'stats', '')
+        self.assertEqual(stats['compressed_responses'], 1)
+        self.assertEqual(stats['decompressed_requests'], 1)
+        self.assertTrue(stats['compress_bytes_out'] <
+                        stats['compress_bytes_in'])
+
+    def test_cancel(self):
+        c = xaprun.LocalConnection()
+        r = []
+        def cb(result):
+            r.append(result)
+        cancelled = []
+        def cancel_cb(result):
+            cancelled.append(result)
+        msgid = c.send(c.GET, 'version', '', cb)
+        c.cancel(msgid, cancel_cb)
+        c.check(1.0)
+        c.check(1.0)
+
+        # The version request is handled immediately, so there's nothing left
+        # to cancel, but the callback for it is not called.
+        self.assertEqual(r, [])
+        self.assertEqual(cancelled, [{'ok': 1, 'cancelled': 'none'}])
+        self.assertEqual(c.pending, {})
+
+    def test_routes(self):
+        c = xaprun.LocalConnection()
+        # Reads of a document are routed to a search worker, which echoes
+        # the payload.
+        self.assertEqual(c.sendwait(c.GET, 'db/foo/doc/1', 'hello'),
+                         {'ok': 1, 'msg': 'hello'})
+
+        # The id of the message to cancel is captured from the target: send
+        # two identical reads and the cancellation together, so that the
+        # second read is still waiting for the first when it is cancelled.
+        r = []
+        def cb(result):
+            r.append(result)
+        cancelled = []
+        written = []
+        c._write = written.append
+        c.send(c.GET, 'db/foo', 'same', cb)
+        msgid = c.send(c.GET, 'db/foo', 'same', cb)
+        c.cancel(msgid, cancelled.append)
+        del c._write
+        c._write(''.join(written))
+        for i in range(10):
+            if r and cancelled:
+                break
+            c.check(1.0)
+        self.assertEqual(r, [{'ok': 1, 'msg': 'same'}])
+        self.assertEqual(cancelled, [{'ok': 1, 'cancelled': 'queued'}])
+
+        # Targets which don't match a route aren't found, even if they are
+        # in a database.
+        self.assertEqual(c.sendwait(c.GET, 'db/foo/_search', ''),
+                         {'ok': 0, 'msg': 'Not found'})
+        self.assertEqual(c.sendwait(c.GET, 'nothing', ''),
+                         {'ok': 0, 'msg': 'Not found'})
@@ -67,7 +67,7 @@ g_def_connection = None
 g_def_connection_mutex = threading.Lock()
 
 class Client(object):
-    def __init__(self, conn=None, timeout=None):
+    def __init__(self, conn=None, timeout=None, qos=None):
         """Create a client.
 
         - `conn` must be a valid connection to xaprun, or None to use a
@@ -77,6 +77,12 @@ class Client(object):
         - `timeout` is the timeout, in seconds, used for all accesses to
           xaprun.  This may be set to None to wait indefinitely.
 
+        - `qos` is the priority class used for all requests made by this
+          client (one of the Connection.INTERACTIVE, Connection.NORMAL or
+          Connection.BATCH values), or None to use the server's default.
+          Clients doing bulk work should use Connection.BATCH, so that they
+          don't delay interactive requests.
+
         """
         if conn is None:
             global g_def_connection_mutex
@@ -90,14 +96,15 @@ class Client(object):
                 g_def_connection_mutex.release()
         self.conn = conn
         self.timeout = timeout
+        self.qos = qos
 
     def _get(self, target):
         return check(self.conn.sendwait(self.conn.GET, target, '',
-                                        self.timeout))
+                                        self.timeout, self.qos))
 
     def _put(self, target, payload):
         return check(self.conn.sendwait(self.conn.PUT, target, payload,
-                                        self.timeout))
+                                        self.timeout, self.qos))
 
     def _putj(self, target, payload):
         payload = jsondumps(payload)
@@ -105,19 +112,27 @@ class Client(object):
 
     def _post(self, target, payload):
         return check(self.conn.sendwait(self.conn.POST, target, payload,
-                                        self.timeout))
+                                        self.timeout, self.qos))
 
     def _postj(self, target, payload):
         return self._post(target, jsondumps(payload))
 
     def _delete(self, target):
         return check(self.conn.sendwait(self.conn.DELETE, target, '',
-                                        self.timeout))
+                                        self.timeout, self.qos))
 
     def version(self):
         r = self._get('version')
         return item_from_response(r, 'msg')
 
+    def stats(self):
+        """Get a dict of statistics about the server.
+
+        """
+        r = self._get('stats')
+        del r['ok']
+        return r
+
     def db(self, dbname):
         return Database(self, dbname)
 
@@ -151,7 +166,7 @@ class Database(object):
         call.
 
         """
-        if docid:
+        if not docid:
             target = self.qname + '/' + quote(type) + '/'
             r = self.client._postj(target, doc)
         else:
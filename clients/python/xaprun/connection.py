@@ -26,6 +26,7 @@ import select
 import subprocess
 import time
 import threading
+import zlib
 
 from utils import json, locked
 
@@ -43,6 +44,7 @@ class Connection(object):
     POST = 'P'
     PUT = 'U'
     DELETE = 'D'
+    CANCEL = 'C'
 
     def __init__(self):
         # Lock to be held whenever accessing the connection.
@@ -64,10 +66,20 @@ class Connection(object):
         # This is set this to True when closed.
         self.closed = False
 
+        # The size at or above which payloads sent are compressed, or None
+        # if compression isn't enabled.
+        self.compress_threshold = None
+
     def __del__(self):
         self.close()
 
-    def sendwait(self, method, target, payload, timeout=None):
+    # Priority classes for messages.
+    INTERACTIVE = 'interactive'
+    NORMAL = 'normal'
+    BATCH = 'batch'
+
+    def sendwait(self, method, target, payload, timeout=None, qos=None,
+                 deadline=None):
         """Send a message, wait for a result, and return it.
 
         The method should be one of Connection.GET, Connection.POST,
@@ -77,20 +89,55 @@ class Connection(object):
         contain any spaces.
 
         Timeout is the number of seconds to wait, or None to wait indefinitely
-        for the response.
+        for the response.  If the timeout is reached, the message is cancelled
+        and an error response is returned.
+
+        `qos` is the priority class of the message - one of
+        Connection.INTERACTIVE, Connection.NORMAL or Connection.BATCH, or None
+        to use the server's default.
+
+        `deadline` is the number of milliseconds from when the message
+        reaches the server by which it must be handled, or None for no
+        deadline.  If a worker isn't free to handle it in time, an error
+        response is returned instead.
 
         """
         r = []
         def cb(result):
             r.append(result)
-        self.send(method, target, payload, cb)
+        msgid = self.send(method, target, payload, cb, qos, deadline)
+        if timeout is None:
+            endtime = None
+        else:
+            endtime = time.time() + timeout
         while True:
-            self.check(timeout)
+            if endtime is None:
+                self.check(None)
+            else:
+                self.check(max(0.0, endtime - time.time()))
             if len(r) != 0:
                 return r[0]
+            if endtime is not None and time.time() >= endtime:
+                self.cancel(msgid)
+                return {'ok': 0, 'msg': 'Timed out waiting for response'}
+
+    def enable_compression(self, threshold=1024):
+        """Enable compression of messages on the connection.
+
+        The server is asked to compress large responses, and payloads of at
+        least `threshold` bytes are compressed before being sent.
+
+        Returns the server's response.
+
+        """
+        result = self.sendwait(self.PUT, 'encoding', 'deflate')
+        if result.get('ok'):
+            self.compress_threshold = threshold
+        return result
 
     @locked
-    def send(self, method, target, payload, callback):
+    def send(self, method, target, payload, callback, qos=None,
+             deadline=None):
         """Send a message.
 
         The method should be one of Connection.GET, Connection.POST,
@@ -99,8 +146,13 @@ class Connection(object):
         The target should be url quoted (eg, with urllib.quote), and must not
         contain any spaces.
 
+        `qos` is the priority class of the message, and `deadline` the
+        milliseconds by which it must be handled (see sendwait()).
+
         This method may block while waiting for data to be sent to the server.
 
+        Returns the id of the message, which may be passed to cancel().
+
         """
         if self.closed:
             callback({'ok': 0, 'msg': 'Connection closed'})
@@ -108,10 +160,50 @@ class Connection(object):
         assert method in 'GPUD' and len(method) == 1
         assert ' ' not in target
         msgid = str(self.next_id)
-        msg = msgid + " " + method + target + " " + payload
+        header = msgid
+        if qos is not None:
+            assert qos in (self.INTERACTIVE, self.NORMAL, self.BATCH)
+            header += ";qos=" + qos
+        if deadline is not None:
+            assert deadline >= 0
+            header += ";deadline=%d" % deadline
+        if self.compress_threshold is not None and \
+           len(payload) >= self.compress_threshold:
+            compressed = zlib.compress(payload)
+            if len(compressed) < len(payload):
+                header += ";enc=deflate"
+                payload = compressed
+        msg = header + " " + method + target + " " + payload
         self.pending[msgid] = callback
         self.next_id += 1
         self._write(str(len(msg)) + " " + msg)
+        return msgid
+
+    @locked
+    def cancel(self, msgid, callback=None):
+        """Cancel a message sent earlier.
+
+        The callback for the message will not be called.  Once the server has
+        acknowledged the cancellation, `callback` (if supplied) will be called
+        with the server's response, in which the 'cancelled' item says what
+        was cancelled ('queued', 'running', or 'none' if the message had
+        already been handled).
+
+        """
+        if self.closed or msgid not in self.pending:
+            return
+        # Keep a placeholder for the message until the cancellation is
+        # acknowledged, since a response may already be on its way.
+        self.pending[msgid] = lambda result: None
+        def cb(result):
+            self.pending.pop(msgid, None)
+            if callback is not None:
+                callback(result)
+        cancelid = str(self.next_id)
+        msg = cancelid + " " + self.CANCEL + msgid + " "
+        self.pending[cancelid] = cb
+        self.next_id += 1
+        self._write(str(len(msg)) + " " + msg)
 
     @locked
     def check(self, timeout=0.0):
@@ -189,12 +281,22 @@ class Connection(object):
             self._failed("Invalid response message - no message id")
         msgid = buf[:i]
         buf = buf[i + 1:]
+        options = msgid.split(';')
+        msgid = options[0]
+        encoding = None
+        for option in options[1:]:
+            if option.startswith('enc='):
+                encoding = option[4:]
         cb = self.pending.get(msgid, None)
         if cb is None:
             self._failed("Response for unknown message id (%r)" % msgid)
         del self.pending[msgid]
         response = ''
         try:
+            if len(buf) > 0 and encoding is not None:
+                if encoding != 'deflate':
+                    raise ValueError("Unknown encoding")
+                buf = buf[0] + zlib.decompress(buf[1:])
             if len(buf) > 0:
                 if buf[0] == 'S':
                     response = {'ok': 1, 'msg': buf[1:]}
@@ -204,6 +306,8 @@ class Connection(object):
                     response = json.loads(buf[1:])
                 elif buf[0] == 'F':
                     response = json.loads(buf[1:])
+                elif buf[0] == 'O':
+                    response = json.loads(buf[1:])
                 else:
                     response = {'ok': 0,
                         'msg': "Unknown response type code (%r)" % buf[0]}
@@ -26,18 +26,27 @@
 #include <config.h>
 
 #include "server/server.h"
+#include "server/supervisor.h"
 #include "settings.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include "xappy/dispatch.h"
 
-int main(int argc, char ** argv) {
-    ServerSettings settings;
-    int args_err = settings.parse_args(argc, argv);
-    if (args_err != -1) return args_err;
+static int run_server(const ServerSettings & settings) {
     XappyDispatcher dispatcher;
     Server server(settings, &dispatcher);
     if (server.run()) return 0;
     fprintf(stderr, "%s\n", server.get_error_message().c_str());
     return 1;
 }
+
+int main(int argc, char ** argv) {
+    ServerSettings settings;
+    int args_err = settings.parse_args(argc, argv);
+    if (args_err != -1) return args_err;
+    if (settings.processes > 0) {
+	Supervisor supervisor(settings, run_server);
+	return supervisor.run();
+    }
+    return run_server(settings);
+}
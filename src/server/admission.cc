@@ -0,0 +1,75 @@
+/** @file admission.cc
+ * @brief Admission control for groups of workers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "admission.h"
+
+#include <algorithm>
+
+/// The shortest interval over which waits are compared to the target, in
+/// microseconds.  This is CoDel's default, and should be longer than the
+/// time a burst of messages normally takes to clear.
+#define ADMISSION_MIN_INTERVAL_USEC 100000
+
+/// The number of target delays in an interval, for long targets.
+#define ADMISSION_INTERVAL_TARGETS 10
+
+AdmissionControl::AdmissionControl()
+	: target(0),
+	  interval(ADMISSION_MIN_INTERVAL_USEC),
+	  interval_end(0),
+	  overloaded(false),
+	  standing_delay(0)
+{
+}
+
+void
+AdmissionControl::set_target(long long target_usec)
+{
+    target = target_usec;
+    interval = std::max(ADMISSION_INTERVAL_TARGETS * target,
+			(long long) ADMISSION_MIN_INTERVAL_USEC);
+}
+
+bool
+AdmissionControl::update(long long now, long long min_wait, bool backlogged)
+{
+    // If no worker took a message all interval, any message still waiting
+    // has waited at least that long.
+    if (min_wait < 0)
+	min_wait = backlogged ? interval : 0;
+    standing_delay = min_wait;
+    interval_end = now + interval;
+
+    bool was_overloaded = overloaded;
+    overloaded = min_wait > target;
+    return overloaded != was_overloaded;
+}
+
+long long
+AdmissionControl::retry_after() const
+{
+    return std::max(standing_delay, interval);
+}
@@ -0,0 +1,103 @@
+/** @file admission.h
+ * @brief Admission control for groups of workers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_ADMISSION_H
+#define XAPSRV_INCLUDED_ADMISSION_H
+
+/** Decides when a group of workers is overloaded, from the time messages
+ *  spend queued for it.
+ *
+ *  This follows CoDel: a queue is only overloaded if even the message which
+ *  waited least in an interval waited longer than the target delay.  Bursts
+ *  which the workers clear within an interval leave some message with a
+ *  short wait, so aren't mistaken for overload, while a standing queue,
+ *  which every message waits behind, is detected within an interval.
+ *
+ *  The group stays overloaded until an interval in which some message
+ *  waited less than the target.
+ *
+ *  This is only used by the main server thread.
+ */
+class AdmissionControl {
+    /// The target delay, in microseconds, or 0 if disabled.
+    long long target;
+
+    /// The length of each interval, in microseconds.
+    long long interval;
+
+    /// The time the current interval ends, from get_monotonic_usec().
+    long long interval_end;
+
+    /// Flag, set to true while the group is overloaded.
+    bool overloaded;
+
+    /// The shortest wait in the last interval, in microseconds.
+    long long standing_delay;
+
+  public:
+    AdmissionControl();
+
+    /** Set the target delay.
+     *
+     *  @param target_usec The target, in microseconds, or 0 to disable
+     *  admission control.
+     */
+    void set_target(long long target_usec);
+
+    /// Check whether admission control is enabled.
+    bool enabled() const { return target != 0; }
+
+    /// Check whether the current interval has ended.
+    bool due(long long now) const { return now >= interval_end; }
+
+    /** Start a new interval, given the waits in the one which ended.
+     *
+     *  @param now The current time, from get_monotonic_usec().
+     *  @param min_wait The shortest time a message waited to be taken by a
+     *  worker in the interval, in microseconds, or -1 if no message was
+     *  taken.
+     *  @param backlogged True if messages are waiting with no worker about
+     *  to take them.
+     *
+     *  @retval true if the group became, or stopped being, overloaded.
+     */
+    bool update(long long now, long long min_wait, bool backlogged);
+
+    /// Check whether the group is overloaded.
+    bool is_overloaded() const { return overloaded; }
+
+    /// Get the shortest wait in the last interval, in microseconds.
+    long long get_standing_delay() const { return standing_delay; }
+
+    /** Get the time clients should wait before retrying rejected messages,
+     *  in microseconds.
+     *
+     *  This is the time the queue needs to drain, judging by the standing
+     *  delay, and at least one interval.
+     */
+    long long retry_after() const;
+};
+
+#endif /* XAPSRV_INCLUDED_ADMISSION_H */
@@ -0,0 +1,117 @@
+/** @file arena.cc
+ * @brief A per-worker allocator for memory used while handling a message.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "arena.h"
+
+#include <stdlib.h>
+
+/// The size of each block of an arena, including its header.
+#define ARENA_BLOCK_SIZE 65536
+
+Arena::Arena()
+	: first(NULL),
+	  current(NULL),
+	  pos(NULL),
+	  end(NULL),
+	  oversized(),
+	  used(0),
+	  allocations(0),
+	  heap_allocations(0),
+	  high_water(0)
+{
+}
+
+Arena::~Arena()
+{
+    reset();
+    while (first != NULL) {
+	Block * next = first->next;
+	free(first);
+	first = next;
+    }
+}
+
+void
+Arena::next_block()
+{
+    Block * block = (current == NULL) ? first : current->next;
+    if (block == NULL) {
+	block = static_cast<Block *>(malloc(ARENA_BLOCK_SIZE));
+	if (block == NULL)
+	    throw std::bad_alloc();
+	block->next = NULL;
+	block->size = ARENA_BLOCK_SIZE - sizeof(Block);
+	if (current == NULL) {
+	    first = block;
+	} else {
+	    current->next = block;
+	}
+    }
+    current = block;
+    pos = reinterpret_cast<char *>(block + 1);
+    end = pos + block->size;
+}
+
+void *
+Arena::allocate_slow(size_t size)
+{
+    if (size > (ARENA_BLOCK_SIZE - sizeof(Block)) / 4) {
+	// Large allocations would waste most of a block, so they come from
+	// the heap.
+	void * result = malloc(size);
+	if (result == NULL)
+	    throw std::bad_alloc();
+	oversized.push_back(result);
+	++heap_allocations;
+	return result;
+    }
+    next_block();
+    void * result = pos;
+    pos += size;
+    return result;
+}
+
+void
+Arena::reset()
+{
+    if (used > high_water)
+	high_water = used;
+    for (std::vector<void *>::const_iterator i = oversized.begin();
+	 i != oversized.end(); ++i) {
+	free(*i);
+    }
+    oversized.clear();
+    current = first;
+    if (first != NULL) {
+	pos = reinterpret_cast<char *>(first + 1);
+	end = pos + first->size;
+    } else {
+	pos = end = NULL;
+    }
+    used = 0;
+    allocations = 0;
+    heap_allocations = 0;
+}
@@ -0,0 +1,202 @@
+/** @file arena.h
+ * @brief A per-worker allocator for memory used while handling a message.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_ARENA_H
+#define XAPSRV_INCLUDED_ARENA_H
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+
+/** Memory for the temporaries used while a worker handles a message.
+ *
+ *  Allocating bumps a pointer through a block of memory, and freeing does
+ *  nothing: everything is released at once by reset(), which each worker
+ *  calls when it finishes a message.  Blocks are kept for the next message
+ *  rather than being returned to the heap, so a worker which has warmed up
+ *  handles a message without touching the global allocator, and never
+ *  contends for it with other workers.
+ *
+ *  Allocations larger than a quarter of a block come from the heap instead,
+ *  and are freed by reset().
+ *
+ *  An arena must only be used by one thread.
+ */
+class Arena {
+    /// A block of memory which allocations are carved from.
+    struct Block {
+	/// The next block, used once this one is full.
+	Block * next;
+
+	/// The number of bytes of memory following the header.
+	size_t size;
+    };
+
+    /// The first block, or NULL if none has been allocated yet.
+    Block * first;
+
+    /// The block allocations are currently taken from.
+    Block * current;
+
+    /// The next free byte in the current block.
+    char * pos;
+
+    /// The end of the current block.
+    char * end;
+
+    /// Allocations which were too large for a block, freed by reset().
+    std::vector<void *> oversized;
+
+    /// The number of bytes allocated since the last reset.
+    size_t used;
+
+    /// The number of allocations since the last reset.
+    size_t allocations;
+
+    /// The number of allocations since the last reset which came from the
+    /// heap because they were too large.
+    size_t heap_allocations;
+
+    /// The most bytes allocated between two resets.
+    size_t high_water;
+
+    /// Move on to the next block, allocating it if necessary.
+    void next_block();
+
+    /// Allocate memory which doesn't fit in the current block.
+    void * allocate_slow(size_t size);
+
+    // Don't allow copying or assignment.
+    Arena(const Arena & other);
+    void operator=(const Arena & other);
+  public:
+    Arena();
+    ~Arena();
+
+    /** Allocate memory.
+     *
+     *  The memory is aligned suitably for any type, and stays valid until
+     *  the next reset().
+     *
+     *  @throws std::bad_alloc if no memory is available.
+     */
+    void * allocate(size_t size) {
+	size = (size + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1);
+	++allocations;
+	used += size;
+	if (size > size_t(end - pos))
+	    return allocate_slow(size);
+	void * result = pos;
+	pos += size;
+	return result;
+    }
+
+    /** Release everything allocated since the last reset.
+     *
+     *  This only frees memory which was too large for a block, so it
+     *  takes constant time unless such memory was allocated.
+     */
+    void reset();
+
+    /// Get the number of bytes allocated since the last reset.
+    size_t get_used() const { return used; }
+
+    /// Get the number of allocations since the last reset.
+    size_t get_allocations() const { return allocations; }
+
+    /// Get the number of allocations since the last reset which were too
+    /// large for a block, and came from the heap.
+    size_t get_heap_allocations() const { return heap_allocations; }
+
+    /// Get the most bytes allocated between two resets, including since the
+    /// last one.
+    size_t get_high_water() const {
+	return used > high_water ? used : high_water;
+    }
+};
+
+/** An allocator for standard containers which takes memory from an Arena.
+ *
+ *  Containers using it must not outlive the arena's next reset.
+ */
+template<class T>
+class ArenaAllocator {
+    template<class U> friend class ArenaAllocator;
+
+    Arena * arena;
+  public:
+    typedef T value_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template<class U> struct rebind {
+	typedef ArenaAllocator<U> other;
+    };
+
+    explicit ArenaAllocator(Arena & arena_) : arena(&arena_) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U> & other) : arena(other.arena) {}
+
+    pointer address(reference value) const { return &value; }
+    const_pointer address(const_reference value) const { return &value; }
+
+    pointer allocate(size_type n, const void * = 0) {
+	if (n > max_size())
+	    throw std::bad_alloc();
+	return static_cast<pointer>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer, size_type) {}
+
+    size_type max_size() const {
+	return std::numeric_limits<size_type>::max() / sizeof(T);
+    }
+
+    void construct(pointer p, const T & value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U> & other) const {
+	return arena == other.arena;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U> & other) const {
+	return arena != other.arena;
+    }
+};
+
+/// A string whose memory comes from an Arena.
+typedef std::basic_string<char, std::char_traits<char>,
+			  ArenaAllocator<char> > ArenaString;
+
+#endif /* XAPSRV_INCLUDED_ARENA_H */
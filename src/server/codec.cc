@@ -0,0 +1,196 @@
+/** @file codec.cc
+ * @brief Codecs for compressing payloads.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "codec.h"
+
+#include <map>
+#include <pthread.h>
+#include <zlib.h>
+
+Codec::~Codec()
+{
+}
+
+/** A codec for the "deflate" encoding: zlib format data (as for HTTP).
+ */
+class DeflateCodec : public Codec {
+    /// The zlib stream used for compression.
+    z_stream deflater;
+
+    /// The zlib stream used for decompression.
+    z_stream inflater;
+
+    /// Flag, set to true when deflater has been initialised.
+    bool deflater_ready;
+
+    /// Flag, set to true when inflater has been initialised.
+    bool inflater_ready;
+
+  public:
+    DeflateCodec();
+    ~DeflateCodec();
+
+    const char * name() const { return "deflate"; }
+    bool compress(const std::string & input, std::string & output);
+    bool decompress(const std::string & input, std::string & output,
+		    size_t max_size);
+};
+
+DeflateCodec::DeflateCodec()
+	: deflater_ready(false), inflater_ready(false)
+{
+}
+
+DeflateCodec::~DeflateCodec()
+{
+    if (deflater_ready)
+	deflateEnd(&deflater);
+    if (inflater_ready)
+	inflateEnd(&inflater);
+}
+
+bool
+DeflateCodec::compress(const std::string & input, std::string & output)
+{
+    // The stream is set up on first use, and reset for later uses, so that
+    // its buffers are only allocated once.
+    if (deflater_ready) {
+	if (deflateReset(&deflater) != Z_OK)
+	    return false;
+    } else {
+	deflater.zalloc = Z_NULL;
+	deflater.zfree = Z_NULL;
+	deflater.opaque = Z_NULL;
+	if (deflateInit(&deflater, Z_DEFAULT_COMPRESSION) != Z_OK)
+	    return false;
+	deflater_ready = true;
+    }
+
+    output.resize(deflateBound(&deflater, input.size()));
+    deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    deflater.avail_in = input.size();
+    deflater.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    deflater.avail_out = output.size();
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+	return false;
+    output.resize(output.size() - deflater.avail_out);
+    return true;
+}
+
+bool
+DeflateCodec::decompress(const std::string & input, std::string & output,
+			 size_t max_size)
+{
+    if (inflater_ready) {
+	if (inflateReset(&inflater) != Z_OK)
+	    return false;
+    } else {
+	inflater.zalloc = Z_NULL;
+	inflater.zfree = Z_NULL;
+	inflater.opaque = Z_NULL;
+	inflater.next_in = Z_NULL;
+	inflater.avail_in = 0;
+	if (inflateInit(&inflater) != Z_OK)
+	    return false;
+	inflater_ready = true;
+    }
+
+    output.clear();
+    inflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    inflater.avail_in = input.size();
+    char buf[16384];
+    while (true) {
+	inflater.next_out = reinterpret_cast<Bytef *>(buf);
+	inflater.avail_out = sizeof(buf);
+	int ret = inflate(&inflater, Z_NO_FLUSH);
+	if (ret != Z_OK && ret != Z_STREAM_END)
+	    return false;
+	size_t produced = sizeof(buf) - inflater.avail_out;
+	output.append(buf, produced);
+	if (output.size() > max_size)
+	    return false;
+	if (ret == Z_STREAM_END)
+	    return inflater.avail_in == 0;
+	if (produced == 0 && inflater.avail_in == 0) {
+	    // The input ended before the end of the compressed data.
+	    return false;
+	}
+    }
+}
+
+/// Key for the codecs belonging to each thread.
+static pthread_key_t codecs_key;
+
+/// Control for creating codecs_key.
+static pthread_once_t codecs_key_once = PTHREAD_ONCE_INIT;
+
+/// Delete the codecs belonging to a thread, when it exits.
+static void
+delete_codecs(void * ptr)
+{
+    std::map<std::string, Codec *> * codecs =
+	    static_cast<std::map<std::string, Codec *> *>(ptr);
+    std::map<std::string, Codec *>::iterator i;
+    for (i = codecs->begin(); i != codecs->end(); ++i) {
+	delete i->second;
+    }
+    delete codecs;
+}
+
+static void
+create_codecs_key()
+{
+    (void) pthread_key_create(&codecs_key, delete_codecs);
+}
+
+/// Create a new instance of the codec for an encoding.
+static Codec *
+new_codec(const std::string & name)
+{
+    if (name == "deflate")
+	return new DeflateCodec;
+    return NULL;
+}
+
+Codec *
+get_codec(const std::string & name)
+{
+    (void) pthread_once(&codecs_key_once, create_codecs_key);
+    std::map<std::string, Codec *> * codecs =
+	    static_cast<std::map<std::string, Codec *> *>(
+		pthread_getspecific(codecs_key));
+    if (codecs == NULL) {
+	codecs = new std::map<std::string, Codec *>;
+	(void) pthread_setspecific(codecs_key, codecs);
+    }
+    std::map<std::string, Codec *>::iterator i = codecs->find(name);
+    if (i != codecs->end())
+	return i->second;
+    Codec * codec = new_codec(name);
+    if (codec != NULL)
+	(*codecs)[name] = codec;
+    return codec;
+}
@@ -0,0 +1,83 @@
+/** @file codec.h
+ * @brief Codecs for compressing payloads.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_CODEC_H
+#define XAPSRV_INCLUDED_CODEC_H
+
+#include <cstddef>
+#include <string>
+
+/** A method of compressing payloads.
+ *
+ *  Codecs keep state (such as compression buffers) between uses, so each
+ *  instance must only be used by one thread: get them with get_codec().
+ */
+class Codec {
+    // Don't allow copying or assignment.
+    Codec(const Codec & other);
+    void operator=(const Codec & other);
+  public:
+    Codec() {}
+    virtual ~Codec();
+
+    /// The name of the encoding produced by the codec.
+    virtual const char * name() const = 0;
+
+    /** Compress some data.
+     *
+     *  @param input The data to compress.
+     *  @param output Set to the compressed data.
+     *
+     *  @retval true if the data was compressed.
+     */
+    virtual bool compress(const std::string & input, std::string & output) = 0;
+
+    /** Decompress some data.
+     *
+     *  @param input The data to decompress.
+     *  @param output Set to the decompressed data.
+     *  @param max_size The maximum size of the decompressed data.
+     *
+     *  @retval true if the data was decompressed.
+     *  @retval false if the data was invalid, or would decompress to more
+     *  than max_size bytes (in which case output is left holding more than
+     *  max_size bytes).
+     */
+    virtual bool decompress(const std::string & input, std::string & output,
+			    size_t max_size) = 0;
+};
+
+/** Get the codec for an encoding, for use in the calling thread.
+ *
+ *  Each thread gets its own instance of each codec, which is reused for the
+ *  life of the thread.
+ *
+ *  @param name The name of the encoding.
+ *
+ *  @returns the codec, or NULL if the encoding isn't supported.
+ */
+Codec * get_codec(const std::string & name);
+
+#endif /* XAPSRV_INCLUDED_CODEC_H */
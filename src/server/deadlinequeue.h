@@ -0,0 +1,114 @@
+/** @file deadlinequeue.h
+ * @brief A queue which removes items in order of their deadlines.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_DEADLINEQUEUE_H
+#define XAPSRV_INCLUDED_DEADLINEQUEUE_H
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <vector>
+
+/** A queue of items with deadlines, which removes the item with the
+ *  earliest deadline first (earliest deadline first scheduling).
+ *
+ *  Items with the same deadline are removed in the order they were added,
+ *  and items without a deadline come after all items with one, in the order
+ *  they were added; so a queue whose items have no deadlines is first-in,
+ *  first-out.
+ *
+ *  The items are kept in a binary heap, so adding or removing an item takes
+ *  time logarithmic in the number of items.
+ *
+ *  This isn't safe to use from several threads at once without locking.
+ */
+template<class T>
+class DeadlineQueue {
+    struct Item {
+	/// The deadline, or LLONG_MAX for none.
+	long long deadline;
+
+	/// The number of items added before this one, to keep the order of
+	/// items with the same deadline.
+	unsigned long long seq;
+
+	T value;
+
+	Item(long long deadline_, unsigned long long seq_, const T & value_)
+		: deadline(deadline_), seq(seq_), value(value_) {}
+
+	/// Order items so that the heap's top is the earliest.
+	bool operator<(const Item & other) const {
+	    if (deadline != other.deadline)
+		return deadline > other.deadline;
+	    return seq > other.seq;
+	}
+    };
+
+    /// The items, as a heap.
+    std::vector<Item> items;
+
+    /// The sequence number of the next item added.
+    unsigned long long next_seq;
+
+    // Don't allow copying or assignment.
+    DeadlineQueue(const DeadlineQueue & other);
+    void operator=(const DeadlineQueue & other);
+  public:
+    DeadlineQueue() : items(), next_seq(0) {}
+
+    /** Add an item.
+     *
+     *  @param deadline The item's deadline, or 0 if it has none.  Only the
+     *  order of deadlines matters, so they may be in any units.
+     */
+    void push(long long deadline, const T & value) {
+	if (deadline == 0)
+	    deadline = LLONG_MAX;
+	items.push_back(Item(deadline, next_seq++, value));
+	std::push_heap(items.begin(), items.end());
+    }
+
+    /** Remove the item with the earliest deadline.
+     *
+     *  @retval false if the queue is empty.
+     */
+    bool pop(T & value) {
+	if (items.empty())
+	    return false;
+	std::pop_heap(items.begin(), items.end());
+	value = items.back().value;
+	items.pop_back();
+	return true;
+    }
+
+    /// The number of items in the queue.
+    size_t size() const { return items.size(); }
+
+    /// Check whether the queue is empty.
+    bool empty() const { return items.empty(); }
+};
+
+#endif /* XAPSRV_INCLUDED_DEADLINEQUEUE_H */
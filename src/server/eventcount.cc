@@ -0,0 +1,130 @@
+/** @file eventcount.cc
+ * @brief Parking for threads waiting on lock-free data structures.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "eventcount.h"
+
+#include <climits>
+#include <errno.h>
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <time.h>
+
+EventCount::EventCount()
+	: epoch(0), waiters(0)
+{
+#ifndef HAVE_LINUX_FUTEX_H
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+#endif
+}
+
+EventCount::~EventCount()
+{
+#ifndef HAVE_LINUX_FUTEX_H
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+unsigned int
+EventCount::prepare_wait()
+{
+    // The increment is a full barrier, so either the notifier sees the
+    // waiter, or the waiter's check of its condition sees the change.
+    (void) __sync_fetch_and_add(&waiters, 1);
+    return epoch;
+}
+
+void
+EventCount::cancel_wait()
+{
+    (void) __sync_fetch_and_sub(&waiters, 1);
+}
+
+void
+EventCount::wake(bool all, unsigned int mask)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+    (void) __sync_fetch_and_add(&epoch, 1);
+    (void) syscall(SYS_futex, &epoch, FUTEX_WAKE_BITSET_PRIVATE,
+		   all ? INT_MAX : 1, NULL, NULL, mask);
+#else
+    pthread_mutex_lock(&mutex);
+    (void) __sync_fetch_and_add(&epoch, 1);
+    // A condition variable can't pick out the threads to wake by their
+    // masks, so they are all woken.
+    if (all || mask != ANY) {
+	pthread_cond_broadcast(&cond);
+    } else {
+	pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+bool
+EventCount::wait(unsigned int key, long long timeout, unsigned int mask)
+{
+    bool woken = true;
+#ifdef HAVE_LINUX_FUTEX_H
+    // A bitset wait takes an absolute timeout on the monotonic clock.
+    struct timespec ts;
+    if (timeout > 0) {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long nsec = ts.tv_nsec + (timeout % 1000000) * 1000;
+	ts.tv_sec += timeout / 1000000 + nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+    }
+    // The futex only sleeps if the epoch still matches the key.
+    if (syscall(SYS_futex, &epoch, FUTEX_WAIT_BITSET_PRIVATE, int(key),
+		timeout > 0 ? &ts : NULL, NULL, mask) == -1 &&
+	errno == ETIMEDOUT) {
+	woken = false;
+    }
+#else
+    (void) mask;
+    pthread_mutex_lock(&mutex);
+    if (epoch == key) {
+	if (timeout <= 0) {
+	    pthread_cond_wait(&cond, &mutex);
+	} else {
+	    struct timespec deadline;
+	    clock_gettime(CLOCK_REALTIME, &deadline);
+	    long long nsec = deadline.tv_nsec + (timeout % 1000000) * 1000;
+	    deadline.tv_sec += timeout / 1000000 + nsec / 1000000000;
+	    deadline.tv_nsec = nsec % 1000000000;
+	    woken = (pthread_cond_timedwait(&cond, &mutex, &deadline) !=
+		     ETIMEDOUT);
+	}
+    }
+    pthread_mutex_unlock(&mutex);
+#endif
+    (void) __sync_fetch_and_sub(&waiters, 1);
+    return woken;
+}
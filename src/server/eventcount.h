@@ -0,0 +1,120 @@
+/** @file eventcount.h
+ * @brief Parking for threads waiting on lock-free data structures.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_EVENTCOUNT_H
+#define XAPSRV_INCLUDED_EVENTCOUNT_H
+
+#ifndef HAVE_LINUX_FUTEX_H
+#include <pthread.h>
+#endif
+
+/** Lets threads sleep until a condition, checked without locking, may have
+ *  become true.
+ *
+ *  A waiting thread calls prepare_wait(), checks its condition again, and
+ *  then calls either cancel_wait() (if the condition is now true) or wait().
+ *  A thread which makes the condition true calls notify_one() or
+ *  notify_all() afterwards.  Wakeups can't be missed between the check and
+ *  the wait, because wait() returns immediately if there has been a
+ *  notification since prepare_wait().
+ *
+ *  Notifying costs a single atomic read when no threads are waiting; threads
+ *  only enter the kernel to sleep and to be woken.  On Linux, waiting threads
+ *  sleep on a futex; elsewhere, a mutex and condition variable are used.
+ *
+ *  Each waiting thread may give a mask, so that notify_mask() can wake just
+ *  the threads whose masks share a bit with its own.  Without futexes,
+ *  notify_mask() wakes all the waiting threads.
+ */
+class EventCount {
+    /// Incremented on each notification which may wake a thread.
+    volatile unsigned int epoch;
+
+    /// The number of threads between prepare_wait() and the end of a wait.
+    volatile int waiters;
+
+#ifndef HAVE_LINUX_FUTEX_H
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+
+    /// Wake threads waiting for a change to the epoch, with any of the bits
+    /// in a mask.
+    void wake(bool all, unsigned int mask);
+
+    // Don't allow copying or assignment.
+    EventCount(const EventCount & other);
+    void operator=(const EventCount & other);
+  public:
+    /// The mask which matches every waiting thread.
+    static const unsigned int ANY = 0xffffffffU;
+
+    EventCount();
+    ~EventCount();
+
+    /** Register to wait.
+     *
+     *  @returns a key to pass to wait().
+     */
+    unsigned int prepare_wait();
+
+    /// Give up waiting, after prepare_wait().
+    void cancel_wait();
+
+    /** Wait for a notification since prepare_wait() returned a key.
+     *
+     *  @param key The key returned by prepare_wait().
+     *  @param timeout The most microseconds to wait for, or 0 to wait
+     *  indefinitely.
+     *  @param mask The bits which notify_mask() must share to wake the
+     *  thread.  Must not be 0.
+     *
+     *  @retval false if the wait timed out.  Spurious wakeups return true.
+     */
+    bool wait(unsigned int key, long long timeout, unsigned int mask = ANY);
+
+    /// Wake one waiting thread, if any are waiting.
+    void notify_one() {
+	__sync_synchronize();
+	if (waiters != 0)
+	    wake(false, ANY);
+    }
+
+    /// Wake all waiting threads.
+    void notify_all() {
+	__sync_synchronize();
+	if (waiters != 0)
+	    wake(true, ANY);
+    }
+
+    /// Wake the waiting threads whose masks share a bit with a mask.
+    void notify_mask(unsigned int mask) {
+	__sync_synchronize();
+	if (waiters != 0)
+	    wake(true, mask);
+    }
+};
+
+#endif /* XAPSRV_INCLUDED_EVENTCOUNT_H */
@@ -0,0 +1,163 @@
+/** @file fairqueue.h
+ * @brief A queue which shares turns fairly between flows of items.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_FAIRQUEUE_H
+#define XAPSRV_INCLUDED_FAIRQUEUE_H
+
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+/** A queue of items from many flows, which takes items from the flows in
+ *  turn rather than in the order they arrived.
+ *
+ *  Items are kept in a first-in, first-out subqueue for each flow, and
+ *  removed by deficit round-robin: each flow with items takes a turn in
+ *  which up to its weight in items are removed, and then goes to the back
+ *  of the line.  Every item costs the same, so a flow with weight 2 has
+ *  twice as many items removed as a flow with weight 1, while both have
+ *  items waiting, however many items either adds.
+ *
+ *  Flows are forgotten as soon as they have no items, so a flow which
+ *  returns after being idle starts a fresh turn at the back of the line,
+ *  rather than being owed turns for the time it was idle.
+ *
+ *  This isn't safe to use from several threads at once without locking.
+ */
+template<class T>
+class FairQueue {
+    struct Flow {
+	/// The flow's items, oldest first.
+	std::deque<T> items;
+
+	/// The number of items the flow removes in each turn.
+	int weight;
+
+	/// The number of items left in the flow's current turn.
+	int deficit;
+    };
+
+    typedef typename std::map<std::string, Flow>::iterator FlowIter;
+
+    /// The flows which have items, by key.
+    std::map<std::string, Flow> flows;
+
+    /// The flows which have items, in the order of their turns.  The flow
+    /// at the front is having its turn.
+    std::list<FlowIter> turns;
+
+    /// The number of items in all flows.
+    size_t count;
+
+    /// Remove an empty flow.
+    void remove_flow(typename std::list<FlowIter>::iterator turn) {
+	flows.erase(*turn);
+	turns.erase(turn);
+    }
+
+    // Don't allow copying or assignment.
+    FairQueue(const FairQueue & other);
+    void operator=(const FairQueue & other);
+  public:
+    FairQueue() : flows(), turns(), count(0) {}
+
+    /** Add an item to the back of a flow.
+     *
+     *  @param key The flow to add the item to.
+     *  @param weight The number of items the flow removes in each turn (at
+     *  least 1).  This replaces the weight given with earlier items.
+     */
+    void push(const std::string & key, int weight, const T & value) {
+	if (weight < 1)
+	    weight = 1;
+	FlowIter i = flows.find(key);
+	if (i == flows.end()) {
+	    i = flows.insert(std::make_pair(key, Flow())).first;
+	    i->second.deficit = weight;
+	    turns.push_back(i);
+	}
+	i->second.weight = weight;
+	i->second.items.push_back(value);
+	++count;
+    }
+
+    /** Remove the next item, from the flow whose turn it is.
+     *
+     *  @retval false if the queue is empty.
+     */
+    bool pop(T & value) {
+	if (turns.empty())
+	    return false;
+	Flow & flow = turns.front()->second;
+	value = flow.items.front();
+	flow.items.pop_front();
+	--count;
+	if (flow.items.empty()) {
+	    remove_flow(turns.begin());
+	} else if (--flow.deficit <= 0) {
+	    flow.deficit = flow.weight;
+	    turns.splice(turns.end(), turns, turns.begin());
+	}
+	return true;
+    }
+
+    /** Remove the oldest item of the flow with the most items.
+     *
+     *  This is used to make room when the queue is full, so that the items
+     *  dropped come from the flows which added the most.
+     *
+     *  @retval false if the queue is empty.
+     */
+    bool pop_longest(T & value) {
+	if (turns.empty())
+	    return false;
+	typename std::list<FlowIter>::iterator longest = turns.begin();
+	typename std::list<FlowIter>::iterator i;
+	for (i = turns.begin(); i != turns.end(); ++i) {
+	    if ((*i)->second.items.size() > (*longest)->second.items.size())
+		longest = i;
+	}
+	Flow & flow = (*longest)->second;
+	value = flow.items.front();
+	flow.items.pop_front();
+	--count;
+	if (flow.items.empty())
+	    remove_flow(longest);
+	return true;
+    }
+
+    /// The number of items in the queue.
+    size_t size() const { return count; }
+
+    /// The number of flows with items in the queue.
+    size_t flow_count() const { return turns.size(); }
+
+    /// Check whether the queue is empty.
+    bool empty() const { return count == 0; }
+};
+
+#endif /* XAPSRV_INCLUDED_FAIRQUEUE_H */
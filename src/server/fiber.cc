@@ -0,0 +1,212 @@
+/** @file fiber.cc
+ * @brief Fibers, for a thread to switch between tasks while they wait.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "fiber.h"
+
+#include <assert.h>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// The fiber running in this thread, or NULL.
+static __thread Fiber * current_fiber = NULL;
+
+Fiber::Fiber(FiberScheduler * scheduler_, size_t stack_size_,
+	     void (*body_)(void *), void * arg_)
+	: scheduler(scheduler_),
+	  stack(NULL),
+	  stack_size(0),
+	  body(body_),
+	  arg(arg_),
+	  finished(false)
+{
+    // The lowest page of the stack is left inaccessible, so that a fiber
+    // which overflows its stack crashes rather than corrupting memory.
+    size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+    stack_size = (stack_size_ + page_size - 1) / page_size * page_size +
+	    page_size;
+    void * mem = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+	throw std::bad_alloc();
+    stack = static_cast<char *>(mem);
+    (void) mprotect(stack, page_size, PROT_NONE);
+
+    if (getcontext(&context) != 0) {
+	(void) munmap(stack, stack_size);
+	throw std::bad_alloc();
+    }
+    context.uc_stack.ss_sp = stack;
+    context.uc_stack.ss_size = stack_size;
+    context.uc_link = &scheduler->context;
+    // makecontext() only passes ints, so the pointer is split in two.
+    unsigned long long ptr = (unsigned long long)(size_t)this;
+    makecontext(&context, (void (*)())start, 2,
+		(unsigned int)(ptr >> 32), (unsigned int)ptr);
+}
+
+Fiber::~Fiber()
+{
+    (void) munmap(stack, stack_size);
+}
+
+void
+Fiber::start(unsigned int high, unsigned int low)
+{
+    Fiber * fiber = reinterpret_cast<Fiber *>(
+	    (size_t)(((unsigned long long)high << 32) | low));
+    fiber->body(fiber->arg);
+    // Returning switches to uc_link: the scheduler.
+    fiber->finished = true;
+}
+
+Fiber *
+Fiber::current()
+{
+    return current_fiber;
+}
+
+void
+Fiber::suspend()
+{
+    Fiber * fiber = current_fiber;
+    assert(fiber != NULL);
+    (void) swapcontext(&fiber->context, &fiber->scheduler->context);
+}
+
+FiberScheduler::FiberScheduler(size_t stack_size_)
+	: ready(), fibers(), stack_size(stack_size_)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+FiberScheduler::~FiberScheduler()
+{
+    for (size_t i = 0; i != fibers.size(); ++i) {
+	delete fibers[i];
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void
+FiberScheduler::notify_ready()
+{
+}
+
+Fiber *
+FiberScheduler::spawn(void (*body)(void *), void * arg)
+{
+    Fiber * fiber = new Fiber(this, stack_size, body, arg);
+    fibers.push_back(fiber);
+    make_ready(fiber);
+    return fiber;
+}
+
+void
+FiberScheduler::make_ready(Fiber * fiber)
+{
+    pthread_mutex_lock(&mutex);
+    ready.push_back(fiber);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    notify_ready();
+}
+
+bool
+FiberScheduler::next_ready(Fiber *& fiber)
+{
+    pthread_mutex_lock(&mutex);
+    bool result = !ready.empty();
+    if (result) {
+	fiber = ready.front();
+	ready.pop_front();
+    }
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+void
+FiberScheduler::wait_for_ready()
+{
+    pthread_mutex_lock(&mutex);
+    while (ready.empty()) {
+	pthread_cond_wait(&cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void
+FiberScheduler::resume(Fiber * fiber)
+{
+    assert(current_fiber == NULL);
+    if (fiber->finished)
+	return;
+    current_fiber = fiber;
+    (void) swapcontext(&context, &fiber->context);
+    current_fiber = NULL;
+}
+
+FiberCondition::FiberCondition()
+	: waiters()
+{
+    pthread_cond_init(&cond, NULL);
+}
+
+FiberCondition::~FiberCondition()
+{
+    pthread_cond_destroy(&cond);
+}
+
+void
+FiberCondition::wait(pthread_mutex_t & mutex)
+{
+    Fiber * fiber = Fiber::current();
+    if (fiber == NULL) {
+	pthread_cond_wait(&cond, &mutex);
+	return;
+    }
+    // A signal which arrives between releasing the mutex and suspending
+    // makes the fiber ready straight away, so the scheduler resumes it as
+    // soon as it has suspended.
+    waiters.push_back(fiber);
+    pthread_mutex_unlock(&mutex);
+    Fiber::suspend();
+    pthread_mutex_lock(&mutex);
+}
+
+void
+FiberCondition::signal()
+{
+    if (waiters.empty()) {
+	pthread_cond_signal(&cond);
+	return;
+    }
+    Fiber * fiber = waiters.front();
+    waiters.pop_front();
+    fiber->get_scheduler()->make_ready(fiber);
+}
@@ -0,0 +1,213 @@
+/** @file fiber.h
+ * @brief Fibers, for a thread to switch between tasks while they wait.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_FIBER_H
+#define XAPSRV_INCLUDED_FIBER_H
+
+#include <cstddef>
+#include <deque>
+#include <pthread.h>
+#include <ucontext.h>
+#include <vector>
+
+class FiberScheduler;
+
+/** A task with its own stack, run by a FiberScheduler.
+ *
+ *  A fiber runs until it suspends itself (usually by waiting on a
+ *  FiberCondition), at which point the thread running it goes back to its
+ *  scheduler, which can run another fiber.  Fibers never move between
+ *  threads.
+ */
+class Fiber {
+    friend class FiberScheduler;
+
+    /// The scheduler which runs the fiber.
+    FiberScheduler * scheduler;
+
+    /// The fiber's saved registers, while it isn't running.
+    ucontext_t context;
+
+    /// The fiber's stack, below which is a guard page.
+    char * stack;
+
+    /// The size of the stack, including the guard page.
+    size_t stack_size;
+
+    /// The function the fiber runs.
+    void (*body)(void *);
+
+    /// The argument to pass to the function.
+    void * arg;
+
+    /// Flag, set to true once the function has returned.
+    bool finished;
+
+    Fiber(FiberScheduler * scheduler_, size_t stack_size_,
+	  void (*body_)(void *), void * arg_);
+    ~Fiber();
+
+    /// Run the fiber's function: the entry point of the fiber's stack.
+    static void start(unsigned int high, unsigned int low);
+
+    // Don't allow copying or assignment.
+    Fiber(const Fiber & other);
+    void operator=(const Fiber & other);
+  public:
+    /// Get the fiber running in this thread, or NULL if none is.
+    static Fiber * current();
+
+    /** Return from the current fiber to its scheduler.
+     *
+     *  The fiber carries on from here once it is made ready again (see
+     *  FiberScheduler::make_ready()) and the scheduler resumes it.  This
+     *  must only be called from a fiber.
+     */
+    static void suspend();
+
+    /// Get the scheduler which runs the fiber.
+    FiberScheduler * get_scheduler() const { return scheduler; }
+
+    /// Get the argument the fiber's function was called with.
+    void * get_arg() const { return arg; }
+
+    /// Check whether the fiber's function has returned.
+    bool is_finished() const { return finished; }
+};
+
+/** Runs a set of fibers in one thread, switching between them as they
+ *  suspend themselves.
+ *
+ *  Only the thread which owns the scheduler may spawn and resume fibers,
+ *  but any thread may make a suspended fiber ready to run again.
+ */
+class FiberScheduler {
+    /// Mutex which must be held when accessing the ready queue.
+    pthread_mutex_t mutex;
+
+    /// Condition used to signal that a fiber has become ready.
+    pthread_cond_t cond;
+
+    /// Fibers which are ready to run.
+    std::deque<Fiber *> ready;
+
+    /// The scheduler's saved registers, while a fiber is running.
+    ucontext_t context;
+
+    /// The fibers, in the order they were spawned.
+    std::vector<Fiber *> fibers;
+
+    /// The size of each fiber's stack.
+    size_t stack_size;
+
+    // Don't allow copying or assignment.
+    FiberScheduler(const FiberScheduler & other);
+    void operator=(const FiberScheduler & other);
+
+  protected:
+    /** Called, from any thread, when a fiber becomes ready.
+     *
+     *  Subclasses which wait for something other than fibers between
+     *  resuming them should override this to interrupt the wait.  The
+     *  default implementation does nothing.
+     */
+    virtual void notify_ready();
+
+    friend class Fiber;
+
+  public:
+    /** Create a scheduler.
+     *
+     *  @param stack_size_ The size of each fiber's stack, in bytes.
+     */
+    explicit FiberScheduler(size_t stack_size_);
+
+    /// Delete the fibers, which must have finished or never been resumed.
+    virtual ~FiberScheduler();
+
+    /** Create a fiber, which is ready to run.
+     *
+     *  @param body The function for the fiber to run.
+     *  @param arg The argument to pass to the function.
+     *
+     *  @throws std::bad_alloc if no memory is available for its stack.
+     */
+    Fiber * spawn(void (*body)(void *), void * arg);
+
+    /// Mark a suspended fiber as ready to run.  May be called from any
+    /// thread.
+    void make_ready(Fiber * fiber);
+
+    /// Take the next fiber which is ready to run, if any.
+    bool next_ready(Fiber *& fiber);
+
+    /// Wait until a fiber is ready to run.
+    void wait_for_ready();
+
+    /** Run a fiber until it suspends itself or finishes.
+     *
+     *  This must only be called by the thread which owns the scheduler, and
+     *  not from within a fiber.
+     */
+    void resume(Fiber * fiber);
+
+    /// Get the fibers, in the order they were spawned.
+    const std::vector<Fiber *> & get_fibers() const { return fibers; }
+};
+
+/** A condition variable which fibers can wait on without blocking the
+ *  thread which runs them.
+ *
+ *  Threads which aren't running a fiber wait on it as they would on a
+ *  pthread condition variable.  The mutex passed to wait() must be held
+ *  when signalling the condition.
+ */
+class FiberCondition {
+    /// Condition used to wake threads which aren't running a fiber.
+    pthread_cond_t cond;
+
+    /// Fibers waiting for the condition, in the order they started waiting.
+    std::deque<Fiber *> waiters;
+
+    // Don't allow copying or assignment.
+    FiberCondition(const FiberCondition & other);
+    void operator=(const FiberCondition & other);
+  public:
+    FiberCondition();
+    ~FiberCondition();
+
+    /** Wait for the condition to be signalled.
+     *
+     *  The mutex is released while waiting, and held again on return.  As
+     *  with pthread_cond_wait(), the caller should check what it was
+     *  waiting for in a loop.
+     */
+    void wait(pthread_mutex_t & mutex);
+
+    /// Wake one waiting fiber or thread, preferring fibers.
+    void signal();
+};
+
+#endif /* XAPSRV_INCLUDED_FIBER_H */
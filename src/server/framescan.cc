@@ -0,0 +1,354 @@
+/** @file framescan.cc
+ * @brief Vectorised scanning for the delimiters of protocol frames.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "framescan.h"
+
+#include <cstddef>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# define XAPSRV_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+/// Check if a character is whitespace, as isspace() does in the C locale.
+static inline bool
+is_space(char ch)
+{
+    return ch == ' ' || (unsigned char)(ch - '\t') <= '\r' - '\t';
+}
+
+static const char *
+scalar_find_any(const char * begin, const char * end,
+		char a, char b, char c, char d)
+{
+    for (; begin != end; ++begin) {
+	char ch = *begin;
+	if (ch == a || ch == b || ch == c || ch == d)
+	    break;
+    }
+    return begin;
+}
+
+static const char *
+scalar_skip_space(const char * begin, const char * end)
+{
+    while (begin != end && is_space(*begin))
+	++begin;
+    return begin;
+}
+
+static void
+scalar_scan_header(const char * begin, const char * end, FrameHeader & header)
+{
+    header.msgid_end = scalar_find_any(begin, end, ' ', ';', ' ', ';');
+    header.options_end = header.msgid_end;
+    if (header.options_end != end && *header.options_end == ';')
+	header.options_end = scalar_find_any(header.options_end, end,
+					     ' ', ' ', ' ', ' ');
+    header.target_end = end;
+    if (header.options_end != end)
+	header.target_end = scalar_find_any(header.options_end + 1, end,
+					    ' ', ' ', ' ', ' ');
+}
+
+static const FrameScanner scalar_scanner = {
+    "scalar", scalar_find_any, scalar_skip_space, scalar_scan_header
+};
+
+#ifdef XAPSRV_X86_SIMD
+
+// Each vector implementation handles whole blocks with vector instructions.
+// Loads are unaligned: on the CPUs which support these instructions, that
+// costs nothing extra for data which happens to be aligned, and frames start
+// anywhere.
+//
+// Most of the fields scanned are shorter than a block, so rather than
+// finishing with a scalar loop, the last partial block is also loaded as a
+// whole block, and the bytes past the end are masked off.  This is only done
+// when the whole block is in the same page as the data, so it can't fault.
+// (This is how the C library's string functions work too.)
+
+/// Check if a block of `size` bytes at `ptr` lies within a single page.
+static inline bool
+within_page(const char * ptr, size_t size)
+{
+    return (reinterpret_cast<size_t>(ptr) & 4095) <= 4096 - size;
+}
+
+/// Get a mask with the bits set for the first `count` bytes of a block.
+static inline unsigned int
+first_bytes_mask(ptrdiff_t count)
+{
+    return count >= 32 ? ~0u : (1u << count) - 1;
+}
+
+/** Update a frame header with the delimiters found in a block.
+ *
+ *  @param block The start of the block.
+ *  @param spaces A mask of the positions of spaces in the block.
+ *  @param semicolons A mask of the positions of semicolons in the block.
+ *  @param header The header to update.  Positions which haven't been found
+ *  yet must be NULL.
+ *
+ *  @retval true if all the delimiters have now been found.
+ */
+static inline bool
+scan_header_block(const char * block, unsigned int spaces,
+		  unsigned int semicolons, FrameHeader & header)
+{
+    if (header.msgid_end == NULL && (spaces | semicolons) != 0)
+	header.msgid_end = block + __builtin_ctz(spaces | semicolons);
+    if (spaces == 0)
+	return false;
+    if (header.options_end == NULL) {
+	header.options_end = block + __builtin_ctz(spaces);
+	spaces &= spaces - 1;
+	if (spaces == 0)
+	    return false;
+    }
+    header.target_end = block + __builtin_ctz(spaces);
+    return true;
+}
+
+/** Find the delimiters in a header which weren't found in whole blocks.
+ *
+ *  @param begin The start of the part of the header not yet scanned.
+ *  @param end The end of the header.
+ *  @param header The header to update.
+ */
+static void
+finish_header(const char * begin, const char * end, FrameHeader & header)
+{
+    // The last block scanned may have extended past the end.
+    if (begin > end)
+	begin = end;
+    FrameHeader rest;
+    if (header.options_end == NULL) {
+	scalar_scan_header(begin, end, rest);
+	if (header.msgid_end == NULL)
+	    header.msgid_end = rest.msgid_end;
+	header.options_end = rest.options_end;
+    } else {
+	// Scan from the space at the end of the options, to find the next.
+	scalar_scan_header(header.options_end, end, rest);
+    }
+    header.target_end = rest.target_end;
+}
+
+__attribute__((target("sse2")))
+static const char *
+sse2_find_any(const char * begin, const char * end,
+	      char a, char b, char c, char d)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i vd = _mm_set1_epi8(d);
+    while (begin < end) {
+	if (end - begin < 16 && !within_page(begin, 16))
+	    return scalar_find_any(begin, end, a, b, c, d);
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+	__m128i hits = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+		_mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+	unsigned int mask = _mm_movemask_epi8(hits) &
+		first_bytes_mask(end - begin);
+	if (mask != 0)
+	    return begin + __builtin_ctz(mask);
+	begin += 16;
+    }
+    return end;
+}
+
+__attribute__((target("sse2")))
+static const char *
+sse2_skip_space(const char * begin, const char * end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i range = _mm_set1_epi8('\r' - '\t');
+    while (begin < end) {
+	if (end - begin < 16 && !within_page(begin, 16))
+	    return scalar_skip_space(begin, end);
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+	// Bytes from '\t' to '\r' are those for which (v - '\t') is no more
+	// than ('\r' - '\t') when compared unsigned.
+	__m128i offset = _mm_sub_epi8(v, tab);
+	__m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(offset, range), offset);
+	__m128i spaces = _mm_or_si128(_mm_cmpeq_epi8(v, space), in_range);
+	unsigned int mask = ~_mm_movemask_epi8(spaces) &
+		first_bytes_mask(end - begin) & 0xffff;
+	if (mask != 0)
+	    return begin + __builtin_ctz(mask);
+	begin += 16;
+    }
+    return end;
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_scan_header(const char * begin, const char * end, FrameHeader & header)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    header.msgid_end = header.options_end = header.target_end = NULL;
+    while (begin < end) {
+	if (end - begin < 16 && !within_page(begin, 16))
+	    break;
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+	unsigned int valid = first_bytes_mask(end - begin);
+	unsigned int spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, space)) &
+		valid;
+	unsigned int semicolons =
+		_mm_movemask_epi8(_mm_cmpeq_epi8(v, semicolon)) & valid;
+	if (scan_header_block(begin, spaces, semicolons, header))
+	    return;
+	begin += 16;
+    }
+    finish_header(begin, end, header);
+}
+
+static const FrameScanner sse2_scanner = {
+    "sse2", sse2_find_any, sse2_skip_space, sse2_scan_header
+};
+
+__attribute__((target("avx2")))
+static const char *
+avx2_find_any(const char * begin, const char * end,
+	      char a, char b, char c, char d)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    const __m256i vd = _mm256_set1_epi8(d);
+    while (begin < end) {
+	if (end - begin < 32 && !within_page(begin, 32)) {
+	    // Clear the upper halves of the registers before running non-AVX
+	    // code, to avoid the penalty for mixing them (GCC doesn't do this
+	    // itself before a tail call).
+	    _mm256_zeroupper();
+	    return scalar_find_any(begin, end, a, b, c, d);
+	}
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+	__m256i hits = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+				_mm256_cmpeq_epi8(v, vb)),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, vc),
+				_mm256_cmpeq_epi8(v, vd)));
+	unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits) &
+		first_bytes_mask(end - begin);
+	if (mask != 0)
+	    return begin + __builtin_ctz(mask);
+	begin += 32;
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+static const char *
+avx2_skip_space(const char * begin, const char * end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i range = _mm256_set1_epi8('\r' - '\t');
+    while (begin < end) {
+	if (end - begin < 32 && !within_page(begin, 32)) {
+	    _mm256_zeroupper();
+	    return scalar_skip_space(begin, end);
+	}
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+	__m256i offset = _mm256_sub_epi8(v, tab);
+	__m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, range),
+					     offset);
+	__m256i spaces = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+					 in_range);
+	unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(spaces) &
+		first_bytes_mask(end - begin);
+	if (mask != 0)
+	    return begin + __builtin_ctz(mask);
+	begin += 32;
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_scan_header(const char * begin, const char * end, FrameHeader & header)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i semicolon = _mm256_set1_epi8(';');
+    header.msgid_end = header.options_end = header.target_end = NULL;
+    while (begin < end) {
+	if (end - begin < 32 && !within_page(begin, 32))
+	    break;
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+	unsigned int valid = first_bytes_mask(end - begin);
+	unsigned int spaces =
+		(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, space)) &
+		valid;
+	unsigned int semicolons =
+		(unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, semicolon)) & valid;
+	if (scan_header_block(begin, spaces, semicolons, header))
+	    return;
+	begin += 32;
+    }
+    _mm256_zeroupper();
+    finish_header(begin, end, header);
+}
+
+static const FrameScanner avx2_scanner = {
+    "avx2", avx2_find_any, avx2_skip_space, avx2_scan_header
+};
+
+#endif /* XAPSRV_X86_SIMD */
+
+std::vector<const FrameScanner *>
+get_frame_scanners()
+{
+    std::vector<const FrameScanner *> result;
+#ifdef XAPSRV_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	result.push_back(&avx2_scanner);
+    if (__builtin_cpu_supports("sse2"))
+	result.push_back(&sse2_scanner);
+#endif
+    result.push_back(&scalar_scanner);
+    return result;
+}
+
+const FrameScanner &
+get_frame_scanner()
+{
+    // The choice is the same every time, so it doesn't matter if several
+    // threads race to make it.
+    static const FrameScanner * scanner = NULL;
+    if (scanner == NULL) {
+	scanner = get_frame_scanners().front();
+    }
+    return *scanner;
+}
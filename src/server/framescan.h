@@ -0,0 +1,93 @@
+/** @file framescan.h
+ * @brief Vectorised scanning for the delimiters of protocol frames.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_FRAMESCAN_H
+#define XAPSRV_INCLUDED_FRAMESCAN_H
+
+#include <vector>
+
+/** The positions of the delimiters in the header of a frame.
+ *
+ *  Each position is the end of the scanned range if the delimiter wasn't
+ *  found.
+ */
+struct FrameHeader {
+    /// The end of the message id: the first ';' or ' '.
+    const char * msgid_end;
+
+    /// The end of the message id and its options: the first ' '.
+    const char * options_end;
+
+    /// The end of the target: the second ' '.
+    const char * target_end;
+};
+
+/** An implementation of the scans used to find the parts of a frame.
+ *
+ *  Several implementations are available, using different instruction sets:
+ *  get_frame_scanner() returns the fastest which the CPU supports.
+ */
+struct FrameScanner {
+    /// The name of the implementation.
+    const char * name;
+
+    /** Find the first byte in [begin, end) which is equal to any of a, b, c
+     *  or d.
+     *
+     *  To search for fewer than four values, repeat one of them.
+     *
+     *  @returns a pointer to the byte found, or end if there is none.
+     */
+    const char * (*find_any)(const char * begin, const char * end,
+			     char a, char b, char c, char d);
+
+    /** Find the first byte in [begin, end) which isn't whitespace (as
+     *  defined by isspace() in the C locale).
+     *
+     *  @returns a pointer to the byte found, or end if there is none.
+     */
+    const char * (*skip_space)(const char * begin, const char * end);
+
+    /** Find the delimiters in the header of a frame, in a single pass.
+     *
+     *  @param begin The start of the frame body (just after the length).
+     *  @param end The end of the frame body.
+     *  @param header Set to the positions found.
+     */
+    void (*scan_header)(const char * begin, const char * end,
+			FrameHeader & header);
+};
+
+/** Get the fastest frame scanner which the CPU supports.
+ */
+const FrameScanner & get_frame_scanner();
+
+/** Get all the frame scanners which the CPU supports, fastest first.
+ *
+ *  The last is always a portable scalar implementation.
+ */
+std::vector<const FrameScanner *> get_frame_scanners();
+
+#endif /* XAPSRV_INCLUDED_FRAMESCAN_H */
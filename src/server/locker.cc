@@ -0,0 +1,113 @@
+/** @file locker.cc
+ * @brief Convenient wrapper for holding thread locks.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "locker.h"
+
+#include "utils.h"
+
+bool LockProfile::enabled = false;
+
+/// Mutex held while adding to the list of profiles.
+static pthread_mutex_t profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// The first profile created, or NULL.
+static LockProfile * volatile profiles = NULL;
+
+/// The last profile created, or NULL.
+static LockProfile * last_profile = NULL;
+
+LockProfile::LockProfile(const std::string & name_)
+	: name(name_), acquisitions(0), contended(0), wait_usec(0),
+	  hold_usec(0), next(NULL)
+{
+}
+
+LockProfile *
+LockProfile::get(const std::string & name)
+{
+    pthread_mutex_lock(&profiles_mutex);
+    LockProfile * profile = profiles;
+    while (profile != NULL && profile->name != name) {
+	profile = profile->next;
+    }
+    if (profile == NULL) {
+	profile = new LockProfile(name);
+	// Append, so that the list can be walked without the mutex.
+	__sync_synchronize();
+	if (last_profile == NULL) {
+	    profiles = profile;
+	} else {
+	    last_profile->next = profile;
+	}
+	last_profile = profile;
+    }
+    pthread_mutex_unlock(&profiles_mutex);
+    return profile;
+}
+
+LockProfile *
+LockProfile::first()
+{
+    return profiles;
+}
+
+LockProfile::Counts
+LockProfile::get_counts() const
+{
+    Counts result;
+    LockProfile * self = const_cast<LockProfile *>(this);
+    result.acquisitions = __sync_fetch_and_add(&self->acquisitions, 0);
+    result.contended = __sync_fetch_and_add(&self->contended, 0);
+    result.wait_usec = __sync_fetch_and_add(&self->wait_usec, 0);
+    result.hold_usec = __sync_fetch_and_add(&self->hold_usec, 0);
+    return result;
+}
+
+void
+Locker::profiled_lock()
+{
+    // Only time the wait if the lock is contended, to keep the overhead of
+    // uncontended acquisitions low.
+    if (pthread_mutex_trylock(&mutex) == 0) {
+	held_since = get_monotonic_usec();
+    } else {
+	long long start = get_monotonic_usec();
+	pthread_mutex_lock(&mutex);
+	held_since = get_monotonic_usec();
+	(void) __sync_fetch_and_add(&profile->contended, 1);
+	(void) __sync_fetch_and_add(&profile->wait_usec, held_since - start);
+    }
+    (void) __sync_fetch_and_add(&profile->acquisitions, 1);
+}
+
+void
+Locker::profiled_unlock()
+{
+    long long held = get_monotonic_usec() - held_since;
+    held_since = 0;
+    pthread_mutex_unlock(&mutex);
+    (void) __sync_fetch_and_add(&profile->hold_usec, held);
+}
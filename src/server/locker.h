@@ -26,23 +26,119 @@
 #define XAPSRV_INCLUDED_LOCKER_H
 
 #include <pthread.h>
+#include <string>
+
+/** Contention statistics for all the locks with a given name.
+ *
+ *  Profiles are only updated while profiling is enabled, and live until
+ *  the process exits.
+ */
+struct LockProfile {
+    /// A snapshot of the statistics in a profile.
+    struct Counts {
+	long long acquisitions;
+	long long contended;
+	long long wait_usec;
+	long long hold_usec;
+
+	Counts()
+		: acquisitions(0), contended(0), wait_usec(0), hold_usec(0)
+	{}
+    };
+
+    /// The name of the locks.
+    std::string name;
+
+    /// The number of times the locks were acquired.
+    volatile long long acquisitions;
+
+    /// The number of those acquisitions which had to wait for another thread.
+    volatile long long contended;
+
+    /// The total time spent waiting to acquire the locks, in microseconds.
+    volatile long long wait_usec;
+
+    /// The total time the locks were held for, in microseconds.
+    volatile long long hold_usec;
+
+    /// The next profile, in the order they were created.
+    LockProfile * next;
+
+    /// Flag, set to true to profile named locks.
+    static bool enabled;
+
+    /** Get the profile for a name, creating it if needed.
+     *
+     *  @param name The name of the locks.
+     */
+    static LockProfile * get(const std::string & name);
+
+    /// Get the first profile, or NULL if there are none.
+    static LockProfile * first();
+
+    /// Get a snapshot of the statistics.
+    Counts get_counts() const;
+
+  private:
+    LockProfile(const std::string & name_);
+};
 
 /** A simple wrapper around a mutex.
+ *
+ *  A lock may be given a name, so that its contention is recorded in the
+ *  LockProfile for that name while profiling is enabled.  Locks with the
+ *  same name share a profile.
  */
 class Locker {
     pthread_mutex_t mutex;
+
+    /// The profile to update, or NULL if the lock has no name.
+    LockProfile * profile;
+
+    /** The time the lock was acquired, from get_monotonic_usec(), if it was
+     *  profiled; otherwise 0.
+     */
+    long long held_since;
+
+    void profiled_lock();
+    void profiled_unlock();
+
+    // Don't allow copying or assignment.
+    Locker(const Locker & other);
+    void operator=(const Locker & other);
   public:
-    Locker() {
+    Locker() : profile(NULL), held_since(0) {
+	pthread_mutex_init(&mutex, NULL);
+    }
+    Locker(const std::string & name)
+	    : profile(LockProfile::get(name)), held_since(0) {
 	pthread_mutex_init(&mutex, NULL);
     }
     ~Locker() {
 	pthread_mutex_destroy(&mutex);
     }
+
+    /** Set the name of the lock.
+     *
+     *  This must be called before the lock is first used.
+     */
+    void set_name(const std::string & name) {
+	profile = LockProfile::get(name);
+    }
+
     void lock() {
-	pthread_mutex_lock(&mutex);
+	if (profile != NULL && LockProfile::enabled) {
+	    profiled_lock();
+	} else {
+	    pthread_mutex_lock(&mutex);
+	}
     }
     void unlock() {
-	pthread_mutex_unlock(&mutex);
+	if (held_since != 0) {
+	    profiled_unlock();
+	} else {
+	    pthread_mutex_unlock(&mutex);
+	}
     }
 };
 
@@ -52,7 +148,7 @@ class ContextLocker {
     Locker & locker;
     bool locked;
   public:
-    ContextLocker(Locker & locker_) : locker(locker_), locked(true) {
+    ContextLocker(Locker & locker_) : locker(locker_), locked(false) {
 	lock();
     }
     ~ContextLocker() {
@@ -72,4 +168,4 @@ class ContextLocker {
     }
 };
 
-#endif /* XAPSRV_INCLUDED_IO_LOCKER_H */
+#endif /* XAPSRV_INCLUDED_LOCKER_H */
@@ -0,0 +1,178 @@
+/** @file mpmcqueue.h
+ * @brief A bounded lock-free queue for many producers and consumers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_MPMCQUEUE_H
+#define XAPSRV_INCLUDED_MPMCQUEUE_H
+
+#include <cstddef>
+
+/// The size of a cache line, used to keep hot variables apart.
+#define XAPSRV_CACHE_LINE 64
+
+/** A bounded queue which any number of threads may add to and remove from
+ *  concurrently, without locking.
+ *
+ *  This is Dmitry Vyukov's bounded MPMC queue: each cell of a ring buffer
+ *  holds a sequence number, which tells producers and consumers whether the
+ *  cell is free for the lap of the ring they are on.  A producer or consumer
+ *  claims a cell with a single compare-and-swap of the enqueue or dequeue
+ *  position, so threads only contend when they use the same end of the
+ *  queue at the same time.
+ *
+ *  The queue never blocks: push() fails when the queue is full, and pop()
+ *  fails when it is empty.  Pair it with an EventCount to wait for items.
+ *
+ *  The value type must be cheap to copy, such as a pointer.
+ */
+template<class T>
+class MpmcQueue {
+    struct Cell {
+	volatile size_t sequence;
+	T data;
+    };
+
+    char pad0[XAPSRV_CACHE_LINE];
+
+    /// The ring buffer.
+    Cell * const buffer;
+
+    /// The number of cells, less one (the number of cells is a power of 2).
+    const size_t mask;
+
+    char pad1[XAPSRV_CACHE_LINE];
+
+    /// The position the next item will be added at.
+    volatile size_t enqueue_pos;
+
+    char pad2[XAPSRV_CACHE_LINE];
+
+    /// The position the next item will be removed from.
+    volatile size_t dequeue_pos;
+
+    char pad3[XAPSRV_CACHE_LINE];
+
+    /// Round a capacity up to a power of 2, of at least 2.
+    static size_t round_capacity(size_t capacity) {
+	size_t result = 2;
+	while (result < capacity)
+	    result *= 2;
+	return result;
+    }
+
+    // Don't allow copying or assignment.
+    MpmcQueue(const MpmcQueue & other);
+    void operator=(const MpmcQueue & other);
+  public:
+    /** Create a queue.
+     *
+     *  @param capacity The most items the queue can hold.  This is rounded
+     *  up to a power of 2.
+     */
+    explicit MpmcQueue(size_t capacity)
+	    : buffer(new Cell[round_capacity(capacity)]),
+	      mask(round_capacity(capacity) - 1),
+	      enqueue_pos(0),
+	      dequeue_pos(0)
+    {
+	for (size_t i = 0; i <= mask; ++i) {
+	    buffer[i].sequence = i;
+	}
+    }
+
+    ~MpmcQueue() {
+	delete [] buffer;
+    }
+
+    /// The most items the queue can hold.
+    size_t capacity() const { return mask + 1; }
+
+    /** Add an item to the back of the queue.
+     *
+     *  @retval false if the queue is full.
+     */
+    bool push(const T & value) {
+	Cell * cell;
+	size_t pos = enqueue_pos;
+	while (true) {
+	    cell = &buffer[pos & mask];
+	    size_t seq = cell->sequence;
+	    long diff = long(seq) - long(pos);
+	    if (diff == 0) {
+		if (__sync_bool_compare_and_swap(&enqueue_pos, pos, pos + 1))
+		    break;
+		pos = enqueue_pos;
+	    } else if (diff < 0) {
+		// The cell still holds an item from the previous lap.
+		return false;
+	    } else {
+		pos = enqueue_pos;
+	    }
+	}
+	cell->data = value;
+	// Publish the item: consumers read the data after the sequence.
+	__sync_synchronize();
+	cell->sequence = pos + 1;
+	return true;
+    }
+
+    /** Remove an item from the front of the queue.
+     *
+     *  @retval false if the queue is empty.
+     */
+    bool pop(T & value) {
+	Cell * cell;
+	size_t pos = dequeue_pos;
+	while (true) {
+	    cell = &buffer[pos & mask];
+	    size_t seq = cell->sequence;
+	    long diff = long(seq) - long(pos + 1);
+	    if (diff == 0) {
+		if (__sync_bool_compare_and_swap(&dequeue_pos, pos, pos + 1))
+		    break;
+		pos = dequeue_pos;
+	    } else if (diff < 0) {
+		// The cell hasn't been filled on this lap.
+		return false;
+	    } else {
+		pos = dequeue_pos;
+	    }
+	}
+	value = cell->data;
+	// Release the cell for the next lap, after the data has been read.
+	__sync_synchronize();
+	cell->sequence = pos + mask + 1;
+	return true;
+    }
+
+    /** Check whether the queue looks empty.
+     *
+     *  The result may be out of date as soon as it is returned.
+     */
+    bool empty() const {
+	return enqueue_pos == dequeue_pos;
+    }
+};
+
+#endif /* XAPSRV_INCLUDED_MPMCQUEUE_H */
@@ -0,0 +1,164 @@
+/** @file payloadstream.cc
+ * @brief Stream of payload data for a message which is still arriving.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "payloadstream.h"
+
+#include "serverinternal.h"
+
+PayloadStream::PayloadStream(ServerInternal * server_, size_t max_buffered_)
+	: server(server_),
+	  cond(),
+	  refcount(0),
+	  chunks(),
+	  buffered(0),
+	  max_buffered(max_buffered_),
+	  writer_waiting(false),
+	  finished(false),
+	  aborted(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+PayloadStream::~PayloadStream()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+void
+PayloadStream::ref()
+{
+    pthread_mutex_lock(&mutex);
+    ++refcount;
+    pthread_mutex_unlock(&mutex);
+}
+
+void
+PayloadStream::unref()
+{
+    pthread_mutex_lock(&mutex);
+    int remaining = --refcount;
+    bool nudge = false;
+    if (remaining == 1 && !finished) {
+	// Only the writer is left, so the buffered data will never be read.
+	// Discard it, and let the writer carry on if it was waiting.
+	chunks.clear();
+	buffered = 0;
+	nudge = writer_waiting;
+	writer_waiting = false;
+    }
+    pthread_mutex_unlock(&mutex);
+    if (remaining == 0) {
+	delete this;
+    } else if (nudge) {
+	server->nudge_streams();
+    }
+}
+
+void
+PayloadStream::write(const std::string & data)
+{
+    pthread_mutex_lock(&mutex);
+    // If nothing except the writer refers to the stream, nothing will ever
+    // read it.
+    if (refcount > 1) {
+	chunks.push_back(data);
+	buffered += data.size();
+	cond.signal();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool
+PayloadStream::has_space()
+{
+    pthread_mutex_lock(&mutex);
+    bool result = buffered < max_buffered;
+    if (!result) {
+	writer_waiting = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+void
+PayloadStream::close(bool aborted_)
+{
+    pthread_mutex_lock(&mutex);
+    finished = true;
+    aborted = aborted_;
+    cond.signal();
+    pthread_mutex_unlock(&mutex);
+}
+
+void
+PayloadStream::finish()
+{
+    close(false);
+}
+
+void
+PayloadStream::abort()
+{
+    close(true);
+}
+
+bool
+PayloadStream::read(std::string & chunk)
+{
+    pthread_mutex_lock(&mutex);
+    while (chunks.empty() && !finished) {
+	cond.wait(mutex);
+    }
+    if (chunks.empty()) {
+	pthread_mutex_unlock(&mutex);
+	return false;
+    }
+    chunk.swap(chunks.front());
+    chunks.pop_front();
+    buffered -= chunk.size();
+
+    // Wait until half the buffer has been read before resuming the writer,
+    // so that it isn't woken for every chunk.
+    bool nudge = false;
+    if (writer_waiting && buffered <= max_buffered / 2) {
+	writer_waiting = false;
+	nudge = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    if (nudge) {
+	server->nudge_streams();
+    }
+    return true;
+}
+
+bool
+PayloadStream::is_aborted()
+{
+    pthread_mutex_lock(&mutex);
+    bool result = aborted;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
@@ -0,0 +1,175 @@
+/** @file payloadstream.h
+ * @brief Stream of payload data for a message which is still arriving.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_PAYLOADSTREAM_H
+#define XAPSRV_INCLUDED_PAYLOADSTREAM_H
+
+#include <cstddef>
+#include <deque>
+#include "fiber.h"
+#include <pthread.h>
+#include <string>
+
+class ServerInternal;
+
+/** The payload of a message, passed from a connection to a worker in chunks
+ *  as it arrives.
+ *
+ *  Data is written by the main server thread, and read by a worker.  The
+ *  amount of data buffered is limited: once the limit is reached, the main
+ *  thread stops reading from the connection until the worker has caught up.
+ *
+ *  If nothing is left which could read from the stream (for example,
+ *  because the message was cancelled before a worker started on it), data
+ *  written to the stream is discarded, so that the rest of the message can
+ *  be skipped.
+ *
+ *  Streams are reference counted: use PayloadStreamPtr to refer to them.
+ *  The writer must hold a reference until it has called finish() or abort().
+ */
+class PayloadStream {
+    /// The server, which is nudged when space becomes available.
+    ServerInternal * server;
+
+    /// Mutex which must be held when accessing the members below.
+    pthread_mutex_t mutex;
+
+    /** Condition used to signal that data has arrived.
+     *
+     *  A reader running in a fiber lets other fibers run while it waits.
+     */
+    FiberCondition cond;
+
+    /// The number of references to the stream.
+    int refcount;
+
+    /// The data which has arrived but not yet been read.
+    std::deque<std::string> chunks;
+
+    /// The number of bytes in chunks.
+    size_t buffered;
+
+    /// The maximum number of bytes to buffer.
+    size_t max_buffered;
+
+    /// Flag, set to true when the writer is waiting for space.
+    bool writer_waiting;
+
+    /// Flag, set to true when all the data has been written.
+    bool finished;
+
+    /// Flag, set to true if the data stopped arriving before it was finished.
+    bool aborted;
+
+    // Don't allow copying or assignment.
+    PayloadStream(const PayloadStream & other);
+    void operator=(const PayloadStream & other);
+
+    ~PayloadStream();
+
+    /** Set the flag indicating that the writer is done, and wake the reader.
+     */
+    void close(bool aborted_);
+
+  public:
+    /** Create a stream.
+     *
+     *  @param server_ The server, which is nudged when the stream has space
+     *  for more data.
+     *  @param max_buffered_ The maximum number of bytes to buffer.
+     */
+    PayloadStream(ServerInternal * server_, size_t max_buffered_);
+
+    /// Add a reference to the stream.
+    void ref();
+
+    /// Remove a reference to the stream, deleting it if none are left.
+    void unref();
+
+    /** Add data to the stream.
+     *
+     *  This never blocks: it is up to the caller to check has_space() before
+     *  reading more data to write.
+     */
+    void write(const std::string & data);
+
+    /** Check if the stream has space for more data.
+     *
+     *  If not, the server will be nudged when space becomes available.
+     */
+    bool has_space();
+
+    /// Mark the end of the data.
+    void finish();
+
+    /// Mark that no more data will arrive, because its connection closed.
+    void abort();
+
+    /** Read the next chunk of data, waiting for it to arrive if necessary.
+     *
+     *  If called from a fiber, only the fiber waits, rather than its thread.
+     *
+     *  @param chunk Set to the data read.
+     *
+     *  @retval true if some data was read.
+     *  @retval false if the end of the data has been reached, or the data
+     *  stopped arriving (in which case is_aborted() will return true).
+     */
+    bool read(std::string & chunk);
+
+    /// Check if the data stopped arriving before it was finished.
+    bool is_aborted();
+};
+
+/** A reference to a PayloadStream.
+ */
+class PayloadStreamPtr {
+    PayloadStream * stream;
+  public:
+    PayloadStreamPtr() : stream(NULL) {}
+
+    explicit PayloadStreamPtr(PayloadStream * stream_) : stream(stream_) {
+	if (stream) stream->ref();
+    }
+
+    PayloadStreamPtr(const PayloadStreamPtr & other) : stream(other.stream) {
+	if (stream) stream->ref();
+    }
+
+    void operator=(const PayloadStreamPtr & other) {
+	if (other.stream) other.stream->ref();
+	if (stream) stream->unref();
+	stream = other.stream;
+    }
+
+    ~PayloadStreamPtr() {
+	if (stream) stream->unref();
+    }
+
+    PayloadStream * get() const { return stream; }
+    PayloadStream * operator->() const { return stream; }
+};
+
+#endif /* XAPSRV_INCLUDED_PAYLOADSTREAM_H */
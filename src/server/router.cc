@@ -0,0 +1,194 @@
+/** @file router.cc
+ * @brief Match message targets against a table of routes.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "router.h"
+
+#include <assert.h>
+
+/// Number of distinct method characters.
+#define ROUTER_METHODS 256
+
+struct Router::Node {
+    /// The literal text leading from the parent node to this node.
+    std::string prefix;
+
+    /// Children reached by literal text.  No two start with the same text.
+    std::vector<Node *> children;
+
+    /// The child reached by a capture, or NULL if none.
+    Node * capture_child;
+
+    /** The route id for each method for routes which end at this node.
+     *
+     *  Indexed by method character, holding -1 for methods with no route.
+     */
+    int routes[ROUTER_METHODS];
+
+    Node() : prefix(), children(), capture_child(NULL) {
+	for (int i = 0; i != ROUTER_METHODS; ++i) {
+	    routes[i] = -1;
+	}
+    }
+
+    ~Node() {
+	std::vector<Node *>::iterator i;
+	for (i = children.begin(); i != children.end(); ++i) {
+	    delete *i;
+	}
+	delete capture_child;
+    }
+};
+
+Router::Router()
+	: root(new Node)
+{
+}
+
+Router::~Router()
+{
+    delete root;
+}
+
+void
+Router::add(const RouteSpec & route)
+{
+    add(root, route.method, route.pattern, 0, 0, route.route_id);
+}
+
+void
+Router::add(const RouteSpec * routes, size_t count)
+{
+    for (size_t i = 0; i != count; ++i) {
+	add(routes[i]);
+    }
+}
+
+void
+Router::add(Node * node, char method, const std::string & pattern,
+	    size_t pos, int ncaptures, int route_id)
+{
+    if (pos == pattern.size()) {
+	int & route = node->routes[static_cast<unsigned char>(method)];
+	assert(route == -1);
+	route = route_id;
+	return;
+    }
+
+    if (pattern[pos] == '{') {
+	size_t close = pattern.find('}', pos);
+	assert(close != pattern.npos);
+	assert(ncaptures < ROUTE_MAX_CAPTURES);
+	if (node->capture_child == NULL) {
+	    node->capture_child = new Node;
+	}
+	add(node->capture_child, method, pattern, close + 1, ncaptures + 1,
+	    route_id);
+	return;
+    }
+
+    size_t end = pattern.find('{', pos);
+    if (end == pattern.npos)
+	end = pattern.size();
+
+    std::vector<Node *>::iterator i;
+    for (i = node->children.begin(); i != node->children.end(); ++i) {
+	Node * child = *i;
+	if (child->prefix[0] != pattern[pos])
+	    continue;
+
+	size_t common = 1;
+	while (common < child->prefix.size() && pos + common < end &&
+	       child->prefix[common] == pattern[pos + common]) {
+	    ++common;
+	}
+	if (common < child->prefix.size()) {
+	    // Split the child, so that the common text leads to a new node.
+	    Node * split = new Node;
+	    split->prefix = child->prefix.substr(0, common);
+	    child->prefix.erase(0, common);
+	    split->children.push_back(child);
+	    *i = split;
+	    child = split;
+	}
+	add(child, method, pattern, pos + common, ncaptures, route_id);
+	return;
+    }
+
+    Node * child = new Node;
+    child->prefix = pattern.substr(pos, end - pos);
+    node->children.push_back(child);
+    add(child, method, pattern, end, ncaptures, route_id);
+}
+
+bool
+Router::match(char method, const std::string & path, size_t pos,
+	      RouteMatch & result) const
+{
+    result.ncaptures = 0;
+    return match(root, method, path, pos, result);
+}
+
+bool
+Router::match(const Node * node, char method, const std::string & path,
+	      size_t pos, RouteMatch & result) const
+{
+    if (pos == path.size()) {
+	int route = node->routes[static_cast<unsigned char>(method)];
+	if (route == -1)
+	    return false;
+	result.route_id = route;
+	return true;
+    }
+
+    // Try literal text first.
+    char ch = path[pos];
+    std::vector<Node *>::const_iterator i;
+    for (i = node->children.begin(); i != node->children.end(); ++i) {
+	const Node * child = *i;
+	if (child->prefix[0] != ch)
+	    continue;
+	if (path.compare(pos, child->prefix.size(), child->prefix) == 0 &&
+	    match(child, method, path, pos + child->prefix.size(), result)) {
+	    return true;
+	}
+	break;
+    }
+
+    // Then try a capture.
+    if (node->capture_child != NULL && ch != '/') {
+	size_t end = path.find('/', pos);
+	if (end == path.npos)
+	    end = path.size();
+	int n = result.ncaptures;
+	result.capture_start[n] = pos;
+	result.capture_len[n] = end - pos;
+	result.ncaptures = n + 1;
+	if (match(node->capture_child, method, path, end, result))
+	    return true;
+	result.ncaptures = n;
+    }
+    return false;
+}
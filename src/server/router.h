@@ -0,0 +1,126 @@
+/** @file router.h
+ * @brief Match message targets against a table of routes.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_ROUTER_H
+#define XAPSRV_INCLUDED_ROUTER_H
+
+#include <string>
+#include <vector>
+
+/// Maximum number of captures in a route pattern.
+#define ROUTE_MAX_CAPTURES 8
+
+/** A route, as declared in a route table.
+ */
+struct RouteSpec {
+    /// The method character which the route applies to.
+    char method;
+
+    /** The pattern for the route.
+     *
+     *  This is a path, with any number of captures.  A capture is a name in
+     *  braces (eg, "{name}"), and matches one or more characters other than
+     *  '/'.  Literal text is preferred to a capture when both match.
+     */
+    const char * pattern;
+
+    /// An identifier for the route, returned when it is matched.
+    int route_id;
+};
+
+/** The result of matching a path against the routes.
+ *
+ *  Captures are recorded as offsets into the path which was matched, so no
+ *  memory needs to be allocated when matching.
+ */
+struct RouteMatch {
+    /// The identifier of the route which matched.
+    int route_id;
+
+    /// The number of captures in the route which matched.
+    int ncaptures;
+
+    /// The start offset, in the matched path, of each capture.
+    size_t capture_start[ROUTE_MAX_CAPTURES];
+
+    /// The length of each capture.
+    size_t capture_len[ROUTE_MAX_CAPTURES];
+
+    /// Get a copy of the text of a capture.
+    std::string capture(const std::string & path, int i) const {
+	return path.substr(capture_start[i], capture_len[i]);
+    }
+};
+
+/** A set of routes, compiled into a radix tree.
+ *
+ *  The cost of matching a path depends on the length of the path, rather than
+ *  on the number of routes.
+ */
+class Router {
+    struct Node;
+
+    /// The root of the tree.
+    Node * root;
+
+    /// Add the remainder of a pattern, starting at `pos`, below a node.
+    void add(Node * node, char method, const std::string & pattern,
+	     size_t pos, int ncaptures, int route_id);
+
+    /// Match the remainder of a path, starting at `pos`, below a node.
+    bool match(const Node * node, char method, const std::string & path,
+	       size_t pos, RouteMatch & result) const;
+
+    // Don't allow copying or assignment.
+    Router(const Router & other);
+    void operator=(const Router & other);
+  public:
+    Router();
+    ~Router();
+
+    /** Add a route.
+     *
+     *  Each combination of method and pattern may only be added once.
+     */
+    void add(const RouteSpec & route);
+
+    /** Add a table of routes.
+     */
+    void add(const RouteSpec * routes, size_t count);
+
+    /** Match a path against the routes.
+     *
+     *  @param method The method character of the message.
+     *  @param path The string holding the path to match.
+     *  @param pos The offset in `path` at which the path starts.
+     *  @param result Set to describe the match, if one is found.
+     *
+     *  @retval true if a route matched, false otherwise.
+     */
+    bool match(char method, const std::string & path, size_t pos,
+	       RouteMatch & result) const;
+};
+
+#endif /* XAPSRV_INCLUDED_ROUTER_H */
@@ -0,0 +1,847 @@
+/** @file runqueue.cc
+ * @brief The queue of messages for a group of workers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "runqueue.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <new>
+#include "stats.h"
+#include "topology.h"
+#include "utils.h"
+
+/// The most messages each worker's lane holds, including cancelled ones
+/// which the worker hasn't dropped yet.
+#define AFFINITY_LANE_SIZE 8
+
+/// The most affinity keys to remember the preferred workers for.
+#define AFFINITY_RANKINGS_SIZE 4096
+
+/// Get the bits which a worker waits for, so that it can be woken without
+/// waking the others (unless there are more than 32 workers).
+static unsigned int
+slot_mask(int slot)
+{
+    return 1U << (slot % 32);
+}
+
+/// Hash an affinity key (64 bit FNV-1a).
+static unsigned long long
+hash_key(const std::string & key)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (std::string::size_type i = 0; i != key.size(); ++i) {
+	h ^= (unsigned char)key[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/// Score a slot for a hashed key, for rendezvous hashing.
+static unsigned long long
+score_slot(unsigned long long key_hash, size_t slot)
+{
+    // The finalizer of splitmix64, so that each slot's scores look
+    // unrelated to the others'.
+    unsigned long long z = key_hash + (slot + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+RunQueue::Running::Running()
+	: connection_num(-1),
+	  msgid(),
+	  target(),
+	  started_at(0),
+	  stall_reported(false),
+	  cancelled(false),
+	  responded(false)
+{
+}
+
+void
+RunQueue::Running::clear()
+{
+    connection_num = -1;
+    msgid.clear();
+    target.clear();
+    stall_reported = false;
+    cancelled = false;
+    responded = false;
+}
+
+RunQueue::Slot::Slot()
+	: mutex("queue_slot"),
+	  active(false),
+	  stop_requested(false),
+	  busy(false),
+	  idle(false),
+	  running(1),
+	  current(0),
+	  wake_requested(false),
+	  heartbeat(0),
+	  lane(NULL),
+	  lane_queued(0)
+{
+}
+
+void
+RunQueue::Slot::start(const Message & msg)
+{
+    busy = true;
+    current_message().connection_num = msg.connection_num;
+    current_message().msgid = msg.msgid;
+    current_message().target = msg.target;
+}
+
+void
+RunQueue::set_idle(Slot & slot, bool value)
+{
+    if (slot.idle == value)
+	return;
+    slot.idle = value;
+    if (value) {
+	(void) __sync_fetch_and_add(&idle, 1);
+    } else {
+	(void) __sync_fetch_and_sub(&idle, 1);
+    }
+}
+
+void
+RunQueue::finish(Slot & slot)
+{
+    Running & running = slot.current_message();
+    if (running.started_at != 0) {
+	(void) __sync_fetch_and_add(&busy_usec,
+				    get_monotonic_usec() - running.started_at);
+    }
+    running.started_at = 0;
+}
+
+void
+RunQueue::unref(Entry * entry)
+{
+    if (__sync_sub_and_fetch(&entry->refs, 1) == 0)
+	delete entry;
+}
+
+bool
+RunQueue::claim(Entry * entry, int new_state)
+{
+    return __sync_bool_compare_and_swap(&entry->state, ENTRY_QUEUED,
+					new_state);
+}
+
+RunQueue::RunQueue(size_t nslots, size_t limit_, Stats * stats_,
+		   const std::vector<int> & cpus_, int node_, bool fair_,
+		   int affinity_, bool edf_)
+	: stats(stats_), limit(limit_), queued(0), lane_queued(0), idle(0),
+	  events(), busy_usec(0), wait_usec(0), taken(0), min_wait_usec(-1),
+	  affinity_hits(0), affinity_spills(0), pending(), slots(), cpus(cpus_),
+	  node(node_), affinity(affinity_), workers_changed(0), rankings(),
+	  rankings_changed(0), scores()
+{
+    // Each ring can hold every message which may be queued at once, with
+    // room to spare for cancelled messages which haven't been removed yet.
+    for (int priority = 0; priority != PRIORITY_LEVELS; ++priority) {
+	injection[priority] = new MpmcQueue<Entry *>(2 * (limit_ + nslots));
+	fair[priority] = fair_ ? new FairQueue<Entry *>() : NULL;
+	by_deadline[priority] =
+		(edf_ && !fair_) ? new DeadlineQueue<Entry *>() : NULL;
+	ordered_mutex[priority].set_name("queue_ordered");
+    }
+    slots.reserve(nslots);
+    for (size_t i = 0; i != nslots; ++i) {
+	// Each slot gets its own pages, which also keeps slots used by
+	// different workers out of each other's cache lines.
+	void * mem = alloc_on_node(sizeof(Slot), node);
+	if (mem == NULL)
+	    throw std::bad_alloc();
+	slots.push_back(new (mem) Slot);
+	if (affinity > 0)
+	    slots.back()->lane = new MpmcQueue<Entry *>(AFFINITY_LANE_SIZE);
+    }
+    stats->add_source(this);
+}
+
+RunQueue::~RunQueue()
+{
+    stats->remove_source(this);
+    for (int priority = 0; priority != PRIORITY_LEVELS; ++priority) {
+	Entry * entry;
+	while (next_entry(priority, entry)) {
+	    unref(entry);
+	}
+	delete injection[priority];
+	delete fair[priority];
+	delete by_deadline[priority];
+    }
+    std::list<Entry *>::iterator i;
+    for (i = pending.begin(); i != pending.end(); ++i) {
+	unref(*i);
+    }
+    for (size_t j = 0; j != slots.size(); ++j) {
+	if (slots[j]->lane != NULL) {
+	    Entry * entry;
+	    while (slots[j]->lane->pop(entry)) {
+		unref(entry);
+	    }
+	    delete slots[j]->lane;
+	}
+	slots[j]->~Slot();
+	free_on_node(slots[j], sizeof(Slot));
+    }
+}
+
+int
+RunQueue::add_worker()
+{
+    for (size_t i = 0; i != slots.size(); ++i) {
+	ContextLocker lock(slots[i]->mutex);
+	if (!slots[i]->active) {
+	    slots[i]->active = true;
+	    slots[i]->stop_requested = false;
+	    slots[i]->wake_requested = false;
+	    slots[i]->busy = true;
+	    set_idle(*slots[i], true);
+	    note_workers_changed();
+	    return int(i);
+	}
+    }
+    return -1;
+}
+
+void
+RunQueue::remove_worker(int slot)
+{
+    Slot & s = *slots[slot];
+    ContextLocker lock(s.mutex);
+    for (s.current = 0; s.current != s.running.size(); ++s.current) {
+	finish(s);
+	s.current_message().clear();
+    }
+    s.running.resize(1);
+    s.current = 0;
+    s.active = false;
+    s.busy = false;
+    set_idle(s, false);
+    note_workers_changed();
+}
+
+void
+RunQueue::stop(int slot)
+{
+    {
+	ContextLocker lock(slots[slot]->mutex);
+	slots[slot]->stop_requested = true;
+	note_workers_changed();
+    }
+    events.notify_mask(slot_mask(slot));
+}
+
+void
+RunQueue::wake(int slot)
+{
+    {
+	ContextLocker lock(slots[slot]->mutex);
+	slots[slot]->wake_requested = true;
+    }
+    events.notify_mask(slot_mask(slot));
+}
+
+void
+RunQueue::set_concurrency(int slot, size_t count)
+{
+    ContextLocker lock(slots[slot]->mutex);
+    slots[slot]->running.resize(count);
+}
+
+void
+RunQueue::switch_message(int slot, size_t index)
+{
+    ContextLocker lock(slots[slot]->mutex);
+    assert(index < slots[slot]->running.size());
+    slots[slot]->current = index;
+}
+
+void
+RunQueue::release(int slot)
+{
+    Slot & s = *slots[slot];
+    ContextLocker lock(s.mutex);
+    finish(s);
+    s.busy = false;
+    s.current_message().clear();
+}
+
+bool
+RunQueue::retire(int slot)
+{
+    // The worker has already stopped counting as idle, so either this sees
+    // a message queued after that, or the thread queueing it sees that the
+    // worker isn't idle (and starts another if needed).
+    if (__sync_fetch_and_add(&queued, 0) > 0)
+	return false;
+    ContextLocker lock(slots[slot]->mutex);
+    slots[slot]->stop_requested = true;
+    note_workers_changed();
+    return true;
+}
+
+bool
+RunQueue::stop_requested(int slot)
+{
+    ContextLocker lock(slots[slot]->mutex);
+    return slots[slot]->stop_requested;
+}
+
+size_t
+RunQueue::backlog()
+{
+    __sync_synchronize();
+    long result = queued - idle;
+    return result > 0 ? size_t(result) : 0;
+}
+
+int
+RunQueue::stop_idle_worker()
+{
+    for (size_t i = 0; i != slots.size(); ++i) {
+	Slot & s = *slots[i];
+	ContextLocker lock(s.mutex);
+	if (s.active && s.idle && !s.busy && !s.stop_requested &&
+	    s.lane_queued == 0) {
+	    s.stop_requested = true;
+	    set_idle(s, false);
+	    note_workers_changed();
+	    lock.unlock();
+	    events.notify_mask(slot_mask(int(i)));
+	    return int(i);
+	}
+    }
+    return -1;
+}
+
+void
+RunQueue::sample_load(LoadSample & result)
+{
+    result.at = get_monotonic_usec();
+    result.wait_usec = __sync_fetch_and_add(&wait_usec, 0);
+    result.taken = __sync_fetch_and_add(&taken, 0);
+    // Count time spent so far on messages which are still being handled,
+    // so that the difference between samples is the busy time between
+    // them.
+    result.busy_usec = __sync_fetch_and_add(&busy_usec, 0);
+    for (size_t i = 0; i != slots.size(); ++i) {
+	ContextLocker lock(slots[i]->mutex);
+	for (size_t j = 0; j != slots[i]->running.size(); ++j) {
+	    long long started_at = slots[i]->running[j].started_at;
+	    if (started_at != 0)
+		result.busy_usec += result.at - started_at;
+	}
+    }
+}
+
+void
+RunQueue::heartbeat(int slot)
+{
+    slots[slot]->heartbeat = get_monotonic_usec();
+}
+
+int
+RunQueue::find_stalls(long long limit_usec, std::vector<Stall> & new_stalls)
+{
+    long long now = get_monotonic_usec();
+    int stalled = 0;
+    for (size_t i = 0; i != slots.size(); ++i) {
+	Slot & s = *slots[i];
+	ContextLocker lock(s.mutex);
+	bool slot_stalled = false;
+	for (size_t j = 0; j != s.running.size(); ++j) {
+	    Running & running = s.running[j];
+	    if (running.started_at == 0 ||
+		now - running.started_at <= limit_usec)
+		continue;
+	    slot_stalled = true;
+	    if (running.stall_reported)
+		continue;
+	    running.stall_reported = true;
+	    Stall stall;
+	    stall.slot = int(i);
+	    stall.msgid = running.msgid;
+	    stall.target = running.target;
+	    stall.running_usec = now - running.started_at;
+	    stall.heartbeat_usec = now - s.heartbeat;
+	    new_stalls.push_back(stall);
+	}
+	if (slot_stalled)
+	    ++stalled;
+    }
+    return stalled;
+}
+
+void
+RunQueue::add_stats(Stats::Totals & totals) const
+{
+    totals.values["queue_depth"] += queued;
+    if (affinity > 0) {
+	totals.values["affinity_hits"] += affinity_hits;
+	totals.values["affinity_spills"] += affinity_spills;
+    }
+}
+
+long long
+RunQueue::take_min_wait()
+{
+    return __sync_lock_test_and_set(&min_wait_usec, -1LL);
+}
+
+void
+RunQueue::note_workers_changed()
+{
+    (void) __sync_fetch_and_add(&workers_changed, 1);
+}
+
+const std::vector<int> &
+RunQueue::preferred_slots(const std::string & key)
+{
+    // Read the count before looking at the workers, so that a change while
+    // they are being ranked causes them to be ranked again next time.
+    unsigned int changed = __sync_fetch_and_add(&workers_changed, 0);
+    if (changed != rankings_changed) {
+	rankings.clear();
+	rankings_changed = changed;
+    }
+    unsigned long long key_hash = hash_key(key);
+    std::map<unsigned long long, std::vector<int> >::iterator i =
+	    rankings.find(key_hash);
+    if (i != rankings.end())
+	return i->second;
+    if (rankings.size() >= AFFINITY_RANKINGS_SIZE)
+	rankings.clear();
+
+    // Rank the workers which aren't stopping by their score for the key,
+    // and keep the best few.
+    scores.clear();
+    for (size_t j = 0; j != slots.size(); ++j) {
+	ContextLocker lock(slots[j]->mutex);
+	if (slots[j]->active && !slots[j]->stop_requested) {
+	    scores.push_back(std::make_pair(score_slot(key_hash, j), int(j)));
+	}
+    }
+    size_t preferred = std::min(scores.size(), size_t(affinity));
+    std::partial_sort(scores.begin(), scores.begin() + preferred,
+		      scores.end(),
+		      std::greater<std::pair<unsigned long long, int> >());
+    std::vector<int> & result = rankings[key_hash];
+    for (size_t j = 0; j != preferred; ++j) {
+	result.push_back(scores[j].second);
+    }
+    return result;
+}
+
+int
+RunQueue::enqueue_preferred(Entry * entry)
+{
+    const std::vector<int> & preferred = preferred_slots(entry->msg.affinity);
+
+    // The slot is locked while the entry is added, so that a worker which
+    // stops counting as idle either finds the entry in its lane or wasn't
+    // given it.  The ranking may be out of date, so the worker is checked
+    // again here.
+    for (size_t i = 0; i != preferred.size(); ++i) {
+	Slot & s = *slots[preferred[i]];
+	ContextLocker lock(s.mutex);
+	if (!s.active || s.stop_requested || !s.idle || s.lane_queued != 0)
+	    continue;
+	entry->lane = preferred[i];
+	if (!s.lane->push(entry)) {
+	    // Full of cancelled entries which the worker hasn't dropped yet.
+	    entry->lane = -1;
+	    continue;
+	}
+	++s.lane_queued;
+	(void) __sync_fetch_and_add(&lane_queued, 1);
+	(void) __sync_fetch_and_add(&queued, 1);
+	return preferred[i];
+    }
+    return -1;
+}
+
+bool
+RunQueue::enqueue(const Message & msg)
+{
+    Entry * entry = new Entry(msg);
+    if (affinity > 0 && !msg.affinity.empty()) {
+	int lane = enqueue_preferred(entry);
+	if (lane != -1) {
+	    (void) __sync_fetch_and_add(&affinity_hits, 1);
+	    pending.push_back(entry);
+	    // Only the lane's worker can take the message, so only it is
+	    // woken.
+	    events.notify_mask(slot_mask(lane));
+	    return true;
+	}
+	(void) __sync_fetch_and_add(&affinity_spills, 1);
+    }
+    if (fair[msg.priority] != NULL) {
+	ContextLocker lock(ordered_mutex[msg.priority]);
+	fair[msg.priority]->push(msg.flow, msg.flow_weight, entry);
+    } else if (by_deadline[msg.priority] != NULL) {
+	ContextLocker lock(ordered_mutex[msg.priority]);
+	by_deadline[msg.priority]->push(msg.deadline, entry);
+    } else if (!injection[msg.priority]->push(entry)) {
+	compact(msg.priority);
+	if (!injection[msg.priority]->push(entry)) {
+	    delete entry;
+	    return false;
+	}
+    }
+    pending.push_back(entry);
+    (void) __sync_fetch_and_add(&queued, 1);
+    events.notify_one();
+    return true;
+}
+
+bool
+RunQueue::next_entry(int priority, Entry *& entry)
+{
+    if (fair[priority] != NULL) {
+	ContextLocker lock(ordered_mutex[priority]);
+	return fair[priority]->pop(entry);
+    }
+    if (by_deadline[priority] != NULL) {
+	ContextLocker lock(ordered_mutex[priority]);
+	return by_deadline[priority]->pop(entry);
+    }
+    return injection[priority]->pop(entry);
+}
+
+bool
+RunQueue::shed(int priority, Message & rejected)
+{
+    Entry * entry;
+    while (true) {
+	if (fair[priority] != NULL) {
+	    // Drop messages from whichever flow has queued the most.
+	    ContextLocker lock(ordered_mutex[priority]);
+	    if (!fair[priority]->pop_longest(entry))
+		break;
+	} else if (by_deadline[priority] != NULL) {
+	    // Drop the message with the least time left, as it is the least
+	    // likely to be handled in time.
+	    ContextLocker lock(ordered_mutex[priority]);
+	    if (!by_deadline[priority]->pop(entry))
+		break;
+	} else if (!injection[priority]->pop(entry)) {
+	    break;
+	}
+	bool claimed = claim(entry, ENTRY_CANCELLED);
+	if (claimed) {
+	    rejected = entry->msg;
+	    (void) __sync_fetch_and_sub(&queued, 1);
+	}
+	unref(entry);
+	if (claimed)
+	    return true;
+    }
+    return false;
+}
+
+void
+RunQueue::compact(int priority)
+{
+    // Only this thread adds to the rings, so everything taken out can be
+    // put back in the same order.
+    std::vector<Entry *> entries;
+    Entry * entry;
+    while (entries.size() != injection[priority]->capacity() &&
+	   injection[priority]->pop(entry)) {
+	entries.push_back(entry);
+    }
+    for (size_t i = 0; i != entries.size(); ++i) {
+	if (entries[i]->state == ENTRY_QUEUED) {
+	    bool pushed = injection[priority]->push(entries[i]);
+	    assert(pushed);
+	    (void) pushed;
+	} else {
+	    unref(entries[i]);
+	}
+    }
+}
+
+void
+RunQueue::prune()
+{
+    std::list<Entry *>::iterator i = pending.begin();
+    while (i != pending.end()) {
+	if ((*i)->state != ENTRY_QUEUED) {
+	    unref(*i);
+	    i = pending.erase(i);
+	} else {
+	    ++i;
+	}
+    }
+}
+
+bool
+RunQueue::push(const Message & msg, Message & rejected)
+{
+    assert(msg.priority >= 0 && msg.priority < PRIORITY_LEVELS);
+
+    // Entries stay in the pending list until the next prune after they
+    // leave the queue; prune when they outnumber the queued entries.
+    if (long(pending.size()) > 2 * queued + 64)
+	prune();
+
+    // Messages which idle workers are about to take don't count towards
+    // the limit.
+    __sync_synchronize();
+    if (queued - idle >= limit) {
+	// Make room by shedding the oldest of the least urgent queued
+	// messages, if the new message is more urgent than it.
+	int priority = PRIORITY_LEVELS - 1;
+	while (priority > msg.priority && !shed(priority, rejected))
+	    --priority;
+	if (priority <= msg.priority) {
+	    rejected = msg;
+	    return true;
+	}
+	if (!enqueue(msg)) {
+	    // Can't happen, since a message was just removed.
+	    assert(false);
+	}
+	return true;
+    }
+    if (!enqueue(msg)) {
+	rejected = msg;
+	return true;
+    }
+    return false;
+}
+
+bool
+RunQueue::take_entry(Slot & own, Entry * entry, Message & result)
+{
+    // The slot is locked while the entry is claimed, so that a cancel
+    // request finds the message either queued or running.
+    bool claimed;
+    long long started_at = 0;
+    {
+	ContextLocker lock(own.mutex);
+	claimed = claim(entry, ENTRY_TAKEN);
+	if (claimed) {
+	    result = entry->msg;
+	    own.start(result);
+	    started_at = get_monotonic_usec();
+	    own.current_message().started_at = started_at;
+	    own.heartbeat = started_at;
+	    set_idle(own, false);
+	    if (entry->lane != -1)
+		--own.lane_queued;
+	}
+    }
+    if (claimed) {
+	if (entry->lane != -1)
+	    (void) __sync_fetch_and_sub(&lane_queued, 1);
+	(void) __sync_fetch_and_sub(&queued, 1);
+	(void) __sync_fetch_and_add(&taken, 1);
+	if (result.queued_at != 0) {
+	    long long wait = started_at - result.queued_at;
+	    (void) __sync_fetch_and_add(&wait_usec, wait);
+	    // Interactive messages go ahead of the others, so their waits
+	    // don't show whether a queue is standing.
+	    long long old_min = min_wait_usec;
+	    while (result.priority != PRIORITY_INTERACTIVE &&
+		   (old_min == -1 || wait < old_min) &&
+		   !__sync_bool_compare_and_swap(&min_wait_usec,
+						 old_min, wait)) {
+		old_min = min_wait_usec;
+	    }
+	}
+    }
+    unref(entry);
+    return claimed;
+}
+
+bool
+RunQueue::take_injected(Slot & own, Message & result)
+{
+    Entry * entry;
+    if (own.lane != NULL) {
+	while (own.lane->pop(entry)) {
+	    if (take_entry(own, entry, result))
+		return true;
+	}
+    }
+    for (int priority = 0; priority != PRIORITY_LEVELS; ++priority) {
+	while (next_entry(priority, entry)) {
+	    if (take_entry(own, entry, result))
+		return true;
+	}
+    }
+    return false;
+}
+
+bool
+RunQueue::has_messages(int slot)
+{
+    // Messages in other workers' lanes are left for those workers.
+    __sync_synchronize();
+    if (queued - lane_queued > 0)
+	return true;
+    ContextLocker lock(slots[slot]->mutex);
+    return slots[slot]->lane_queued > 0 || slots[slot]->stop_requested ||
+	    slots[slot]->wake_requested;
+}
+
+RunQueue::PopResult
+RunQueue::pop(int slot, Message & result, long long idle_timeout)
+{
+    long long deadline = 0;
+    if (idle_timeout > 0)
+	deadline = get_monotonic_usec() + idle_timeout;
+
+    Slot & own = *slots[slot];
+    {
+	ContextLocker lock(own.mutex);
+	finish(own);
+	own.busy = false;
+	set_idle(own, true);
+	own.current_message().clear();
+    }
+
+    PopResult popped;
+    while (true) {
+	if (stop_requested(slot)) {
+	    popped = POP_STOPPED;
+	    break;
+	}
+	if (take_injected(own, result)) {
+	    popped = POP_MESSAGE;
+	    break;
+	}
+	{
+	    ContextLocker lock(own.mutex);
+	    if (own.wake_requested) {
+		own.wake_requested = false;
+		popped = POP_WOKEN;
+		break;
+	    }
+	}
+
+	long long timeout = 0;
+	if (deadline != 0) {
+	    timeout = deadline - get_monotonic_usec();
+	    if (timeout <= 0) {
+		popped = POP_IDLE;
+		break;
+	    }
+	}
+
+	// Check again after registering to wait, so that a message added
+	// or a stop requested in between isn't missed.
+	unsigned int key = events.prepare_wait();
+	if (has_messages(slot)) {
+	    events.cancel_wait();
+	    continue;
+	}
+	(void) events.wait(key, timeout, slot_mask(slot));
+    }
+    if (popped != POP_MESSAGE) {
+	ContextLocker lock(own.mutex);
+	set_idle(own, false);
+    }
+    return popped;
+}
+
+CancelResult
+RunQueue::cancel(int connection_num, const std::string & msgid)
+{
+    CancelResult result = CANCEL_NOT_FOUND;
+    long removed = 0;
+    std::list<Entry *>::iterator i = pending.begin();
+    while (i != pending.end()) {
+	Entry * entry = *i;
+	if (entry->msg.connection_num == connection_num &&
+	    (msgid.empty() || entry->msg.msgid == msgid) &&
+	    claim(entry, ENTRY_CANCELLED)) {
+	    ++removed;
+	    result = CANCEL_QUEUED;
+	    if (entry->lane != -1) {
+		ContextLocker lock(slots[entry->lane]->mutex);
+		--slots[entry->lane]->lane_queued;
+		(void) __sync_fetch_and_sub(&lane_queued, 1);
+	    }
+	}
+	if (entry->state != ENTRY_QUEUED) {
+	    unref(entry);
+	    i = pending.erase(i);
+	} else {
+	    ++i;
+	}
+    }
+    if (removed != 0) {
+	(void) __sync_fetch_and_sub(&queued, removed);
+    }
+    for (size_t j = 0; j != slots.size(); ++j) {
+	Slot & s = *slots[j];
+	ContextLocker lock(s.mutex);
+	for (size_t k = 0; k != s.running.size(); ++k) {
+	    Running & running = s.running[k];
+	    if (running.connection_num == connection_num &&
+		!running.responded &&
+		(msgid.empty() || running.msgid == msgid)) {
+		running.cancelled = true;
+		result = CANCEL_RUNNING;
+	    }
+	}
+    }
+    return result;
+}
+
+bool
+RunQueue::cancelled(int slot)
+{
+    ContextLocker lock(slots[slot]->mutex);
+    return slots[slot]->current_message().cancelled;
+}
+
+bool
+RunQueue::claim_response(int slot, int connection_num)
+{
+    Slot & s = *slots[slot];
+    ContextLocker lock(s.mutex);
+    Running & running = s.current_message();
+    if (connection_num != running.connection_num)
+	return true;
+    if (running.cancelled)
+	return false;
+    running.responded = true;
+    return true;
+}
@@ -0,0 +1,609 @@
+/** @file runqueue.h
+ * @brief The queue of messages for a group of workers.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_RUNQUEUE_H
+#define XAPSRV_INCLUDED_RUNQUEUE_H
+
+#include <cstddef>
+#include "deadlinequeue.h"
+#include "eventcount.h"
+#include "fairqueue.h"
+#include <list>
+#include "locker.h"
+#include <map>
+#include "mpmcqueue.h"
+#include "server.h"
+#include "stats.h"
+#include <string>
+#include <vector>
+
+/** The messages for a group of workers.
+ *
+ *  Workers pull messages from the queue themselves, rather than being sent
+ *  them.  Messages wait in lock-free rings, one for each priority level, so
+ *  adding a message never blocks, and only enters the kernel to wake a
+ *  worker when one is sleeping.  Idle workers sleep on an EventCount.
+ *
+ *  Each queued message is also kept in a list used to cancel it, which is
+ *  only touched by the thread adding messages.  A queued message is claimed
+ *  either by a worker taking it or by cancelling it, with a single
+ *  compare-and-swap, so it is never both handled and cancelled.
+ *
+ *  Each worker has a slot in the queue, which also holds the state of the
+ *  message it is handling, so that a message is never seen as neither
+ *  queued nor running while it is being cancelled, and so that a watchdog
+ *  can find messages which have been running for too long.  A worker which switches
+ *  between several messages (see WorkerThread) holds the state of each in
+ *  its slot, and tells the queue which one it is working on.
+ *
+ *  Alternatively, the queue may share its workers fairly between the flows
+ *  of messages (see Message::flow): messages of each priority then wait in
+ *  a FairQueue instead of a ring, which workers lock to take a message.
+ *  Or the queue may order each priority's messages by their deadlines (see
+ *  Message::deadline), in a DeadlineQueue which is locked in the same way.
+ *
+ *  Messages may also prefer particular workers (see Message::affinity), so
+ *  that messages for a database are mostly handled by the same few workers,
+ *  which keep it open and cached.  The preferred workers for a key are the
+ *  highest scoring by rendezvous hashing, so that adding or removing a worker
+ *  only moves the keys it gains or loses.  A message goes to the first of
+ *  its preferred workers which is idle, through a small ring (a lane) which
+ *  only that worker takes from; if none is idle, it waits for any worker as
+ *  usual.
+ *
+ *  The queue may be tied to a set of CPUs, which its workers run on.  If
+ *  those CPUs are all on one NUMA node, the slots are allocated from that
+ *  node's memory, so that the workers don't contend for remote memory.
+ *
+ *  The queue reports the number of messages waiting, and how many messages
+ *  went to a preferred worker, from its own atomic counters when the
+ *  server's statistics are described, rather than updating the statistics
+ *  for every message.
+ *
+ *  push() and cancel() must only be called by one thread (the main server
+ *  thread); the other methods are safe to call from any thread.
+ */
+class RunQueue : public StatsSource {
+    struct Entry;
+
+    /// A message being handled by a worker.
+    struct Running {
+	/// The connection number of the message, or -1 if there is none.
+	int connection_num;
+
+	/// The id of the message.
+	std::string msgid;
+
+	/// The target of the message, to report if it stalls.
+	std::string target;
+
+	/// The time the message was taken, from get_monotonic_usec(), or 0.
+	long long started_at;
+
+	/// Flag, set to true once the message has been reported as stalled.
+	bool stall_reported;
+
+	/// Flag, set to true when the message has been cancelled.
+	bool cancelled;
+
+	/// Flag, set to true when a response to the message has been sent.
+	bool responded;
+
+	Running();
+
+	/// Forget the message.
+	void clear();
+    };
+
+    /// A worker's slot in the queue.
+    struct Slot {
+	/// Mutex which must be held when accessing the members below.
+	Locker mutex;
+
+	/// Flag, set to true while a worker is using the slot.
+	bool active;
+
+	/// Flag, set to true when the worker has been asked to stop.
+	bool stop_requested;
+
+	/// Flag, set to true while the worker is handling a message.
+	bool busy;
+
+	/** Flag, set to true while the worker counts towards the number of
+	 *  idle workers: while it is warming up or waiting for a message.
+	 */
+	bool idle;
+
+	/** The messages the worker is handling: one for each message it can
+	 *  handle at once.
+	 */
+	std::vector<Running> running;
+
+	/// The index in running of the message the worker is working on.
+	size_t current;
+
+	/// Flag, set to true when the worker has been asked to stop waiting
+	/// for a message, without stopping.
+	bool wake_requested;
+
+	/** The last time the worker showed it was making progress, from
+	 *  get_monotonic_usec(): when it took a message, or checked whether
+	 *  one had been cancelled.
+	 *
+	 *  This is written by the worker without holding the mutex.
+	 */
+	volatile long long heartbeat;
+
+	/** Messages for this worker in particular, or NULL if messages don't
+	 *  prefer particular workers.
+	 *
+	 *  Only the queue's main thread adds to the lane, and only the
+	 *  worker takes from it, so the lane itself needs no lock.
+	 */
+	MpmcQueue<Entry *> * lane;
+
+	/// The number of messages in the lane which are still queued.
+	long lane_queued;
+
+	Slot();
+
+	/// Note that the worker has started handling a message.
+	void start(const Message & msg);
+
+	/// Get the message the worker is working on.
+	Running & current_message() { return running[current]; }
+    };
+
+    /** Set whether a slot's worker counts as idle.
+     *
+     *  The slot's mutex must be held.
+     */
+    void set_idle(Slot & slot, bool value);
+
+    /// The states of a queued message.
+    enum EntryState {
+	/// Waiting for a worker.
+	ENTRY_QUEUED,
+
+	/// Taken by a worker.
+	ENTRY_TAKEN,
+
+	/// Cancelled, or dropped to make room for a more urgent message.
+	ENTRY_CANCELLED
+    };
+
+    /** A queued message.
+     *
+     *  Entries are referenced by a ring and by the list of pending entries,
+     *  and are deleted when both have dropped them.
+     */
+    struct Entry {
+	Message msg;
+
+	/// The state of the entry - one of the EntryState values.
+	volatile int state;
+
+	/// The number of references to the entry.
+	volatile int refs;
+
+	/// The slot whose lane holds the entry, or -1 if it is in a ring or
+	/// fair queue.
+	int lane;
+
+	Entry(const Message & msg_)
+		: msg(msg_), state(ENTRY_QUEUED), refs(2), lane(-1) {}
+    };
+
+    /// Drop a reference to an entry, deleting it if it was the last.
+    static void unref(Entry * entry);
+
+    /// Move an entry out of the queued state.  Returns false if it had
+    /// already left it.
+    static bool claim(Entry * entry, int new_state);
+
+    /// Statistics to report to.
+    Stats * stats;
+
+    /// The most messages to queue, beyond those idle workers will take.
+    long limit;
+
+    /// Messages waiting for a worker, with one ring for each priority level.
+    MpmcQueue<Entry *> * injection[PRIORITY_LEVELS];
+
+    /** Messages waiting for a worker, by flow, with one queue for each
+     *  priority level, if workers are shared fairly between flows.
+     *
+     *  If not, these are NULL, and the rings are used instead.
+     */
+    FairQueue<Entry *> * fair[PRIORITY_LEVELS];
+
+    /** Messages waiting for a worker, by deadline, with one queue for each
+     *  priority level, if messages are taken in order of their deadlines.
+     *
+     *  If not, these are NULL.
+     */
+    DeadlineQueue<Entry *> * by_deadline[PRIORITY_LEVELS];
+
+    /// Mutexes which must be held when using the fair or deadline queues.
+    Locker ordered_mutex[PRIORITY_LEVELS];
+
+    /// The number of messages waiting for a worker.
+    volatile long queued;
+
+    /// The number of those messages which are waiting in a worker's lane.
+    volatile long lane_queued;
+
+    /// The number of workers warming up or waiting for a message.
+    volatile long idle;
+
+    /// Used by workers to sleep until messages arrive.
+    EventCount events;
+
+    /// The total time workers have spent on messages they have finished.
+    volatile long long busy_usec;
+
+    /// The total time messages waited before being taken by a worker.
+    volatile long long wait_usec;
+
+    /// The number of messages taken by workers.
+    volatile long long taken;
+
+    /// The shortest time a message other than an interactive one waited
+    /// before being taken since take_min_wait() was last called, or -1 if
+    /// none has been taken.
+    volatile long long min_wait_usec;
+
+    /// The number of messages which went to one of their preferred workers.
+    volatile long long affinity_hits;
+
+    /// The number of messages with an affinity key which went to any worker.
+    volatile long long affinity_spills;
+
+    /** Entries which may still be queued, so that they can be cancelled.
+     *
+     *  Only used by the thread which adds messages.
+     */
+    std::list<Entry *> pending;
+
+    /// The slots for workers.  The number of slots never changes.
+    std::vector<Slot *> slots;
+
+    /// The CPUs which the workers run on, or empty for any CPU.
+    std::vector<int> cpus;
+
+    /// The NUMA node which the slots are allocated from, or -1 for any.
+    int node;
+
+    /// The number of workers preferred by each affinity key, or 0 to ignore
+    /// the keys.
+    int affinity;
+
+    /// Incremented whenever a worker starts, stops or is asked to stop, so
+    /// that the affinity rankings are made again.
+    volatile unsigned int workers_changed;
+
+    /** The workers preferred for each hashed affinity key, best first.
+     *
+     *  Only used by the thread which adds messages.
+     */
+    std::map<unsigned long long, std::vector<int> > rankings;
+
+    /// The value of workers_changed when the rankings were made.
+    unsigned int rankings_changed;
+
+    /// Space to score the workers in, when ranking them for a key.
+    std::vector<std::pair<unsigned long long, int> > scores;
+
+    /// Note that a worker has started, stopped or been asked to stop.
+    void note_workers_changed();
+
+    /** Get the workers preferred for an affinity key, best first.
+     *
+     *  The ranking is remembered until the workers change.
+     */
+    const std::vector<int> & preferred_slots(const std::string & key);
+
+    /** Add an entry to the lane of the first idle worker it prefers.
+     *
+     *  @returns the slot of the worker whose lane the entry was added to,
+     *  or -1 if it wasn't added to a lane.
+     */
+    int enqueue_preferred(Entry * entry);
+
+    /// Add a message to the ring, fair queue or deadline queue for its
+    /// priority, or to a worker's lane.
+    bool enqueue(const Message & msg);
+
+    /// Remove the next entry for a worker from the ring, fair queue or
+    /// deadline queue for a priority.
+    bool next_entry(int priority, Entry *& entry);
+
+    /// Drop the oldest queued message of a priority, to make room.
+    bool shed(int priority, Message & rejected);
+
+    /// Remove cancelled and taken entries from a full ring.
+    void compact(int priority);
+
+    /// Remove entries which are no longer queued from the pending list.
+    void prune();
+
+    /** Claim an entry for a worker, dropping the reference the worker
+     *  took it with.
+     *
+     *  @retval true if the entry was still queued.
+     */
+    bool take_entry(Slot & own, Entry * entry, Message & result);
+
+    /// Take the message from the worker's lane, if any, or otherwise the
+    /// most urgent message from the rings, for a worker.
+    bool take_injected(Slot & own, Message & result);
+
+    /// Check whether a worker may have a message to take, or has been
+    /// asked to stop or wake.
+    bool has_messages(int slot);
+
+    /// Check whether the worker using a slot has been asked to stop.
+    bool stop_requested(int slot);
+
+    /** Note that a slot's worker has finished the message it is working
+     *  on, if it had one.
+     *
+     *  The slot's mutex must be held.
+     */
+    void finish(Slot & slot);
+
+    // Don't allow copying or assignment.
+    RunQueue(const RunQueue & other);
+    void operator=(const RunQueue & other);
+  public:
+    /** Totals describing the load on a queue since it was created.
+     *
+     *  Subtract two samples to get the load between them.
+     */
+    struct LoadSample {
+	/// The time the sample was taken, from get_monotonic_usec().
+	long long at;
+
+	/// The total time workers have spent handling messages, including
+	/// messages which are still being handled.
+	long long busy_usec;
+
+	/// The total time messages waited before being taken by a worker.
+	long long wait_usec;
+
+	/// The number of messages taken by workers.
+	long long taken;
+
+	LoadSample() : at(0), busy_usec(0), wait_usec(0), taken(0) {}
+    };
+
+    /// A message which has been running for longer than it should.
+    struct Stall {
+	/// The slot of the worker handling the message.
+	int slot;
+
+	/// The id of the message.
+	std::string msgid;
+
+	/// The target of the message.
+	std::string target;
+
+	/// The time the message has been running for.
+	long long running_usec;
+
+	/// The time since the worker's last heartbeat.
+	long long heartbeat_usec;
+    };
+
+    /// The result of waiting for a message.
+    enum PopResult {
+	/// A message was found.
+	POP_MESSAGE,
+
+	/// The worker has been asked to stop.
+	POP_STOPPED,
+
+	/// No message arrived before the idle timeout.
+	POP_IDLE,
+
+	/// The worker was woken by wake().
+	POP_WOKEN
+    };
+
+    /** Create a queue.
+     *
+     *  @param nslots The maximum number of workers which can use the queue.
+     *  @param limit_ The most messages to hold, not counting messages which
+     *  idle workers are about to take.
+     *  @param stats_ Statistics to report to.
+     *  @param cpus_ The CPUs which the workers run on, or empty for any.
+     *  @param node_ The NUMA node to allocate the slots from, or -1 for any.
+     *  @param fair_ True to share the workers fairly between flows.
+     *  @param affinity_ The number of workers preferred by messages with
+     *  each affinity key, or 0 to ignore the keys.
+     *  @param edf_ True to take the messages of each priority in order of
+     *  their deadlines.  Ignored if fair_ is true.
+     */
+    RunQueue(size_t nslots, size_t limit_, Stats * stats_,
+	     const std::vector<int> & cpus_ = std::vector<int>(),
+	     int node_ = -1, bool fair_ = false, int affinity_ = 0,
+	     bool edf_ = false);
+
+    ~RunQueue();
+
+    void add_stats(Stats::Totals & totals) const;
+
+    /// Get the CPUs which the workers run on, or an empty list for any.
+    const std::vector<int> & get_cpus() const { return cpus; }
+
+    /// Get the NUMA node which the queue is placed on, or -1 for any.
+    int get_node() const { return node; }
+
+    /** Allocate a slot for a new worker.
+     *
+     *  The worker counts as idle while it warms up, since it will take a
+     *  message as soon as it is ready, so that a new worker isn't started
+     *  for every message which arrives meanwhile.
+     *
+     *  @retval the slot number, or -1 if all the slots are in use.
+     */
+    int add_worker();
+
+    /// Release the slot of a worker which has exited.
+    void remove_worker(int slot);
+
+    /** Ask the worker using a slot to stop.
+     *
+     *  The worker stops when it next waits for a message.
+     */
+    void stop(int slot);
+
+    /** Wake a worker waiting for a message, without stopping it.
+     *
+     *  The worker's current or next call to pop() returns POP_WOKEN, unless
+     *  a message is ready for it.
+     */
+    void wake(int slot);
+
+    /** Set the number of messages a worker can handle at once.
+     *
+     *  The worker uses switch_message() to say which of them it is working
+     *  on.  This must be called before the worker takes a message.
+     */
+    void set_concurrency(int slot, size_t count);
+
+    /** Note which of its messages a worker is working on.
+     *
+     *  pop(), cancelled() and claim_response() then refer to that message.
+     *
+     *  @param index The index of the message, below the number passed to
+     *  set_concurrency().
+     */
+    void switch_message(int slot, size_t index);
+
+    /// Note that a worker has finished the message it is working on.
+    void release(int slot);
+
+    /** Ask a worker which has given up waiting to stop, if there are no
+     *  messages waiting.
+     *
+     *  @retval true if the worker was asked to stop.
+     */
+    bool retire(int slot);
+
+    /** Get the number of queued messages which no idle (or warming up)
+     *  worker is about to take.
+     */
+    size_t backlog();
+
+    /** Ask an idle worker to stop.
+     *
+     *  @returns the slot of the worker, or -1 if no worker is idle.
+     */
+    int stop_idle_worker();
+
+    /// Get the load on the queue so far.
+    void sample_load(LoadSample & result);
+
+    /** Note that a worker is making progress on its message.
+     *
+     *  Workers need not hold the slot's mutex to call this.
+     */
+    void heartbeat(int slot);
+
+    /** Find the workers handling a message which has been running for
+     *  longer than a limit.
+     *
+     *  @param limit_usec The longest a message may run for, in
+     *  microseconds.
+     *  @param new_stalls Messages which have run over the limit since the
+     *  last call are appended to this.  Each message is only reported once.
+     *
+     *  @returns the number of workers handling a message which is over the
+     *  limit, whether or not it was reported before.
+     */
+    int find_stalls(long long limit_usec, std::vector<Stall> & new_stalls);
+
+    /** Get the shortest time a message waited before being taken by a
+     *  worker, since this was last called.
+     *
+     *  Interactive messages aren't counted, since they don't wait behind
+     *  other messages.
+     *
+     *  @returns the wait in microseconds, or -1 if no message was taken.
+     */
+    long long take_min_wait();
+
+    /** Add a message to the queue.
+     *
+     *  If the queue already holds `limit` messages more than there are idle
+     *  workers, either the message or the oldest queued message of the least
+     *  urgent priority (if that is less urgent than the message) is rejected
+     *  instead.  If workers are shared fairly between flows, the message
+     *  rejected from the queue is the oldest of the flow with the most
+     *  queued messages of that priority; if messages are ordered by
+     *  deadline, it is the one with the earliest deadline, which is the
+     *  least likely to be handled in time.
+     *
+     *  @param rejected Set to the rejected message, if any.
+     *
+     *  @retval true if a message was rejected.
+     */
+    bool push(const Message & msg, Message & rejected);
+
+    /** Wait for a message for a worker.
+     *
+     *  @param slot The worker's slot.
+     *  @param result Set to the message found, if any.
+     *  @param idle_timeout The number of microseconds to wait for a message
+     *  before giving up, or 0 to wait indefinitely.
+     */
+    PopResult pop(int slot, Message & result, long long idle_timeout);
+
+    /** Remove queued messages, and flag running messages as cancelled.
+     *
+     *  @param connection_num The connection which the messages came from.
+     *  @param msgid The id of the message to cancel.  If empty, all
+     *  messages from the connection are cancelled.
+     *
+     *  @returns the result for the message which was affected most.
+     */
+    CancelResult cancel(int connection_num, const std::string & msgid);
+
+    /// Check if the message being handled by a worker has been cancelled.
+    bool cancelled(int slot);
+
+    /** Check whether a response from a worker should be sent.
+     *
+     *  Responses to the message being handled are discarded if it has been
+     *  cancelled; otherwise, the message is marked as responded to, so that
+     *  it can no longer be cancelled.
+     *
+     *  @retval true if the response should be sent.
+     */
+    bool claim_response(int slot, int connection_num);
+};
+
+#endif /* XAPSRV_INCLUDED_RUNQUEUE_H */
@@ -28,9 +28,14 @@
 #include "serverinternal.h"
 
 #include <algorithm>
+#include <arpa/inet.h>
 #include <assert.h>
+#include <climits>
+#include <cstring>
 #include <errno.h>
+#include <fcntl.h>
 #include "io_wrappers.h"
+#include <netinet/in.h>
 #include <pthread.h>
 #include "signals.h"
 #include "settings.h"
@@ -38,22 +43,99 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include "topology.h"
+#include <utility>
 #include "utils.h"
+#include <vector>
 #include "worker.h"
 #include "workerpool.h"
 
+/// The number of times to check for stalled workers in each stall timeout.
+#define WATCHDOG_CHECKS_PER_TIMEOUT 4
+
+/// The period over which the main loop's utilization is measured, in usec.
+#define LOOP_UTILIZATION_PERIOD 1000000
+
+/// Check whether an error from a non-blocking file descriptor only means
+/// that it wasn't ready after all.
+static bool
+would_block(int err)
+{
+#if EAGAIN != EWOULDBLOCK
+    if (err == EWOULDBLOCK)
+	return true;
+#endif
+    return err == EAGAIN;
+}
+
+int
+Dispatcher::group_id(const std::string & group)
+{
+    return pool->group_id(group);
+}
+
 void
-Dispatcher::send_to_worker(const std::string & group, const Message & msg)
+Dispatcher::send_to_worker(int group, const Message & msg)
 {
     pool->send_to_worker(group, msg);
 }
 
+CancelResult
+Dispatcher::cancel_message(int connection_num, const std::string & msgid)
+{
+    return pool->cancel_message(connection_num, msgid);
+}
+
+bool
+Dispatcher::group_overloaded(int group, long long & retry_after_usec)
+{
+    return pool->overloaded(group, retry_after_usec);
+}
+
 void
 Dispatcher::send_response(int connection_num, const std::string & msg)
 {
     server->queue_response(connection_num, msg);
 }
 
+void
+Dispatcher::write_response(int connection_num, const std::string & msg)
+{
+    server->write_to_connection(connection_num, msg);
+}
+
+PayloadStreamPtr
+Dispatcher::stream_payload(int connection_num, size_t length)
+{
+    return server->start_stream(connection_num, length);
+}
+
+void
+Dispatcher::connection_closed(int connection_num)
+{
+    (void) connection_num;
+}
+
+int
+Dispatcher::min_workers(const std::string & group)
+{
+    (void) group;
+    return 0;
+}
+
+void
+Dispatcher::startup_groups(std::vector<std::string> & groups)
+{
+    (void) groups;
+}
+
+std::string
+Dispatcher::worker_cpus(const std::string & group)
+{
+    (void) group;
+    return std::string();
+}
+
 Server::Server(const ServerSettings & settings, Dispatcher * dispatcher)
 	: internal(new ServerInternal(settings, dispatcher))
 {
@@ -81,22 +163,31 @@ ServerInternal::ServerInternal(const ServerSettings & settings_, Dispatcher * di
 	: settings(settings_),
 	  dispatcher(dispatcher_),
 	  logger(settings_.log_filename),
+	  stats(),
 	  started(false),
 	  shutting_down(false),
 	  nudge_write_end(-1),
 	  nudge_read_end(-1),
 	  error_message(),
-	  workers(&logger, dispatcher_, this)
+	  connections(),
+	  listen_fd(-1),
+	  next_connection_num(1),
+	  workers(&logger, dispatcher_, this),
+	  outgoing_message_mutex("responses"),
+	  outgoing_messages(),
+	  responses_queued_at(0),
+	  logged_lock_counts(),
+	  loop_stats()
 {
     dispatcher->server = this;
     dispatcher->pool = &workers;
     dispatcher->logger = &logger;
-    pthread_mutex_init(&outgoing_message_mutex, NULL);
+    dispatcher->settings = &settings;
+    dispatcher->stats = &stats;
 }
 
 ServerInternal::~ServerInternal()
 {
-    pthread_mutex_destroy(&outgoing_message_mutex);
 }
 
 bool
@@ -108,6 +199,7 @@ ServerInternal::run()
     }
     started = true;
     logger.info("Starting server");
+    LockProfile::enabled = settings.lock_stats_interval > 0;
 
     // Create the socket used for signalling a shutdown request.
     {
@@ -121,8 +213,23 @@ ServerInternal::run()
 	nudge_read_end = fds[1];
     }
     set_up_signal_handlers(this);
+    if (!settings.reactor_cpus.empty()) {
+	std::vector<int> cpus;
+	(void) parse_cpu_list(settings.reactor_cpus, cpus);
+	int ret = bind_thread_to_cpus(cpus);
+	if (ret != 0) {
+	    logger.error("Can't handle connections on CPUs " +
+			 settings.reactor_cpus + ": " + get_sys_error(ret));
+	}
+    }
     try {
 	if (start_listening()) {
+	    std::vector<std::string> groups;
+	    dispatcher->startup_groups(groups);
+	    std::vector<std::string>::const_iterator i;
+	    for (i = groups.begin(); i != groups.end(); ++i) {
+		workers.start_group(*i);
+	    }
 	    mainloop();
 	    stop_listening();
 	    workers.stop();
@@ -149,7 +256,25 @@ ServerInternal::run()
 void
 ServerInternal::mainloop()
 {
-    while (!connections.empty()) {
+    long long autoscale_interval = settings.autoscale_interval * 1000000LL;
+    long long next_autoscale = get_monotonic_usec() + autoscale_interval;
+    // Check for stalled workers a few times per stall timeout, so that a
+    // stall is noticed soon after the timeout passes.
+    long long watchdog_interval = 0;
+    if (settings.stall_timeout > 0) {
+	watchdog_interval = std::max(settings.stall_timeout * 1000LL /
+				     WATCHDOG_CHECKS_PER_TIMEOUT, 1000LL);
+    }
+    long long next_watchdog = get_monotonic_usec() + watchdog_interval;
+    long long lock_stats_interval = settings.lock_stats_interval * 1000000LL;
+    long long next_lock_stats = get_monotonic_usec() + lock_stats_interval;
+
+    // Timings of the loop itself, to show when this thread is the bottleneck.
+    long long last_poll_start = 0;
+    long long woke = 0;
+    long long busy_usec = 0;
+    long long utilization_start = get_monotonic_usec();
+    while (!connections.empty() || listen_fd != -1) {
 	int maxfd = 0;
 	fd_set rfds;
 	fd_set wfds;
@@ -158,13 +283,27 @@ ServerInternal::mainloop()
 	FD_SET(nudge_read_end, &rfds);
 	if (nudge_read_end > maxfd)
 	    maxfd = nudge_read_end;
+	if (listen_fd != -1) {
+	    FD_SET(listen_fd, &rfds);
+	    if (listen_fd > maxfd)
+		maxfd = listen_fd;
+	}
 
 	// Mark all the filedescriptors that Connections are interested in.
 	std::map<int, Connection>::iterator i;
 	for (i = connections.begin(); i != connections.end(); ++i) {
-	    FD_SET(i->second.read_fd, &rfds);
-	    if (i->second.read_fd > maxfd)
-		maxfd = i->second.read_fd;
+	    // Stop reading from connections which are streaming to a worker
+	    // which hasn't caught up yet: the worker will nudge us when it has.
+	    if (i->second.stream.get() == NULL ||
+		i->second.stream->has_space()) {
+		i->second.read_paused = false;
+		FD_SET(i->second.read_fd, &rfds);
+		if (i->second.read_fd > maxfd)
+		    maxfd = i->second.read_fd;
+	    } else if (!i->second.read_paused) {
+		i->second.read_paused = true;
+		stats.incr("stream_read_pauses");
+	    }
 	    if (!i->second.write_buf.empty()) {
 		FD_SET(i->second.write_fd, &wfds);
 		if (i->second.write_fd > maxfd)
@@ -172,13 +311,76 @@ ServerInternal::mainloop()
 	    }
 	}
 
-	// Wait for one of the filedescriptors to be ready
-	int ret = select(maxfd + 1, &rfds, &wfds, NULL, NULL);
+	// Wait for one of the filedescriptors to be ready, or until the
+	// workers are next due to be resized or checked for stalls, or lock
+	// statistics are due to be logged.
+	struct timeval timeout;
+	struct timeval * timeout_ptr = NULL;
+	if (autoscale_interval > 0 || watchdog_interval > 0 ||
+	    lock_stats_interval > 0) {
+	    long long next_timer = LLONG_MAX;
+	    if (autoscale_interval > 0)
+		next_timer = next_autoscale;
+	    if (watchdog_interval > 0)
+		next_timer = std::min(next_timer, next_watchdog);
+	    if (lock_stats_interval > 0)
+		next_timer = std::min(next_timer, next_lock_stats);
+	    long long wait = std::max(next_timer - get_monotonic_usec(), 0LL);
+	    timeout.tv_sec = wait / 1000000;
+	    timeout.tv_usec = wait % 1000000;
+	    timeout_ptr = &timeout;
+	}
+
+	// Everything since the last wakeup was work done by this thread.
+	long long poll_start = get_monotonic_usec();
+	if (woke != 0) {
+	    loop_stats.histograms["loop_busy_us"].record(poll_start - woke);
+	    loop_stats.histograms["loop_iteration_us"].record(
+		    poll_start - last_poll_start);
+	    busy_usec += poll_start - woke;
+	}
+	if (poll_start - utilization_start >= LOOP_UTILIZATION_PERIOD) {
+	    stats.set("loop_utilization",
+		      busy_usec * 100 / (poll_start - utilization_start));
+	    busy_usec = 0;
+	    utilization_start = poll_start;
+	}
+	last_poll_start = poll_start;
+	publish_loop_stats();
+
+	int ret = select(maxfd + 1, &rfds, &wfds, NULL, timeout_ptr);
+	woke = get_monotonic_usec();
+	loop_stats.histograms["loop_poll_us"].record(woke - poll_start);
 	if (ret == -1) {
 	    if (errno == EINTR) continue;
 	    set_sys_error("Select failed", errno);
 	    return;
 	}
+	int events = ret;
+	if (autoscale_interval > 0 && woke >= next_autoscale) {
+	    loop_stats.histograms["loop_timer_lag_us"].record(
+		    get_monotonic_usec() - next_autoscale);
+	    ++events;
+	    workers.autoscale();
+	    next_autoscale = get_monotonic_usec() + autoscale_interval;
+	}
+	if (watchdog_interval > 0 && woke >= next_watchdog) {
+	    loop_stats.histograms["loop_timer_lag_us"].record(
+		    get_monotonic_usec() - next_watchdog);
+	    ++events;
+	    workers.check_stalls();
+	    next_watchdog = get_monotonic_usec() + watchdog_interval;
+	}
+	if (lock_stats_interval > 0 && woke >= next_lock_stats) {
+	    loop_stats.histograms["loop_timer_lag_us"].record(
+		    get_monotonic_usec() - next_lock_stats);
+	    ++events;
+	    log_lock_stats();
+	    next_lock_stats = get_monotonic_usec() + lock_stats_interval;
+	}
+	if (events > 0) {
+	    loop_stats.histograms["loop_events"].record(events);
+	}
 	if (ret == 0) {
 	    continue;
 	}
@@ -195,23 +397,72 @@ ServerInternal::mainloop()
 		logger.info("Shutting down");
 		return;
 	    }
-	    // Currently, the only other thing we can get is 'R', indicating
-	    // that there are responses to deliver.
-	    if (!dispatch_responses())
-		return;
+	    // The only other things we can get are 'R', indicating that there
+	    // are responses to deliver, 'X', indicating that workers have
+	    // exited and need joining, and 'W', indicating that a stream has
+	    // space for more data (which needs no action other than waking up).
+	    if (result.find('R') != result.npos) {
+		dispatch_responses();
+	    }
+	    if (result.find('X') != result.npos) {
+		workers.join_exited();
+	    }
+	}
+
+	// Check for new connections.
+	if (listen_fd != -1 && FD_ISSET(listen_fd, &rfds)) {
+	    accept_connection();
 	}
 
 	// Check each connection's file descriptors.
 	std::set<int> closed_connections;
 	for (i = connections.begin(); i != connections.end(); ++i) {
-	    if (FD_ISSET(i->second.read_fd, &rfds)) {
+	    if (FD_ISSET(i->second.read_fd, &rfds) ||
+		FD_ISSET(i->second.write_fd, &wfds)) {
+		loop_stats.histograms["loop_fd_lag_us"].record(
+			get_monotonic_usec() - woke);
+	    }
+	    if (FD_ISSET(i->second.read_fd, &rfds) &&
+		i->second.stream.get() != NULL) {
+		// Don't read past the end of the streamed message.
+		std::string chunk;
+		int bytes_read = io_read_append(chunk, i->second.read_fd,
+			std::min(i->second.stream_remaining, size_t(65536)));
+		if (bytes_read < 0) {
+		    // Connections are non-blocking, so select may report one
+		    // readable which then has nothing to read.
+		    if (!would_block(errno)) {
+			logger.syserr("Failed to read from fd " +
+				      str(i->second.read_fd) +
+				      " for connection " +
+				      str(i->first));
+			closed_connections.insert(i->first);
+		    }
+		} else if (bytes_read == 0) {
+		    logger.info("Connection " + str(i->first) + " closed");
+		    closed_connections.insert(i->first);
+		} else {
+		    loop_stats.values["stream_bytes"] += bytes_read;
+		    i->second.stream->write(chunk);
+		    i->second.stream_remaining -= bytes_read;
+		    if (i->second.stream_remaining == 0) {
+			i->second.stream->finish();
+			i->second.stream = PayloadStreamPtr();
+		    }
+		}
+	    } else if (FD_ISSET(i->second.read_fd, &rfds)) {
 		int bytes_read = io_read_append(i->second.read_buf,
 						i->second.read_fd, 65536);
 		if (bytes_read < 0) {
-		    logger.syserr("Failed to read from fd " +
-				  str(i->second.read_fd) +
-				  " for connection " +
-				  str(i->first));
+		    // Connections are non-blocking, so select may report one
+		    // readable which then has nothing to read.
+		    if (!would_block(errno)) {
+			logger.syserr("Failed to read from fd " +
+				      str(i->second.read_fd) +
+				      " for connection " +
+				      str(i->first));
+			closed_connections.insert(i->first);
+		    }
 		} else if (bytes_read == 0) {
 		    logger.info("Connection " + str(i->first) + " closed");
 		    closed_connections.insert(i->first);
@@ -223,15 +474,15 @@ ServerInternal::mainloop()
 	    }
 	    if (FD_ISSET(i->second.write_fd, &wfds)) {
 		int written = io_write_some(i->second.write_fd, i->second.write_buf);
-		if (written <= 0) {
+		if (written > 0) {
+		    assert((size_t)written <= i->second.write_buf.size());
+		    i->second.write_buf.erase(0, written);
+		} else if (written == 0 || !would_block(errno)) {
 		    logger.syserr("Failed to write to fd " +
 				  str(i->second.write_fd) +
 				  " for connection " +
 				  str(i->first));
 		    closed_connections.insert(i->first);
-		} else {
-		    assert((size_t)written <= i->second.write_buf.size());
-		    i->second.write_buf.erase(0, written);
 		}
 	    }
 	}
@@ -240,12 +491,63 @@ ServerInternal::mainloop()
 	     j != closed_connections.end(); ++j) {
 	    i = connections.find(*j);
 	    if (i != connections.end()) {
+		if (i->second.stream.get() != NULL) {
+		    i->second.stream->abort();
+		}
+		if (i->second.owns_fds) {
+		    (void) io_close(i->second.read_fd);
+		    if (i->second.write_fd != i->second.read_fd)
+			(void) io_close(i->second.write_fd);
+		}
 		connections.erase(i);
 	    }
+	    // Nobody is left to receive responses to the connection's
+	    // outstanding messages, so don't spend any more effort on them.
+	    dispatcher->connection_closed(*j);
+	    workers.cancel_queued_messages(*j);
 	}
     }
 }
 
+/// Order lock statistics by the time spent waiting for the lock, longest first.
+static bool
+longer_wait(const std::pair<std::string, LockProfile::Counts> & a,
+	    const std::pair<std::string, LockProfile::Counts> & b)
+{
+    return a.second.wait_usec > b.second.wait_usec;
+}
+
+void
+ServerInternal::log_lock_stats()
+{
+    // Log the activity since the last summary, most contended locks first.
+    std::vector<std::pair<std::string, LockProfile::Counts> > changes;
+    const LockProfile * profile;
+    for (profile = LockProfile::first(); profile != NULL;
+	 profile = profile->next) {
+	LockProfile::Counts counts = profile->get_counts();
+	LockProfile::Counts & logged = logged_lock_counts[profile->name];
+	LockProfile::Counts change;
+	change.acquisitions = counts.acquisitions - logged.acquisitions;
+	change.contended = counts.contended - logged.contended;
+	change.wait_usec = counts.wait_usec - logged.wait_usec;
+	change.hold_usec = counts.hold_usec - logged.hold_usec;
+	logged = counts;
+	if (change.acquisitions > 0)
+	    changes.push_back(std::make_pair(profile->name, change));
+    }
+    std::sort(changes.begin(), changes.end(), longer_wait);
+    std::vector<std::pair<std::string, LockProfile::Counts> >::const_iterator i;
+    for (i = changes.begin(); i != changes.end(); ++i) {
+	const LockProfile::Counts & change = i->second;
+	logger.info("Lock '" + i->first + "': " + str(change.acquisitions) +
+		    " acquisitions, " + str(change.contended) +
+		    " contended, waited " + str(change.wait_usec) +
+		    "us, held " + str(change.hold_usec) + "us in the last " +
+		    str(settings.lock_stats_interval) + "s");
+    }
+}
+
 void
 ServerInternal::shutdown()
 {
@@ -271,73 +573,230 @@ ServerInternal::set_sys_error(const std::string & message, int errno_value)
     error_message = new_message;
 }
 
+void
+ServerInternal::accept_connection()
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+	// Another process sharing the port may have taken the connection, or
+	// the client may have given up on it.
+	if (!would_block(errno) && errno != EINTR && errno != ECONNABORTED) {
+	    logger.syserr("Failed to accept connection");
+	}
+	return;
+    }
+    // Connections are only read and written when select says they are
+    // ready, so never block the main loop on one.
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+	logger.syserr("Couldn't make connection non-blocking");
+	(void) io_close(fd);
+	return;
+    }
+    int connection_num = next_connection_num++;
+    connections[connection_num] = Connection(fd, fd, true);
+    stats.incr("connections_accepted");
+    logger.info("Connection " + str(connection_num) + " accepted");
+}
+
 bool
 ServerInternal::start_listening()
 {
     if (settings.use_stdio) {
 	logger.info("Listening on stdio");
 	connections[0] = Connection(0, 1);
+	return true;
     }
 
-    // FIXME - listen on tcp interface specified in settings
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(settings.port);
+    if (inet_pton(AF_INET, settings.interface.c_str(), &addr.sin_addr) != 1) {
+	set_sys_error("Can't listen on interface " + settings.interface,
+		      EINVAL);
+	return false;
+    }
 
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+	set_sys_error("Couldn't create listening socket", errno);
+	return false;
+    }
+    int on = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
+		   &on, sizeof(on)) == -1) {
+	set_sys_error("Couldn't set SO_REUSEADDR on listening socket", errno);
+	stop_listening();
+	return false;
+    }
+    if (settings.processes > 0) {
+	// Each server process binds its own socket to the port, and the
+	// kernel shares incoming connections between them.
+#ifdef SO_REUSEPORT
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+		       &on, sizeof(on)) == -1) {
+	    set_sys_error("Couldn't set SO_REUSEPORT on listening socket",
+			  errno);
+	    stop_listening();
+	    return false;
+	}
+#else
+	set_sys_error("Can't share the port between processes", ENOTSUP);
+	stop_listening();
+	return false;
+#endif
+    }
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+	     sizeof(addr)) == -1) {
+	set_sys_error("Couldn't bind to " + settings.interface + ":" +
+		      str(settings.port), errno);
+	stop_listening();
+	return false;
+    }
+    if (listen(listen_fd, SOMAXCONN) == -1 ||
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1) {
+	set_sys_error("Couldn't listen on " + settings.interface + ":" +
+		      str(settings.port), errno);
+	stop_listening();
+	return false;
+    }
+    logger.info("Listening on " + settings.interface + ":" +
+		str(settings.port));
     return true;
 }
 
 void
 ServerInternal::stop_listening()
 {
-    // FIXME - stop listening on tcp interface
+    if (listen_fd != -1) {
+	(void) io_close(listen_fd);
+	listen_fd = -1;
+    }
+
+    // Don't leave workers waiting for the rest of messages which will never
+    // arrive.
+    std::map<int, Connection>::iterator i;
+    for (i = connections.begin(); i != connections.end(); ++i) {
+	if (i->second.stream.get() != NULL) {
+	    i->second.stream->abort();
+	    i->second.stream = PayloadStreamPtr();
+	}
+    }
 }
 
-bool
+void
 ServerInternal::dispatch_responses()
 {
-    if (pthread_mutex_lock(&outgoing_message_mutex) != 0) {
-	set_sys_error("Couldn't lock outgoing message mutex", errno);
-	return false;
+    // Take the queued responses, so that the lock isn't held while handling
+    // them (handling a response may queue further responses).
+    std::queue<Response> responses;
+    long long queued_at;
+    {
+	ContextLocker lock(outgoing_message_mutex);
+	std::swap(responses, outgoing_messages);
+	queued_at = responses_queued_at;
     }
-    try {
-	while (!outgoing_messages.empty()) {
-	    int conn_num = outgoing_messages.front().first;
-	    std::map<int, Connection>::iterator i = connections.find(conn_num);
-	    if (i != connections.end()) {
-		logger.debug("Dispatching response for connection " +
-			    str(conn_num));
-		i->second.write_buf.append(outgoing_messages.front().second);
-	    } else {
-		// log the inability to send the messsage
-		logger.info("Couldn't add response to connection number " +
-			    str(conn_num) + " - connection not found");
-	    }
-	    outgoing_messages.pop();
-	}
-    } catch(...) {
-	pthread_mutex_unlock(&outgoing_message_mutex);
-	throw;
+    if (!responses.empty()) {
+	loop_stats.histograms["response_queue_lag_us"].record(
+		get_monotonic_usec() - queued_at);
     }
-    if (pthread_mutex_unlock(&outgoing_message_mutex) != 0) {
-	set_sys_error("Couldn't unlock outgoing message mutex", errno);
-	return false;
+
+    while (!responses.empty()) {
+	const Response & response = responses.front();
+	if (response.status == '\0') {
+	    write_to_connection(response.connection_num, response.payload);
+	} else {
+	    dispatcher->handle_response(response);
+	}
+	responses.pop();
     }
-    return true;
 }
 
 void
-ServerInternal::queue_response(int connection_num,
-				 const std::string & response)
+ServerInternal::publish_loop_stats()
 {
-    if (pthread_mutex_lock(&outgoing_message_mutex) != 0) {
-	throw StopWorkerException("Couldn't lock outgoing message mutex");
+    stats.add(loop_stats);
+    // Keep the entries, so that the next iteration doesn't allocate them.
+    std::map<std::string, long long>::iterator i;
+    for (i = loop_stats.values.begin(); i != loop_stats.values.end(); ++i) {
+	i->second = 0;
     }
-    try {
-	outgoing_messages.push(make_pair(connection_num, response));
-    } catch(...) {
-	pthread_mutex_unlock(&outgoing_message_mutex);
-	throw;
+    std::map<std::string, Stats::Histogram>::iterator j;
+    for (j = loop_stats.histograms.begin(); j != loop_stats.histograms.end();
+	 ++j) {
+	j->second = Stats::Histogram();
+    }
+}
+
+PayloadStreamPtr
+ServerInternal::start_stream(int connection_num, size_t length)
+{
+    PayloadStreamPtr stream(new PayloadStream(this, settings.stream_threshold));
+    std::map<int, Connection>::iterator i = connections.find(connection_num);
+    if (i == connections.end()) {
+	stream->abort();
+	return stream;
     }
-    if (pthread_mutex_unlock(&outgoing_message_mutex) != 0) {
-	throw StopWorkerException("Couldn't unlock outgoing message mutex");
+    assert(i->second.stream.get() == NULL);
+    stats.incr("streams_started");
+    if (length == 0) {
+	stream->finish();
+    } else {
+	i->second.stream = stream;
+	i->second.stream_remaining = length;
     }
-    (void) io_write(nudge_write_end, "R");
+    return stream;
+}
+
+void
+ServerInternal::nudge_streams()
+{
+    (void) io_write(nudge_write_end, "W");
+}
+
+void
+ServerInternal::nudge_workers_exited()
+{
+    (void) io_write(nudge_write_end, "X");
+}
+
+void
+ServerInternal::write_to_connection(int connection_num,
+				    const std::string & data)
+{
+    std::map<int, Connection>::iterator i = connections.find(connection_num);
+    if (i != connections.end()) {
+	logger.debug("Dispatching response for connection " +
+		     str(connection_num));
+	i->second.write_buf.append(data);
+    } else {
+	// log the inability to send the messsage
+	logger.info("Couldn't add response to connection number " +
+		    str(connection_num) + " - connection not found");
+    }
+}
+
+void
+ServerInternal::queue_response(int connection_num,
+				 const std::string & response)
+{
+    queue_response(Response(connection_num, std::string(), '\0', response));
+}
+
+void
+ServerInternal::queue_response(const Response & response)
+{
+    ContextLocker lock(outgoing_message_mutex);
+    // Only nudge the main thread if the queue was empty: otherwise it has
+    // already been nudged, and will take this response along with the
+    // others.  Nudging for every response could fill the socket's buffer
+    // under load, blocking every thread which sends a response (including
+    // the main thread).
+    bool nudge = outgoing_messages.empty();
+    outgoing_messages.push(response);
+    if (nudge)
+	responses_queued_at = get_monotonic_usec();
+    lock.unlock();
+    if (nudge)
+	(void) io_write(nudge_write_end, "R");
 }
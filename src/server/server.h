@@ -26,24 +26,170 @@
 #ifndef XAPSRV_INCLUDED_SERVER_H
 #define XAPSRV_INCLUDED_SERVER_H
 
+#include "payloadstream.h"
 #include "settings.h"
+#include <string>
+#include <vector>
 
+class Arena;
 class Logger;
 class ServerInternal;
+class Stats;
 class WorkerPool;
 class WorkerThread;
 
+/** Priority classes for messages.
+ *
+ *  Lower values are more urgent.  A worker always handles a queued message of
+ *  a more urgent class before any queued message of a less urgent class.
+ */
+enum MessagePriority {
+    /// Requests which a user is waiting for.
+    PRIORITY_INTERACTIVE = 0,
+
+    /// Requests which didn't specify a priority.
+    PRIORITY_NORMAL = 1,
+
+    /// Bulk or background requests, such as exports or backfills.
+    PRIORITY_BATCH = 2
+};
+
+/// The number of distinct message priorities.
+#define PRIORITY_LEVELS 3
+
 struct Message {
     int connection_num;
     std::string msgid;
     std::string target;
     std::string payload;
-    Message() {}
+
+    /// The priority of the message - one of the MessagePriority values.
+    int priority;
+
+    /** The flow the message belongs to, such as the connection or database
+     *  it is for.
+     *
+     *  If the server shares workers fairly between flows, queued messages
+     *  of each priority are taken from their flows in turn, rather than in
+     *  the order they arrived.
+     */
+    std::string flow;
+
+    /// The share of workers the message's flow gets, relative to others.
+    int flow_weight;
+
+    /** A key, such as the database the message is for, used to prefer
+     *  the same few workers for all messages with the key.
+     *
+     *  If empty, or the server isn't set to prefer workers, the message
+     *  goes to any worker.
+     */
+    std::string affinity;
+
+    /** The encoding the payload was compressed with, or empty if it wasn't.
+     *
+     *  The dispatcher decompresses the payload before passing the message to
+     *  a worker, so workers never see compressed payloads.
+     */
+    std::string encoding;
+
+    /** The encoding to compress the response to the message with, if it is
+     *  large enough to be worth compressing.
+     *
+     *  If empty, the response isn't compressed.
+     */
+    std::string accept_encoding;
+
+    /** The rest of the payload, for messages which are too large to buffer.
+     *
+     *  If this is set, the payload member is empty, and the payload should
+     *  be read from the stream as it arrives.
+     */
+    PayloadStreamPtr stream;
+
+    /** The time at which the message was sent to a worker pool, from
+     *  get_monotonic_usec().
+     */
+    long long queued_at;
+
+    /** The CPU which the message was queued from, or -1 if not recorded.
+     *
+     *  This is only recorded on machines with more than one NUMA node, to
+     *  count messages which cross between nodes.
+     */
+    int queued_cpu;
+
+    /** The time by which the message must be handled, from
+     *  get_monotonic_usec(), or 0 if it has none.
+     *
+     *  A message whose deadline has passed when a worker takes it is
+     *  dropped, with Worker::deadline_missed() called instead of the worker
+     *  seeing it.  If the server orders queues by deadline, messages with
+     *  the earliest deadlines are taken first.
+     */
+    long long deadline;
+
+    Message()
+	    : priority(PRIORITY_NORMAL), flow_weight(1), queued_at(0),
+	      queued_cpu(-1), deadline(0)
+    {}
     Message(int connection_num_)
-	    : connection_num(connection_num_)
+	    : connection_num(connection_num_),
+	      priority(PRIORITY_NORMAL),
+	      flow_weight(1),
+	      queued_at(0),
+	      queued_cpu(-1),
+	      deadline(0)
     {}
 };
 
+/** A response to a message.
+ */
+struct Response {
+    /// The connection to send the response to.
+    int connection_num;
+
+    /// The id of the message which this is a response to.
+    std::string msgid;
+
+    /** The status code of the response.
+     *
+     *  If this is '\0', the response is raw: the payload is written to the
+     *  connection unchanged, and the msgid is ignored.
+     */
+    char status;
+
+    /// The body of the response.
+    std::string payload;
+
+    /// The encoding the payload is compressed with, or empty if it isn't.
+    std::string encoding;
+
+    Response() : connection_num(-1), status('\0') {}
+    Response(int connection_num_, const std::string & msgid_, char status_,
+	     const std::string & payload_)
+	    : connection_num(connection_num_), msgid(msgid_),
+	      status(status_), payload(payload_), encoding()
+    {}
+};
+
+/** The result of a request to cancel a message.
+ */
+enum CancelResult {
+    /// No queued or running message matched.
+    CANCEL_NOT_FOUND,
+
+    /// The message was still queued, and has been removed from the queue.
+    CANCEL_QUEUED,
+
+    /** The message was running, and its worker has been asked to abandon it.
+     *
+     *  Any further responses sent by the worker for the message will be
+     *  discarded.
+     */
+    CANCEL_RUNNING
+};
+
 class Worker {
     WorkerThread * thread;
   protected:
@@ -70,7 +216,37 @@ class Worker {
      */
     void send_response(int connection_num, const std::string & msg);
 
+    /** Send a response to a message.
+     *
+     *  The response is passed to Dispatcher::handle_response() in the main
+     *  server thread, which is responsible for formatting it.  If the message
+     *  accepts compressed responses, and the payload is large enough, it is
+     *  compressed first (in the calling thread).
+     */
+    void send_response(const Message & msg, char status,
+		       const std::string & payload);
+
+    /** Check if the message currently being handled has been cancelled.
+     *
+     *  Workers performing long-running tasks should check this periodically,
+     *  and abandon the message if it returns true.  Responses sent for a
+     *  cancelled message are discarded.  Each check also counts as a
+     *  heartbeat, which is reported if the message stalls (see
+     *  --stall-timeout).
+     */
+    bool cancelled();
+
+    /** Get the arena for temporaries used while handling a message.
+     *
+     *  Everything allocated from the arena is released when the worker next
+     *  calls wait_for_message(), so nothing allocated from it may be kept
+     *  beyond the current message.
+     */
+    Arena & get_arena();
+
   public:
+    virtual ~Worker();
+
     /** @internal
      *
      *  Set the thread that this worker is run in.
@@ -83,6 +259,17 @@ class Worker {
      */
     virtual void run() = 0;
 
+    /** Prepare the worker to handle messages.
+     *
+     *  This is called in the worker's thread before run(), and before the
+     *  worker takes any messages, so slow setup (such as opening databases
+     *  or loading caches) can be done here rather than delaying the first
+     *  message.
+     *
+     *  The default implementation does nothing.
+     */
+    virtual void warm_up();
+
     /** Cleanup the worker.
      *
      *  This will be called after the stop() method has been called, to give
@@ -91,6 +278,28 @@ class Worker {
      *  The default implementation does nothing.
      */
     virtual void cleanup();
+
+    /** Check whether the worker can handle several messages at once.
+     *
+     *  If so, and the server is set to handle more than one message in
+     *  each worker (with --fibers), run() is called once for each message
+     *  the worker can handle at once, each call in a separate fiber in the
+     *  worker's thread.  When one of them waits, such as for more of a
+     *  streamed payload, another carries on.  The worker must keep any
+     *  state for a message on the stack, rather than in members.
+     *
+     *  The default implementation returns false.
+     */
+    virtual bool multiplexes() const;
+
+    /** Called instead of handling a message whose deadline passed before
+     *  the worker took it.
+     *
+     *  This is called from within wait_for_message(), which then waits for
+     *  the next message.  The default implementation sends an error
+     *  response with the message "Deadline exceeded".
+     */
+    virtual void deadline_missed(const Message & msg);
 };
 
 class Dispatcher {
@@ -100,11 +309,56 @@ class Dispatcher {
   protected:
     Logger * logger;
     ServerInternal * server;
+    const ServerSettings * settings;
+    Stats * stats;
     friend class ServerInternal;
 
-    void send_to_worker(const std::string & group, const Message & msg);
+    /** Get the id of a group of workers, for sending messages to it.
+     *
+     *  Looking the id up once, rather than passing the group's name with
+     *  each message, saves finding the group by name for every message.
+     *  Ids stay valid for as long as the server runs.
+     */
+    int group_id(const std::string & group);
+
+    void send_to_worker(int group, const Message & msg);
     void send_response(int connection_num, const std::string & msg);
 
+    /** Write a response to a connection immediately.
+     *
+     *  This must only be called from the main server thread (ie, from
+     *  dispatch_request(), handle_response() or connection_closed()).
+     */
+    void write_response(int connection_num, const std::string & msg);
+
+    /** Pass part of a message from a connection to a new stream.
+     *
+     *  The next `length` bytes read from the connection are written to the
+     *  returned stream instead of being passed to dispatch_request().  This
+     *  must only be called from the main server thread.
+     */
+    PayloadStreamPtr stream_payload(int connection_num, size_t length);
+
+    /** Cancel a message previously sent to a worker.
+     *
+     *  @param connection_num The connection which the message came from.
+     *  @param msgid The id of the message.
+     */
+    CancelResult cancel_message(int connection_num, const std::string & msgid);
+
+    /** Check whether a group of workers is too overloaded to accept a new
+     *  message.
+     *
+     *  Messages which would be rejected should be answered immediately,
+     *  rather than being sent to the group.  Always returns false unless
+     *  the --overload-delay setting is used.
+     *
+     *  @param group The id of the group which the message is for.
+     *  @param retry_after_usec Set to the time the sender should wait before
+     *  retrying, in microseconds, if the group is overloaded.
+     */
+    bool group_overloaded(int group, long long & retry_after_usec);
+
   public:
     /** Pull the first request from the start of "buf", and dispatch it.
      *
@@ -114,6 +368,30 @@ class Dispatcher {
      */
     virtual bool dispatch_request(int connection_num, std::string & buf) = 0;
 
+    /** Handle a response sent by a worker for a message.
+     *
+     *  This is called in the main server thread, in the order in which the
+     *  responses were sent, and should format the response and write it to
+     *  its connection with write_response().
+     */
+    virtual void handle_response(const Response & response) = 0;
+
+    /** Called in the main server thread when a connection has closed.
+     *
+     *  This is called before any outstanding messages from the connection
+     *  are cancelled.  The default implementation does nothing.
+     */
+    virtual void connection_closed(int connection_num);
+
+    /** Called in the main server thread when a message sent to a worker
+     *  has been rejected, because its group is overloaded.
+     *
+     *  This is called from within send_to_worker(), and should send an
+     *  error response for the message.  The rejected message may have been
+     *  sent earlier than the one being sent, if that was less urgent.
+     */
+    virtual void message_rejected(const Message & msg) = 0;
+
     /** Get a newly allocated worker for the given group.
      *
      *  This may return NULL if there are already the maximum number of workers
@@ -128,6 +406,48 @@ class Dispatcher {
 
     virtual Worker * get_worker(const std::string & group,
 				int current_workers) = 0;
+
+    /** Get the maximum number of workers to run for a message.
+     *
+     *  Workers can be reserved for urgent messages by returning a lower limit
+     *  for less urgent priorities: once a group has reached the limit for a
+     *  message's priority, the message is queued for an existing worker
+     *  rather than a new worker being started for it.  Messages queued for a
+     *  group are passed to the next of its workers to become free.
+     *
+     *  @param group The group that the message is for.
+     *  @param priority The priority of the message.
+     *
+     *  @retval The maximum number of workers in the group (at least 1).
+     */
+    virtual int max_workers(const std::string & group, int priority) = 0;
+
+    /** Get the number of workers to keep running in a group, even when idle.
+     *
+     *  These workers are started as soon as the group is first used (or
+     *  when the server starts, for the groups listed by startup_groups()),
+     *  and are never stopped for being idle.  The default implementation
+     *  returns 0.
+     */
+    virtual int min_workers(const std::string & group);
+
+    /** Get the groups whose minimum number of workers should be started
+     *  when the server starts.
+     *
+     *  The default implementation returns no groups.
+     */
+    virtual void startup_groups(std::vector<std::string> & groups);
+
+    /** Get the CPUs which a group's workers should run on.
+     *
+     *  The group's queue is also placed on the NUMA node of the CPUs, if
+     *  they are all on one node.  The default implementation returns an
+     *  empty string, for no restriction.
+     *
+     *  @returns a CPU list, such as "0-3,8", in the format accepted by
+     *  parse_cpu_list().
+     */
+    virtual std::string worker_cpus(const std::string & group);
 };
 
 class Server {
@@ -26,10 +26,13 @@
 #ifndef XAPSRV_INCLUDED_SERVERINTERNAL_H
 #define XAPSRV_INCLUDED_SERVERINTERNAL_H
 
+#include "locker.h"
 #include "logger.h"
 #include <queue>
+#include "payloadstream.h"
 #include "settings.h"
 #include <map>
+#include "stats.h"
 #include "workerpool.h"
 
 class Dispatcher;
@@ -40,12 +43,27 @@ struct Connection {
     std::string read_buf;
     std::string write_buf;
 
+    /// The stream which data read from the connection is passed to, if any.
+    PayloadStreamPtr stream;
+
+    /// The number of bytes still to be passed to the stream.
+    size_t stream_remaining;
+
+    /// Flag, set to true while reading is paused to let a stream drain.
+    bool read_paused;
+
+    /// Flag, set to true if the file descriptors are closed with the
+    /// connection.
+    bool owns_fds;
+
     Connection()
-	    : read_fd(-1), write_fd(-1)
+	    : read_fd(-1), write_fd(-1), stream_remaining(0), read_paused(false),
+	      owns_fds(false)
     {}
 
-    Connection(int read_fd_, int write_fd_)
-	    : read_fd(read_fd_), write_fd(write_fd_)
+    Connection(int read_fd_, int write_fd_, bool owns_fds_ = false)
+	    : read_fd(read_fd_), write_fd(write_fd_), stream_remaining(0),
+	      read_paused(false), owns_fds(owns_fds_)
     {}
 };
 
@@ -59,6 +77,9 @@ class ServerInternal {
     /// Logger to use.
     Logger logger;
 
+    /// Statistics about the server.
+    Stats stats;
+
     /// Flag, set to true when the server has started.
     bool started;
 
@@ -86,22 +107,53 @@ class ServerInternal {
      */
     std::map<int, Connection> connections;
 
+    /// The socket to accept connections from, or -1 if not listening.
+    int listen_fd;
+
+    /// The number to give the next connection accepted.
+    int next_connection_num;
+
     /** The current workers.
      */
     WorkerPool workers;
 
     /** Mutex to be held whenever accessing outgoing_messages.
      */
-    pthread_mutex_t outgoing_message_mutex;
+    Locker outgoing_message_mutex;
+
+    /** Responses ready to be passed to a connection.
+     */
+    std::queue<Response> outgoing_messages;
 
-    /** Messages ready to be passed to a connection.
+    /** The time the oldest response in outgoing_messages was queued, from
+     *  get_monotonic_usec().
      */
-    std::queue<std::pair<int, std::string> > outgoing_messages;
+    long long responses_queued_at;
+
+    /// The lock statistics at the time they were last logged, by lock name.
+    std::map<std::string, LockProfile::Counts> logged_lock_counts;
+
+    /** Statistics gathered by the main loop since they were last added to
+     *  the server's statistics.
+     *
+     *  These are added once each time round the loop, so that the loop
+     *  doesn't take the statistics' mutex for every event it handles.
+     */
+    Stats::Totals loop_stats;
 
     /** Run the main loop.
      */
     void mainloop();
 
+    /** Add the statistics gathered by the main loop to the server's
+     *  statistics.
+     */
+    void publish_loop_stats();
+
+    /** Log the lock statistics since they were last logged.
+     */
+    void log_lock_stats();
+
     /** Start the server listening.
      */
     bool start_listening();
@@ -112,9 +164,13 @@ class ServerInternal {
      */
     void stop_listening();
 
+    /** Accept a connection from the listening socket.
+     */
+    void accept_connection();
+
     /** Dispatch all responses which are ready.
      */
-    bool dispatch_responses();
+    void dispatch_responses();
 
   public:
     ServerInternal(const ServerSettings & settings_, Dispatcher * dispatcher_);
@@ -156,9 +212,45 @@ class ServerInternal {
      */
     const std::string & get_error_message() const { return error_message; }
 
+    /** Get the settings used by the server.
+     */
+    const ServerSettings & get_settings() const { return settings; }
+
+    /** Get the statistics about the server.
+     */
+    Stats & get_stats() { return stats; }
+
     /** Queue a response for sending back to the server.
      */
     void queue_response(int connection_num, const std::string & response);
+
+    /** Queue a response to a message for sending back to the server.
+     *
+     *  Unless the response is raw, it will be passed to the dispatcher's
+     *  handle_response() method in the main thread.
+     */
+    void queue_response(const Response & response);
+
+    /** Pass the next `length` bytes read from a connection to a new stream.
+     *
+     *  This must only be called from the main server thread.
+     */
+    PayloadStreamPtr start_stream(int connection_num, size_t length);
+
+    /** Nudge the main thread, to resume reading for any streams which have
+     *  space available.
+     */
+    void nudge_streams();
+
+    /** Nudge the main thread, to join any workers which have exited.
+     */
+    void nudge_workers_exited();
+
+    /** Append data to the write buffer of a connection.
+     *
+     *  This must only be called from the main server thread.
+     */
+    void write_to_connection(int connection_num, const std::string & data);
 };
 
 #endif /* XAPSRV_INCLUDED_SERVERINTERNAL_H */
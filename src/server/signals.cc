@@ -130,6 +130,14 @@ set_up_signal_handlers(ServerInternal * internal)
 	internal->set_sys_error("Unable to set SIGTERM handler", errno);
 	return false;
     }
+
+    // A client going away shouldn't kill the server: writing to it fails,
+    // and the connection is closed.
+    act.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &act, NULL) == -1) {
+	internal->set_sys_error("Unable to ignore SIGPIPE", errno);
+	return false;
+    }
     return true;
 }
 
@@ -156,4 +164,5 @@ release_signal_handlers()
     (void) sigaction(SIGTERM, &act, NULL);
     (void) sigaction(SIGINT, &act, NULL);
     (void) sigaction(SIGCHLD, &act, NULL);
+    (void) sigaction(SIGPIPE, &act, NULL);
 }
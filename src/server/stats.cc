@@ -0,0 +1,254 @@
+/** @file stats.cc
+ * @brief Statistics about the running server.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "stats.h"
+
+#include <algorithm>
+#include <climits>
+
+/// Convert a value to JSON, as an integer if it fits in one.
+static Json::Value
+json_number(long long value)
+{
+    if (value >= INT_MIN && value <= INT_MAX)
+	return Json::Value(int(value));
+    return Json::Value(double(value));
+}
+
+int
+Stats::histogram_bucket(long long value)
+{
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0) {
+	++bucket;
+    }
+    return bucket;
+}
+
+Stats::Histogram::Histogram()
+	: count(0), sum(0), max(0)
+{
+    for (int i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+	buckets[i] = 0;
+    }
+}
+
+void
+Stats::Histogram::record(long long value)
+{
+    if (value < 0)
+	value = 0;
+    ++count;
+    sum += value;
+    if (value > max)
+	max = value;
+    ++buckets[histogram_bucket(value)];
+}
+
+void
+Stats::Histogram::add(const Histogram & other)
+{
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+    for (int i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+	buckets[i] += other.buckets[i];
+    }
+}
+
+long long
+Stats::Histogram::percentile(int percent) const
+{
+    // The rank of the value to find, rounding up.
+    long long rank = (count * percent + 99) / 100;
+    if (rank == 0)
+	rank = 1;
+    long long seen = 0;
+    for (int i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+	seen += buckets[i];
+	if (seen >= rank) {
+	    if (i == 0)
+		return 0;
+	    long long bound = (i >= 63) ? LLONG_MAX : (1LL << i) - 1;
+	    return std::min(bound, max);
+	}
+    }
+    return max;
+}
+
+Stats::Stats()
+	: mutex("stats"), counters(), gauges(), histograms(), sources()
+{
+}
+
+void
+Stats::incr(const std::string & name, long long amount)
+{
+    ContextLocker lock(mutex);
+    counters[name] += amount;
+}
+
+void
+Stats::set(const std::string & name, long long value)
+{
+    ContextLocker lock(mutex);
+    gauges[name] = value;
+}
+
+void
+Stats::adjust(const std::string & name, long long amount)
+{
+    ContextLocker lock(mutex);
+    gauges[name] += amount;
+}
+
+void
+Stats::record(const std::string & name, long long value)
+{
+    ContextLocker lock(mutex);
+    histograms[name].record(value);
+}
+
+void
+Stats::add(const Totals & totals)
+{
+    ContextLocker lock(mutex);
+    std::map<std::string, long long>::const_iterator i;
+    for (i = totals.values.begin(); i != totals.values.end(); ++i) {
+	if (i->second != 0)
+	    counters[i->first] += i->second;
+    }
+    std::map<std::string, Histogram>::const_iterator j;
+    for (j = totals.histograms.begin(); j != totals.histograms.end(); ++j) {
+	if (j->second.count != 0)
+	    histograms[j->first].add(j->second);
+    }
+}
+
+void
+Stats::add_source(const StatsSource * source)
+{
+    ContextLocker lock(mutex);
+    sources.push_back(source);
+}
+
+void
+Stats::remove_source(const StatsSource * source)
+{
+    ContextLocker lock(mutex);
+    sources.erase(std::remove(sources.begin(), sources.end(), source),
+		  sources.end());
+}
+
+void
+Stats::describe(Json::Value & result) const
+{
+    ContextLocker lock(mutex);
+    Totals totals;
+    totals.values = counters;
+    std::map<std::string, long long>::const_iterator i;
+    for (i = gauges.begin(); i != gauges.end(); ++i) {
+	totals.values[i->first] += i->second;
+    }
+    totals.histograms = histograms;
+    std::vector<const StatsSource *>::const_iterator source;
+    for (source = sources.begin(); source != sources.end(); ++source) {
+	(*source)->add_stats(totals);
+    }
+
+    for (i = totals.values.begin(); i != totals.values.end(); ++i) {
+	result[i->first] = json_number(i->second);
+    }
+    std::map<std::string, Histogram>::const_iterator j;
+    for (j = totals.histograms.begin(); j != totals.histograms.end(); ++j) {
+	Json::Value & item = result[j->first];
+	item[Json::StaticString("count")] = json_number(j->second.count);
+	item[Json::StaticString("sum")] = json_number(j->second.sum);
+	item[Json::StaticString("max")] = json_number(j->second.max);
+	item[Json::StaticString("p50")] = json_number(j->second.percentile(50));
+	item[Json::StaticString("p90")] = json_number(j->second.percentile(90));
+	item[Json::StaticString("p99")] = json_number(j->second.percentile(99));
+    }
+    if (LockProfile::enabled) {
+	Json::Value & locks = result[Json::StaticString("locks")];
+	const LockProfile * profile;
+	for (profile = LockProfile::first(); profile != NULL;
+	     profile = profile->next) {
+	    LockProfile::Counts counts = profile->get_counts();
+	    Json::Value & item = locks[profile->name];
+	    item[Json::StaticString("acquisitions")] =
+		    json_number(counts.acquisitions);
+	    item[Json::StaticString("contended")] =
+		    json_number(counts.contended);
+	    item[Json::StaticString("wait_us")] = json_number(counts.wait_usec);
+	    item[Json::StaticString("hold_us")] = json_number(counts.hold_usec);
+	}
+    }
+}
+
+StatsSource::~StatsSource()
+{
+}
+
+AtomicHistogram::AtomicHistogram()
+	: count(0), sum(0), max(0)
+{
+    for (int i = 0; i != Stats::HISTOGRAM_BUCKETS; ++i) {
+	buckets[i] = 0;
+    }
+}
+
+void
+AtomicHistogram::record(long long value)
+{
+    if (value < 0)
+	value = 0;
+    (void) __sync_fetch_and_add(&buckets[Stats::histogram_bucket(value)], 1);
+    (void) __sync_fetch_and_add(&sum, value);
+    long long old_max = max;
+    while (value > old_max &&
+	   !__sync_bool_compare_and_swap(&max, old_max, value)) {
+	old_max = max;
+    }
+    // Count the value last, so that a value counted is always in a bucket.
+    (void) __sync_fetch_and_add(&count, 1);
+}
+
+void
+AtomicHistogram::add_to(Stats::Totals & totals,
+			const std::string & name) const
+{
+    long long recorded = count;
+    if (recorded == 0)
+	return;
+    Stats::Histogram & histogram = totals.histograms[name];
+    histogram.count += recorded;
+    histogram.sum += sum;
+    histogram.max = std::max(histogram.max, (long long) max);
+    for (int i = 0; i != Stats::HISTOGRAM_BUCKETS; ++i) {
+	histogram.buckets[i] += buckets[i];
+    }
+}
@@ -0,0 +1,245 @@
+/** @file stats.h
+ * @brief Statistics about the running server.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_STATS_H
+#define XAPSRV_INCLUDED_STATS_H
+
+#include "json/json.h"
+#include "locker.h"
+#include <map>
+#include <string>
+#include <vector>
+
+class StatsSource;
+
+/** A set of named statistics.
+ *
+ *  All methods are safe to call from any thread.  Statistics updated for
+ *  every message should be kept by a StatsSource instead, so that the
+ *  threads handling messages don't contend for the mutex.
+ */
+class Stats {
+  public:
+    /// The number of buckets in a histogram.
+    static const int HISTOGRAM_BUCKETS = 64;
+
+    /** Get the bucket of a histogram which a value is counted in.
+     *
+     *  @param value The value, which must not be negative.
+     */
+    static int histogram_bucket(long long value);
+
+    /** A histogram of recorded values.
+     *
+     *  Bucket 0 counts values less than 1, and bucket n counts values from
+     *  2^(n-1) up to 2^n - 1, so percentiles are accurate to within a
+     *  factor of two.
+     */
+    struct Histogram {
+	/// The number of values recorded.
+	long long count;
+
+	/// The sum of the values recorded.
+	long long sum;
+
+	/// The largest value recorded.
+	long long max;
+
+	/// The number of values recorded in each bucket.
+	long long buckets[HISTOGRAM_BUCKETS];
+
+	Histogram();
+
+	/** Record a value.
+	 *
+	 *  @param value The value to record.  Negative values are recorded
+	 *  as 0.
+	 */
+	void record(long long value);
+
+	/// Add the values recorded in another histogram.
+	void add(const Histogram & other);
+
+	/** Get an upper bound for a percentile of the values recorded.
+	 *
+	 *  @param percent The percentile to get, between 0 and 100.
+	 */
+	long long percentile(int percent) const;
+    };
+
+    /** Totals of statistics, to which each StatsSource adds its own.
+     */
+    struct Totals {
+	/// Counters and gauges, by name.
+	std::map<std::string, long long> values;
+
+	/// Histograms, by name.
+	std::map<std::string, Histogram> histograms;
+    };
+
+  private:
+    /// Mutex which must be held when accessing the statistics.
+    mutable Locker mutex;
+
+    /// Counters, which only increase.
+    std::map<std::string, long long> counters;
+
+    /// Gauges, which hold the most recently set value.
+    std::map<std::string, long long> gauges;
+
+    /// Histograms, which summarise the distribution of recorded values.
+    std::map<std::string, Histogram> histograms;
+
+    /// Sources of further statistics.
+    std::vector<const StatsSource *> sources;
+
+    // Don't allow copying or assignment.
+    Stats(const Stats & other);
+    void operator=(const Stats & other);
+  public:
+    Stats();
+
+    /** Increment a counter.
+     *
+     *  @param name The name of the counter.
+     *  @param amount The amount to increment the counter by.
+     */
+    void incr(const std::string & name, long long amount = 1);
+
+    /** Set the value of a gauge.
+     *
+     *  @param name The name of the gauge.
+     *  @param value The new value of the gauge.
+     */
+    void set(const std::string & name, long long value);
+
+    /** Adjust the value of a gauge.
+     *
+     *  @param name The name of the gauge.
+     *  @param amount The amount to add to the gauge (which may be negative).
+     */
+    void adjust(const std::string & name, long long amount);
+
+    /** Record a value in a histogram.
+     *
+     *  @param name The name of the histogram.
+     *  @param value The value to record.  Negative values are recorded as 0.
+     */
+    void record(const std::string & name, long long value);
+
+    /** Add statistics gathered without locking, all at once.
+     *
+     *  This lets a thread which updates statistics many times over take the
+     *  mutex once for all of them.
+     *
+     *  @param totals The amounts to increment counters by, and the values
+     *  to add to histograms.  Histograms with no values are ignored.
+     */
+    void add(const Totals & totals);
+
+    /** Add a source of statistics.
+     *
+     *  The source must be removed before it is destroyed.
+     *
+     *  @param source The source to add.
+     */
+    void add_source(const StatsSource * source);
+
+    /** Remove a source of statistics.
+     *
+     *  Once this returns, the source won't be used again.
+     *
+     *  @param source The source to remove.
+     */
+    void remove_source(const StatsSource * source);
+
+    /** Get a description of all the statistics.
+     *
+     *  Statistics with the same name from several sources are added
+     *  together.  Each histogram is described by an object holding the
+     *  count, sum and maximum of its values, and upper bounds for their
+     *  50th, 90th and 99th percentiles.
+     *
+     *  @param result A JSON object to store the statistics in.
+     */
+    void describe(Json::Value & result) const;
+};
+
+/** Something which keeps statistics of its own, and adds them to the
+ *  server's statistics when they are described.
+ *
+ *  This lets statistics which are updated for every message be kept in
+ *  atomic counters, rather than taking the statistics' mutex each time.
+ */
+class StatsSource {
+  public:
+    virtual ~StatsSource();
+
+    /** Add the source's statistics to some totals.
+     *
+     *  This is called with the statistics' mutex held, so mustn't update
+     *  the statistics itself.
+     *
+     *  @param totals The totals to add to.
+     */
+    virtual void add_stats(Stats::Totals & totals) const = 0;
+};
+
+/** A histogram which values can be recorded in without locking.
+ */
+class AtomicHistogram {
+    /// The number of values recorded.
+    volatile long long count;
+
+    /// The sum of the values recorded.
+    volatile long long sum;
+
+    /// The largest value recorded.
+    volatile long long max;
+
+    /// The number of values recorded in each bucket.
+    volatile long long buckets[Stats::HISTOGRAM_BUCKETS];
+
+    // Don't allow copying or assignment.
+    AtomicHistogram(const AtomicHistogram & other);
+    void operator=(const AtomicHistogram & other);
+  public:
+    AtomicHistogram();
+
+    /** Record a value.
+     *
+     *  @param value The value to record.  Negative values are recorded as 0.
+     */
+    void record(long long value);
+
+    /** Add the values recorded to some totals, if any have been recorded.
+     *
+     *  @param totals The totals to add to.
+     *  @param name The name of the histogram.
+     */
+    void add_to(Stats::Totals & totals, const std::string & name) const;
+};
+
+#endif /* XAPSRV_INCLUDED_STATS_H */
@@ -0,0 +1,203 @@
+/** @file supervisor.cc
+ * @brief Running several server processes.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "supervisor.h"
+
+#include <algorithm>
+#include <climits>
+#include <errno.h>
+#include <stdlib.h>
+#include "str.h"
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils.h"
+
+/// The time a process must run for to be restarted at once, in usec.
+#define PROCESS_MIN_UPTIME 1000000
+
+/// The first delay before restarting a process which exited quickly, in usec.
+#define PROCESS_MIN_RESTART_DELAY 100000
+
+/// The longest delay before restarting a process, in usec.
+#define PROCESS_MAX_RESTART_DELAY 10000000
+
+Supervisor::Supervisor(const ServerSettings & settings_,
+		       ServerProcessFunction run_process_)
+	: settings(settings_),
+	  run_process(run_process_),
+	  logger(settings_.log_filename),
+	  processes(settings_.processes)
+{
+    sigemptyset(&old_mask);
+}
+
+void
+Supervisor::start_process(size_t index)
+{
+    Process & process = processes[index];
+    pid_t pid = fork();
+    if (pid == -1) {
+	long long delay = schedule_restart(process);
+	logger.syserr("Couldn't start server process " + str(index) +
+		      "; retrying in " + str(delay / 1000) + "ms");
+	return;
+    }
+    if (pid == 0) {
+	// Give each process its own process group, so that the signals it
+	// sends to its group when shutting down in an emergency don't reach
+	// the supervisor or the other processes.
+	(void) setpgid(0, 0);
+	(void) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	exit(run_process(settings));
+    }
+    process.pid = pid;
+    process.started_at = get_monotonic_usec();
+    logger.info("Started server process " + str(index) + " (pid " +
+		str(pid) + ")");
+}
+
+long long
+Supervisor::schedule_restart(Process & process)
+{
+    long long now = get_monotonic_usec();
+    if (process.started_at != 0 &&
+	now - process.started_at >= PROCESS_MIN_UPTIME) {
+	process.restart_delay = 0;
+    } else {
+	process.restart_delay = std::min(
+		std::max(process.restart_delay * 2,
+			 (long long) PROCESS_MIN_RESTART_DELAY),
+		(long long) PROCESS_MAX_RESTART_DELAY);
+    }
+    process.pid = -1;
+    process.restart_at = now + process.restart_delay;
+    return process.restart_delay;
+}
+
+int
+Supervisor::reap_processes(bool stopping)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	size_t index = 0;
+	while (index != processes.size() && processes[index].pid != pid) {
+	    ++index;
+	}
+	if (index == processes.size())
+	    continue;
+	std::string description = "Server process " + str(index) +
+		" (pid " + str(pid) + ")";
+	if (WIFSIGNALED(status)) {
+	    description += " was killed by signal " + str(WTERMSIG(status));
+	} else {
+	    description += " exited with status " + str(WEXITSTATUS(status));
+	}
+	if (stopping) {
+	    processes[index].pid = -1;
+	    logger.info(description);
+	} else {
+	    long long delay = schedule_restart(processes[index]);
+	    logger.error(description + "; restarting in " +
+			 str(delay / 1000) + "ms");
+	}
+    }
+
+    int running = 0;
+    std::vector<Process>::const_iterator i;
+    for (i = processes.begin(); i != processes.end(); ++i) {
+	if (i->pid != -1)
+	    ++running;
+    }
+    return running;
+}
+
+int
+Supervisor::run()
+{
+    // Take signals synchronously, so that none can arrive between checking
+    // on the processes and waiting for something to happen.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, &old_mask) == -1) {
+	logger.syserr("Couldn't block signals in supervisor");
+	return 1;
+    }
+
+    logger.info("Starting " + str(processes.size()) + " server processes");
+    for (size_t index = 0; index != processes.size(); ++index) {
+	start_process(index);
+    }
+
+    bool stopping = false;
+    while (true) {
+	int running = reap_processes(stopping);
+	if (stopping && running == 0)
+	    break;
+
+	// Restart any processes which are due, and wait until the next one
+	// is due, or until a signal arrives.
+	long long next_restart = LLONG_MAX;
+	for (size_t index = 0; !stopping && index != processes.size();
+	     ++index) {
+	    if (processes[index].pid != -1)
+		continue;
+	    if (get_monotonic_usec() >= processes[index].restart_at)
+		start_process(index);
+	    if (processes[index].pid == -1)
+		next_restart = std::min(next_restart,
+					processes[index].restart_at);
+	}
+	struct timespec timeout;
+	struct timespec * timeout_ptr = NULL;
+	if (next_restart != LLONG_MAX) {
+	    long long wait = std::max(next_restart - get_monotonic_usec(),
+				      0LL);
+	    timeout.tv_sec = wait / 1000000;
+	    timeout.tv_nsec = (wait % 1000000) * 1000;
+	    timeout_ptr = &timeout;
+	}
+	int signum = sigtimedwait(&mask, NULL, timeout_ptr);
+	if (signum == SIGINT || signum == SIGTERM) {
+	    if (!stopping)
+		logger.info("Stopping server processes");
+	    stopping = true;
+	    std::vector<Process>::const_iterator i;
+	    for (i = processes.begin(); i != processes.end(); ++i) {
+		if (i->pid != -1)
+		    (void) kill(i->pid, signum);
+	    }
+	}
+    }
+
+    (void) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    logger.info("Shut down");
+    return 0;
+}
@@ -0,0 +1,127 @@
+/** @file supervisor.h
+ * @brief Running several server processes.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_SUPERVISOR_H
+#define XAPSRV_INCLUDED_SUPERVISOR_H
+
+#include "logger.h"
+#include "settings.h"
+#include <signal.h>
+#include <sys/types.h>
+#include <vector>
+
+/** A function which runs one server process.
+ *
+ *  @param settings The settings for the server.
+ *
+ *  @returns The exit status for the process.
+ */
+typedef int (*ServerProcessFunction)(const ServerSettings & settings);
+
+/** Runs several server processes, restarting any which exit unexpectedly.
+ *
+ *  Each process accepts connections on the shared port and has its own
+ *  workers and heap, so a crash or runaway memory use in one only affects
+ *  the connections which it accepted.  Interrupting or terminating the
+ *  supervisor passes the signal on to every process, and waits for them to
+ *  exit.
+ */
+class Supervisor {
+    /// A server process.
+    struct Process {
+	/// The process ID, or -1 if it isn't running.
+	pid_t pid;
+
+	/// The time the process was started, from get_monotonic_usec().
+	long long started_at;
+
+	/// The time to restart the process at, if it isn't running.
+	long long restart_at;
+
+	/// The time to wait before restarting the process, in microseconds.
+	long long restart_delay;
+
+	Process() : pid(-1), started_at(0), restart_at(0), restart_delay(0) {}
+    };
+
+    /// The settings for the server processes.
+    const ServerSettings & settings;
+
+    /// The function to run in each server process.
+    ServerProcessFunction run_process;
+
+    /// Logger to use.
+    Logger logger;
+
+    /// The server processes.
+    std::vector<Process> processes;
+
+    /// The signal mask to restore in each server process.
+    sigset_t old_mask;
+
+    /** Start a server process.
+     *
+     *  If it can't be started, it is retried later.
+     *
+     *  @param index The index of the process in processes.
+     */
+    void start_process(size_t index);
+
+    /** Wait for any server processes which have exited.
+     *
+     *  @param stopping True if the processes are being stopped, so
+     *  shouldn't be restarted.
+     *
+     *  @returns The number of processes still running.
+     */
+    int reap_processes(bool stopping);
+
+    /** Note that a server process needs restarting.
+     *
+     *  Processes which keep exiting soon after starting are restarted after
+     *  increasing delays.
+     *
+     *  @param process The process.
+     *
+     *  @returns The time to wait before restarting it, in microseconds.
+     */
+    long long schedule_restart(Process & process);
+
+    // Don't allow copying or assignment.
+    Supervisor(const Supervisor & other);
+    void operator=(const Supervisor & other);
+  public:
+    Supervisor(const ServerSettings & settings_,
+	       ServerProcessFunction run_process_);
+
+    /** Run the server processes until the supervisor is interrupted or
+     *  terminated.
+     *
+     *  @returns The exit status for the supervisor.
+     */
+    int run();
+};
+
+#endif /* XAPSRV_INCLUDED_SUPERVISOR_H */
@@ -0,0 +1,249 @@
+/** @file topology.cc
+ * @brief The CPU and NUMA topology of the machine, and thread placement.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "topology.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include "str.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// The mbind() policy which prefers a node, from <numaif.h>.
+#define XAPSRV_MPOL_PREFERRED 1
+
+/// The largest CPU number accepted in a CPU list.
+#define XAPSRV_MAX_CPU 4095
+
+bool
+parse_cpu_list(const std::string & text, std::vector<int> & cpus)
+{
+    cpus.clear();
+    const char * p = text.c_str();
+    while (*p == ' ' || *p == '\n')
+	++p;
+    while (*p != '\0') {
+	char * end;
+	long first = strtol(p, &end, 10);
+	if (end == p || first < 0 || first > XAPSRV_MAX_CPU)
+	    return false;
+	long last = first;
+	p = end;
+	if (*p == '-') {
+	    ++p;
+	    last = strtol(p, &end, 10);
+	    if (end == p || last < first || last > XAPSRV_MAX_CPU)
+		return false;
+	    p = end;
+	}
+	for (long cpu = first; cpu <= last; ++cpu) {
+	    cpus.push_back(int(cpu));
+	}
+	while (*p == ' ' || *p == '\n')
+	    ++p;
+	if (*p == ',') {
+	    ++p;
+	} else if (*p != '\0') {
+	    return false;
+	}
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return true;
+}
+
+std::string
+format_cpu_list(const std::vector<int> & cpus)
+{
+    std::string result;
+    size_t i = 0;
+    while (i != cpus.size()) {
+	size_t j = i + 1;
+	while (j != cpus.size() && cpus[j] == cpus[j - 1] + 1)
+	    ++j;
+	if (!result.empty())
+	    result += ",";
+	result += str(cpus[i]);
+	if (j - i > 1)
+	    result += "-" + str(cpus[j - 1]);
+	i = j;
+    }
+    return result;
+}
+
+/// Read the first line of a small file, returning false if it can't be read.
+static bool
+read_line(const std::string & path, std::string & line)
+{
+    FILE * fp = fopen(path.c_str(), "r");
+    if (fp == NULL)
+	return false;
+    char buf[1024];
+    bool ok = (fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    if (ok)
+	line = buf;
+    return ok;
+}
+
+CpuTopology::CpuTopology()
+	: cpu_nodes(), nodes(1), allowed()
+{
+}
+
+void
+CpuTopology::load(const std::string & node_dir)
+{
+    cpu_nodes.clear();
+    nodes = 1;
+    allowed.clear();
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+	for (int cpu = 0; cpu != CPU_SETSIZE; ++cpu) {
+	    if (CPU_ISSET(cpu, &set))
+		allowed.push_back(cpu);
+	}
+    }
+#endif
+
+    DIR * dir = opendir(node_dir.c_str());
+    if (dir == NULL)
+	return;
+    int max_node = -1;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+	const char * name = entry->d_name;
+	if (name[0] != 'n' || name[1] != 'o' || name[2] != 'd' ||
+	    name[3] != 'e' || name[4] < '0' || name[4] > '9')
+	    continue;
+	int node = atoi(name + 4);
+	std::string line;
+	std::vector<int> cpus;
+	if (!read_line(node_dir + "/" + name + "/cpulist", line) ||
+	    !parse_cpu_list(line, cpus))
+	    continue;
+	max_node = std::max(max_node, node);
+	for (size_t i = 0; i != cpus.size(); ++i) {
+	    if (size_t(cpus[i]) >= cpu_nodes.size())
+		cpu_nodes.resize(cpus[i] + 1, -1);
+	    cpu_nodes[cpus[i]] = node;
+	}
+    }
+    closedir(dir);
+    if (max_node >= 0)
+	nodes = max_node + 1;
+}
+
+int
+CpuTopology::node_of_cpu(int cpu) const
+{
+    if (cpu < 0)
+	return -1;
+    if (nodes == 1)
+	return 0;
+    if (size_t(cpu) >= cpu_nodes.size())
+	return -1;
+    return cpu_nodes[cpu];
+}
+
+int
+CpuTopology::node_of_cpus(const std::vector<int> & cpus) const
+{
+    int result = -1;
+    for (size_t i = 0; i != cpus.size(); ++i) {
+	int node = node_of_cpu(cpus[i]);
+	if (node == -1 || (i != 0 && node != result))
+	    return -1;
+	result = node;
+    }
+    return result;
+}
+
+int
+bind_thread_to_cpus(const std::vector<int> & cpus)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i != cpus.size(); ++i) {
+	if (cpus[i] >= CPU_SETSIZE)
+	    return EINVAL;
+	CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpus;
+    return ENOSYS;
+#endif
+}
+
+int
+get_current_cpu()
+{
+#ifdef HAVE_SCHED_GETCPU
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+void *
+alloc_on_node(size_t size, int node)
+{
+    void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+	return NULL;
+#ifdef SYS_mbind
+    if (node >= 0 && size_t(node) < sizeof(unsigned long) * CHAR_BIT) {
+	unsigned long mask = 1UL << node;
+	// The policy only takes effect when the pages are first touched, so
+	// it must be set before the memory is used.  Failure isn't fatal: the
+	// memory is just placed wherever the kernel chooses.
+	// The kernel reads one bit fewer than the node count passed.
+	(void) syscall(SYS_mbind, ptr, size, XAPSRV_MPOL_PREFERRED, &mask,
+		       sizeof(mask) * CHAR_BIT + 1, 0);
+    }
+#endif
+    return ptr;
+}
+
+void
+free_on_node(void * ptr, size_t size)
+{
+    if (ptr != NULL)
+	munmap(ptr, size);
+}
@@ -0,0 +1,123 @@
+/** @file topology.h
+ * @brief The CPU and NUMA topology of the machine, and thread placement.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_TOPOLOGY_H
+#define XAPSRV_INCLUDED_TOPOLOGY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/** Parse a list of CPU numbers, in the format used by sysfs and taskset.
+ *
+ *  The list is a comma separated list of CPU numbers and ranges, such as
+ *  "0-3,8,10-11".
+ *
+ *  @param text The list to parse.
+ *  @param cpus Set to the CPU numbers in the list, in increasing order.
+ *
+ *  @retval true if the list was valid.
+ */
+bool parse_cpu_list(const std::string & text, std::vector<int> & cpus);
+
+/** Format a list of CPU numbers in the format read by parse_cpu_list().
+ */
+std::string format_cpu_list(const std::vector<int> & cpus);
+
+/** The NUMA nodes which the CPUs of the machine belong to.
+ *
+ *  This is read from sysfs, so that libnuma isn't needed.  On machines
+ *  without NUMA support, all CPUs are treated as being on node 0.
+ */
+class CpuTopology {
+    /// The node of each CPU, indexed by CPU number, or -1 if unknown.
+    std::vector<int> cpu_nodes;
+
+    /// The number of nodes.
+    int nodes;
+
+    /// The CPUs which the process was allowed to run on at startup.
+    std::vector<int> allowed;
+  public:
+    /// Create a topology with a single node.
+    CpuTopology();
+
+    /** Read the topology of the machine.
+     *
+     *  @param node_dir The sysfs directory holding a subdirectory for each
+     *  node (normally "/sys/devices/system/node").
+     */
+    void load(const std::string & node_dir);
+
+    /// The number of NUMA nodes.
+    int node_count() const { return nodes; }
+
+    /// The node which a CPU is on, or -1 if it is unknown.
+    int node_of_cpu(int cpu) const;
+
+    /** The node which a set of CPUs is on.
+     *
+     *  @returns -1 if the set is empty, or spans more than one node.
+     */
+    int node_of_cpus(const std::vector<int> & cpus) const;
+
+    /** The CPUs which the process was allowed to run on when the topology
+     *  was loaded.
+     */
+    const std::vector<int> & allowed_cpus() const { return allowed; }
+};
+
+/** Restrict the calling thread to run on a set of CPUs.
+ *
+ *  @returns 0 on success, or an errno value on failure.
+ */
+int bind_thread_to_cpus(const std::vector<int> & cpus);
+
+/** Get the CPU which the calling thread is running on.
+ *
+ *  @returns -1 if this can't be found.
+ */
+int get_current_cpu();
+
+/** Allocate memory, preferably from a given NUMA node.
+ *
+ *  The memory is page aligned, and is placed on the node when first used if
+ *  the node has any free memory.  It must be freed with free_on_node().
+ *
+ *  @param size The number of bytes to allocate.
+ *  @param node The node to allocate from, or -1 for any node.
+ *
+ *  @returns the memory, or NULL if it couldn't be allocated.
+ */
+void * alloc_on_node(size_t size, int node);
+
+/** Free memory allocated by alloc_on_node().
+ *
+ *  @param ptr The memory.
+ *  @param size The size passed to alloc_on_node().
+ */
+void free_on_node(void * ptr, size_t size);
+
+#endif /* XAPSRV_INCLUDED_TOPOLOGY_H */
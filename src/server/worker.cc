@@ -29,69 +29,272 @@
 
 #include <assert.h>
 #include <errno.h>
+#include "codec.h"
+#include "json/json.h"
+#include <new>
 #include "serverinternal.h"
+#include "str.h"
+#include "topology.h"
+#include "utils.h"
+
+/// The size of the stack of each fiber running a worker.
+#define WORKER_FIBER_STACK_SIZE (256 * 1024)
+
+/** Runs the fibers of a worker, waking the worker's thread when a fiber
+ *  becomes ready while the thread waits for a message.
+ */
+class WorkerFibers : public FiberScheduler {
+    RunQueue * queue;
+    int slot;
+  protected:
+    void notify_ready() { queue->wake(slot); }
+  public:
+    WorkerFibers(RunQueue * queue_, int slot_)
+	    : FiberScheduler(WORKER_FIBER_STACK_SIZE),
+	      queue(queue_), slot(slot_) {}
+};
 
 WorkerThread::WorkerThread(ServerInternal * server_, WorkerPool * pool_,
-			   Worker * worker_)
+			   Worker * worker_, WorkerGroup * group_, int slot_)
 	: worker(worker_),
 	  server(server_),
 	  pool(pool_),
-	  messages(),
-	  stop_requested(false),
+	  group(group_),
+	  queue(group_->queue),
+	  slot(slot_),
 	  started(false),
 	  joined(false),
-	  had_message(false)
+	  had_message(false),
+	  exit_ready(true),
+	  arena(),
+	  fibers(),
+	  current_fiber(NULL)
 {
-    pthread_cond_init(&message_cond, NULL);
-    pthread_mutex_init(&message_mutex, NULL);
 }
 
 WorkerThread::~WorkerThread()
 {
     stop();
     join();
-    pthread_cond_destroy(&message_cond);
-    pthread_mutex_destroy(&message_mutex);
+    delete worker;
+}
+
+void
+WorkerThread::note_message_taken(const Message & msg)
+{
+    WorkerGroupStats & stats = group->stats;
+    if (msg.queued_at != 0)
+	stats.queue_wait_us.record(get_monotonic_usec() - msg.queued_at);
+    if (msg.queued_cpu != -1) {
+	const CpuTopology & topology = pool->get_topology();
+	if (topology.node_of_cpu(msg.queued_cpu) ==
+	    topology.node_of_cpu(get_current_cpu())) {
+	    (void) __sync_fetch_and_add(&stats.messages_local_node, 1);
+	} else {
+	    (void) __sync_fetch_and_add(&stats.messages_cross_node, 1);
+	}
+    }
 }
 
 Message
 WorkerThread::wait_for_message(bool ready_to_exit)
 {
+    if (current_fiber != NULL)
+	return wait_in_fiber(ready_to_exit);
+
     Message result;
 
+    // Release everything allocated for the last message at once.
+    arena.reset();
+
     if (had_message) {
 	// Tell the pool we've handled a message.
-	//
-	// This isn't done when the mutex is held to avoid deadlock - the pool may
-	// know that the ready_to_exit flag isn't correct because it's already sent
-	// a message to the worker which the worker hasn't handled, but it will
-	// deal with that.
 	pool->worker_message_handled(this, ready_to_exit);
     } else {
 	had_message = true;
     }
 
-    if (pthread_mutex_lock(&message_mutex) != 0)
-	throw StopWorkerException();
-    while (!stop_requested && messages.empty()) {
-	// Worker is idle
-	(void)pthread_cond_wait(&message_cond, &message_mutex);
+    long long idle_timeout = server->get_settings().idle_timeout * 1000000LL;
+    while (true) {
+	RunQueue::PopResult popped = queue->pop(slot, result, idle_timeout);
+	if (popped == RunQueue::POP_MESSAGE)
+	    break;
+	if (popped == RunQueue::POP_WOKEN)
+	    continue;
+	if (popped == RunQueue::POP_STOPPED ||
+	    pool->retire_idle_worker(this))
+	    throw StopWorkerException();
     }
-    if (stop_requested) {
-	(void) pthread_mutex_unlock(&message_mutex);
-	throw StopWorkerException();
+    note_message_taken(result);
+    return result;
+}
+
+Message
+WorkerThread::wait_in_fiber(bool ready_to_exit)
+{
+    FiberState & state = *current_fiber;
+    // Release everything allocated for the fiber's last message at once.
+    state.arena.reset();
+    queue->release(slot);
+    if (state.had_message) {
+	pool->worker_message_handled(this, ready_to_exit);
+    } else {
+	state.had_message = true;
     }
-    result = messages.front();
-    messages.pop();
-    if (pthread_mutex_unlock(&message_mutex) != 0)
+
+    // The thread waits for a message on the fiber's behalf, and resumes it
+    // once it has one, or to stop it.
+    state.waiting = true;
+    Fiber::suspend();
+    if (state.stop)
 	throw StopWorkerException();
+    Message result(state.message);
+    state.message = Message(-1);
+    note_message_taken(result);
     return result;
 }
 
 void
-WorkerThread::send_response(int connection_num, const std::string & msg)
+WorkerThread::resume_fiber(FiberScheduler & scheduler, FiberState & state)
+{
+    queue->switch_message(slot, state.index);
+    current_fiber = &state;
+    scheduler.resume(state.fiber);
+    current_fiber = NULL;
+}
+
+void
+WorkerThread::run_fiber(void * arg)
+{
+    FiberState * state = static_cast<FiberState *>(arg);
+    try {
+	state->thread->worker->run();
+    } catch (StopWorkerException & e) {
+	// Do nothing
+    }
+}
+
+void
+WorkerThread::run_fibers(size_t count)
+{
+    WorkerFibers scheduler(queue, slot);
+    queue->set_concurrency(slot, count);
+    for (size_t i = 0; i != count; ++i) {
+	FiberState * state = new FiberState(this, i);
+	try {
+	    state->fiber = scheduler.spawn(run_fiber, state);
+	} catch (std::bad_alloc & e) {
+	    delete state;
+	    pool->logger->error("Can't allocate a stack for a worker fiber");
+	    break;
+	}
+	fibers.push_back(state);
+    }
+    if (fibers.empty()) {
+	try {
+	    worker->run();
+	} catch (StopWorkerException & e) {
+	    // Do nothing
+	}
+	return;
+    }
+
+    long long idle_timeout = server->get_settings().idle_timeout * 1000000LL;
+    bool stopping = false;
+    while (true) {
+	Fiber * fiber;
+	while (scheduler.next_ready(fiber)) {
+	    resume_fiber(scheduler,
+			 *static_cast<FiberState *>(fiber->get_arg()));
+	}
+
+	// Fibers which aren't waiting for a message are handling one.
+	FiberState * waiting = NULL;
+	size_t live = 0;
+	size_t busy = 0;
+	for (size_t i = 0; i != fibers.size(); ++i) {
+	    if (fibers[i]->fiber->is_finished())
+		continue;
+	    ++live;
+	    if (!fibers[i]->waiting) {
+		++busy;
+	    } else if (waiting == NULL) {
+		waiting = fibers[i];
+	    }
+	}
+	if (live == 0)
+	    break;
+
+	if (waiting == NULL) {
+	    scheduler.wait_for_ready();
+	    continue;
+	}
+	if (stopping) {
+	    // Fibers handling a message finish it before they stop.
+	    for (size_t i = 0; i != fibers.size(); ++i) {
+		if (fibers[i]->waiting) {
+		    fibers[i]->waiting = false;
+		    fibers[i]->stop = true;
+		    scheduler.make_ready(fibers[i]->fiber);
+		}
+	    }
+	    continue;
+	}
+
+	// Only give up waiting for a message if no fiber is busy; otherwise,
+	// the queue wakes the thread when a busy fiber is ready to carry on.
+	queue->switch_message(slot, waiting->index);
+	RunQueue::PopResult popped =
+		queue->pop(slot, waiting->message, busy == 0 ? idle_timeout : 0);
+	switch (popped) {
+	    case RunQueue::POP_MESSAGE:
+		waiting->waiting = false;
+		resume_fiber(scheduler, *waiting);
+		break;
+	    case RunQueue::POP_STOPPED:
+		stopping = true;
+		break;
+	    case RunQueue::POP_IDLE:
+		if (pool->retire_idle_worker(this))
+		    stopping = true;
+		break;
+	    case RunQueue::POP_WOKEN:
+		break;
+	}
+    }
+
+    for (size_t i = 0; i != fibers.size(); ++i) {
+	delete fibers[i];
+    }
+    fibers.clear();
+}
+
+void
+WorkerThread::send_response(const Response & response)
+{
+    // Check for cancellation and mark the message as responded to
+    // atomically, so that a cancel request either prevents the response or
+    // finds that it has already been sent.
+    if (queue->claim_response(slot, response.connection_num))
+	server->queue_response(response);
+}
+
+bool
+WorkerThread::cancelled()
+{
+    // Workers check for cancellation while they make progress, so this
+    // also shows the watchdog that the worker isn't stuck.
+    queue->heartbeat(slot);
+    return queue->cancelled(slot);
+}
+
+bool
+WorkerThread::missed_deadline(const Message & msg)
 {
-    server->queue_response(connection_num, msg);
+    if (msg.deadline == 0 || get_monotonic_usec() < msg.deadline)
+	return false;
+    server->get_stats().incr("messages_expired");
+    return true;
 }
 
 static void *
@@ -105,8 +308,28 @@ run_worker_thread(void * arg_ptr)
 void
 WorkerThread::do_run()
 {
+    // Move to the group's CPUs before warming up, so that memory the worker
+    // allocates is placed on their node.
+    const std::vector<int> & cpus = queue->get_cpus();
+    if (!cpus.empty()) {
+	int ret = bind_thread_to_cpus(cpus);
+	if (ret != 0) {
+	    pool->logger->error("Can't run worker on CPUs " +
+				format_cpu_list(cpus) + ": " +
+				get_sys_error(ret));
+	}
+    }
     try {
-	worker->run();
+	long long start = get_monotonic_usec();
+	worker->warm_up();
+	server->get_stats().record("worker_warm_up_us",
+				   get_monotonic_usec() - start);
+	size_t count = size_t(server->get_settings().worker_fibers);
+	if (count > 1 && worker->multiplexes()) {
+	    run_fibers(count);
+	} else {
+	    worker->run();
+	}
     } catch (StopWorkerException & e) {
 	// Do nothing
     }
@@ -121,8 +344,10 @@ WorkerThread::start()
     started = true;
     pool->logger->debug("Starting worker");
     int ret = pthread_create(&worker_thread, NULL, run_worker_thread, this);
-    if (ret == -1) {
-	server->set_sys_error("Can't create worker thread", errno);
+    if (ret != 0) {
+	// pthread_create() returns the error, rather than setting errno.
+	started = false;
+	server->set_sys_error("Can't create worker thread", ret);
 	return false;
     }
     return true;
@@ -131,18 +356,11 @@ WorkerThread::start()
 void
 WorkerThread::stop()
 {
-    if (!started)
+    // Once the thread has exited, its slot may belong to another worker.
+    if (!started || joined)
 	return;
-    if (pthread_mutex_lock(&message_mutex) != 0)
-	server->set_sys_error("Can't get lock on worker to stop it", errno);
-    if (!stop_requested) {
-	stop_requested = true;
-	pool->logger->debug("Stopping worker");
-	(void) pthread_cond_signal(&message_cond);
-    }
-    if (pthread_mutex_unlock(&message_mutex) != 0)
-	server->set_sys_error("Can't release lock on worker after stopping it",
-			      errno);
+    pool->logger->debug("Stopping worker");
+    queue->stop(slot);
 }
 
 void
@@ -159,32 +377,97 @@ WorkerThread::join()
     pool->logger->debug("Worker stopped");
 }
 
+Message
+Worker::wait_for_message(bool ready_to_exit)
+{
+    while (true) {
+	Message msg = thread->wait_for_message(ready_to_exit);
+	if (!thread->missed_deadline(msg))
+	    return msg;
+	deadline_missed(msg);
+    }
+}
+
 void
-WorkerThread::send_message(const Message & msg)
+Worker::send_response(int connection_num, const std::string & msg)
 {
-    if (pthread_mutex_lock(&message_mutex) != 0)
-	server->set_sys_error("Can't get lock on worker to send message to it",
-			      errno);
-    messages.push(msg);
-    (void) pthread_cond_signal(&message_cond);
-    if (pthread_mutex_unlock(&message_mutex) != 0)
-	server->set_sys_error("Can't release lock on worker after sending "
-			      "message to it", errno);
+    thread->send_response(Response(connection_num, std::string(), '\0', msg));
 }
 
-Message
-Worker::wait_for_message(bool ready_to_exit)
+void
+WorkerThread::compress_response(Response & response,
+				 const std::string & encoding)
+{
+    const ServerSettings & settings = server->get_settings();
+    if (response.payload.size() < size_t(settings.compress_threshold))
+	return;
+    Codec * codec = get_codec(encoding);
+    if (codec == NULL)
+	return;
+
+    Stats & stats = server->get_stats();
+    std::string compressed;
+    long long start = get_thread_cpu_usec();
+    bool ok = codec->compress(response.payload, compressed);
+    stats.incr("compress_cpu_us", get_thread_cpu_usec() - start);
+    // Send the response uncompressed if compressing it didn't help.
+    if (!ok || compressed.size() >= response.payload.size())
+	return;
+    stats.incr("compressed_responses");
+    stats.incr("compress_bytes_in", response.payload.size());
+    stats.incr("compress_bytes_out", compressed.size());
+    response.payload.swap(compressed);
+    response.encoding = codec->name();
+}
+
+void
+Worker::send_response(const Message & msg, char status,
+		      const std::string & payload)
+{
+    Response response(msg.connection_num, msg.msgid, status, payload);
+    if (!msg.accept_encoding.empty())
+	thread->compress_response(response, msg.accept_encoding);
+    thread->send_response(response);
+}
+
+bool
+Worker::cancelled()
+{
+    return thread->cancelled();
+}
+
+Arena &
+Worker::get_arena()
+{
+    return thread->get_arena();
+}
+
+Worker::~Worker()
 {
-    return thread->wait_for_message(ready_to_exit);
 }
 
 void
-Worker::send_response(int connection_num, const std::string & msg)
+Worker::warm_up()
 {
-    return thread->send_response(connection_num, msg);
 }
 
 void
 Worker::cleanup()
 {
 }
+
+bool
+Worker::multiplexes() const
+{
+    return false;
+}
+
+void
+Worker::deadline_missed(const Message & msg)
+{
+    Json::FastWriter writer;
+    Json::Value root;
+    root[Json::StaticString("ok")] = 0;
+    root[Json::StaticString("msg")] = "Deadline exceeded";
+    send_response(msg, 'E', writer.write(root));
+}
@@ -26,8 +26,10 @@
 #ifndef XAPSRV_INCLUDED_WORKER_H
 #define XAPSRV_INCLUDED_WORKER_H
 
+#include "arena.h"
+#include "fiber.h"
 #include <pthread.h>
-#include <queue>
+#include "runqueue.h"
 #include "server.h"
 #include "serverinternal.h"
 #include <string>
@@ -35,6 +37,7 @@
 
 class Worker;
 class WorkerPool;
+struct WorkerGroup;
 
 /** Exception raised to stop a worker.
  */
@@ -46,7 +49,50 @@ class StopWorkerException {
     const std::string & get_message() const { return message; }
 };
 
+/** A thread running a worker.
+ *
+ *  If the worker can handle several messages at once (see
+ *  Worker::multiplexes()), and the server is set to let it, the thread runs
+ *  the worker in several fibers, each handling one message at a time.  The
+ *  thread waits for messages on behalf of the fibers, and gives each message
+ *  to a fiber which is waiting for one; a fiber which waits for something
+ *  else, such as more of a streamed payload, lets the others run meanwhile.
+ *  The worker keeps a single slot in its queue, which holds the state of
+ *  each fiber's message.
+ */
 class WorkerThread {
+    /// The state of a fiber running the worker.
+    struct FiberState {
+	/// The thread running the fiber.
+	WorkerThread * thread;
+
+	/// The fiber.
+	Fiber * fiber;
+
+	/// The index of the fiber's message in the worker's slot.
+	size_t index;
+
+	/// Flag, set to true while the fiber waits for a message.
+	bool waiting;
+
+	/// Flag, set to true when the fiber should stop rather than take
+	/// another message.
+	bool stop;
+
+	/// Flag, set to true once the fiber has taken a message.
+	bool had_message;
+
+	/// The message given to the fiber.
+	Message message;
+
+	/// The arena for temporaries used while handling the fiber's message.
+	Arena arena;
+
+	FiberState(WorkerThread * thread_, size_t index_)
+		: thread(thread_), fiber(NULL), index(index_), waiting(false),
+		  stop(false), had_message(false), message(), arena() {}
+    };
+
     /// The worker for this thread.
     Worker * worker;
 
@@ -56,17 +102,14 @@ class WorkerThread {
     /// The worker pool controlling this worker.
     WorkerPool * pool;
 
-    /** The messages received.
-     *
-     *  message_mutex must be held when accessing this.
-     */
-    std::queue<Message> messages;
+    /// The group which the worker is in.
+    WorkerGroup * group;
 
-    /** Flag, set to true when a stop has been requested.
-     *
-     *  message_mutex must be held when accessing this.
-     */
-    bool stop_requested;
+    /// The queue which the worker takes messages from.
+    RunQueue * queue;
+
+    /// The worker's slot in the queue.
+    int slot;
 
     /** Flag, set to true when worker is started.
      *
@@ -86,23 +129,53 @@ class WorkerThread {
      */
     bool had_message;
 
-    /** The thread containing the worker.
+    /** Flag, set to true when the worker has no significant outstanding
+     *  work to do before exiting.
      */
-    pthread_t worker_thread;
+    volatile bool exit_ready;
 
-    /** Condition used to signal receipt of new messages.
+    /** The arena for temporaries used while handling a message.
+     *
+     *  This is reset each time the worker waits for a message.  Fibers
+     *  each have their own arena instead.
      */
-    pthread_cond_t message_cond;
+    Arena arena;
+
+    /// The worker's fibers, if it runs in fibers.
+    std::vector<FiberState *> fibers;
+
+    /// The fiber which is running, or NULL.
+    FiberState * current_fiber;
 
-    /** Mutex to be held when using message_cond.
+    /// Record statistics about a message which has just been taken.
+    void note_message_taken(const Message & msg);
+
+    /// Wait for a message for the running fiber.
+    Message wait_in_fiber(bool ready_to_exit);
+
+    /// Run a fiber until it waits or finishes.
+    void resume_fiber(FiberScheduler & scheduler, FiberState & state);
+
+    /// Run the worker in a number of fibers, until they have all stopped.
+    void run_fibers(size_t count);
+
+    /// The entry point of each fiber.
+    static void run_fiber(void * arg);
+
+    /** The thread containing the worker.
      */
-    pthread_mutex_t message_mutex;
+    pthread_t worker_thread;
 
   public:
     /** Create a new worker.
+     *
+     *  @param worker_ The worker to run, which is owned by the thread.
+     *  @param group_ The group the worker is in, whose queue it takes
+     *  messages from.
+     *  @param slot_ The worker's slot in the queue.
      */
     WorkerThread(ServerInternal * server_, WorkerPool * pool_,
-		 Worker * worker_);
+		 Worker * worker_, WorkerGroup * group_, int slot_);
 
     /** Clean up after the worker.
      */
@@ -126,9 +199,20 @@ class WorkerThread {
      */
     Message wait_for_message(bool ready_to_exit);
 
-    /** Send a response to a connection.
+    /** Send a response.
+     *
+     *  If the response is for the current message, and the message has been
+     *  cancelled, the response is discarded.
+     */
+    void send_response(const Response & response);
+
+    /** Compress the payload of a response, if it's large enough to be worth
+     *  it.
+     *
+     *  @param response The response to compress.
+     *  @param encoding The encoding to compress it with.
      */
-    void send_response(int connection_num, const std::string & msg);
+    void compress_response(Response & response, const std::string & encoding);
 
     /** Start the worker running (in a new thread).
      */
@@ -144,9 +228,32 @@ class WorkerThread {
      */
     void join();
 
-    /** Send a message to the worker.
+    /// Get the group which the worker is in.
+    WorkerGroup * get_group() const { return group; }
+
+    /// Get the queue which the worker takes messages from.
+    RunQueue * get_queue() const { return queue; }
+
+    /// Note whether the worker has significant work to do before exiting.
+    void set_ready_to_exit(bool value) { exit_ready = value; }
+
+    /// Get the worker's slot in its queue.
+    int get_slot() const { return slot; }
+
+    /// Get the arena for temporaries used while handling a message.
+    Arena & get_arena() {
+	return current_fiber == NULL ? arena : current_fiber->arena;
+    }
+
+    /** Check if the current message has been cancelled.
+     */
+    bool cancelled();
+
+    /** Check whether a message's deadline passed before it was taken.
+     *
+     *  Messages which missed their deadline are counted in the statistics.
      */
-    void send_message(const Message & msg);
+    bool missed_deadline(const Message & msg);
 
     /** Called to start the worker thread.
      */
@@ -26,63 +26,60 @@
 #include <config.h>
 #include "workerpool.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <new>
 #include "server.h"
+#include "serverinternal.h"
 #include "str.h"
+#include "utils.h"
 #include "worker.h"
 
+/// Grow a group whose messages waited longer than this on average, in
+/// microseconds...
+#define AUTOSCALE_GROW_WAIT_USEC 10000
+
+/// ...or whose workers were busy for more than this fraction of the time.
+#define AUTOSCALE_GROW_BUSY 0.85
+
+/// Don't grow groups while the process uses more than this fraction of the
+/// CPU time available to it: more workers would only compete for the CPUs.
+#define AUTOSCALE_CPU_SATURATED 0.9
+
+/// Shrink a group whose workers were busy for less than this fraction of
+/// the time, and whose messages waited less than AUTOSCALE_SHRINK_WAIT_USEC
+/// on average, for AUTOSCALE_SHRINK_SAMPLES samples in a row.
+#define AUTOSCALE_SHRINK_BUSY 0.4
+#define AUTOSCALE_SHRINK_WAIT_USEC 1000
+#define AUTOSCALE_SHRINK_SAMPLES 3
+
+/// The number of samples after a group grows before it may shrink.
+#define AUTOSCALE_COOLDOWN_SAMPLES 5
+
 void
-WorkerPool::add_worker(WorkerThread * worker, const std::string & group)
+WorkerGroupStats::add_stats(Stats::Totals & totals) const
 {
-    try {
-	workers.insert(std::make_pair(worker, WorkerDetails(group)));
-    } catch(...) {
-	delete worker;
-	throw;
-    }
-
-    // Add the worker to `workers_by_group`
-    std::map<std::string, std::set<WorkerThread *> >::iterator i;
-    i = workers_by_group.find(group);
-    if (i == workers_by_group.end()) {
-	std::pair<std::map<std::string, std::set<WorkerThread *> >::iterator,
-		bool> j;
-	j = workers_by_group.insert(
-		std::make_pair(group, std::set<WorkerThread *>()));
-	i = j.first;
-	assert(j.second);
-    }
-    i->second.insert(worker);
+    queue_wait_us.add_to(totals, "queue_wait_us");
+    if (messages_local_node != 0)
+	totals.values["messages_local_node"] += messages_local_node;
+    if (messages_cross_node != 0)
+	totals.values["messages_cross_node"] += messages_cross_node;
 }
 
 bool
 WorkerPool::remove_current_worker(WorkerThread * worker)
 {
-    std::map<WorkerThread *, WorkerDetails>::iterator i;
-    i = workers.find(worker);
-    if (i == workers.end())
-	return false;
-    std::map<std::string, std::set<WorkerThread *> >::iterator j;
-    j = workers_by_group.find(i->second.group);
-    if (j == workers_by_group.end())
-	return false;
-
-    std::set<WorkerThread *>::iterator k = j->second.find(worker);
-    if (k == j->second.end())
-	return false;
-    j->second.erase(k);
-    workers.erase(i);
-    return true;
+    return worker->get_group()->workers.erase(worker) != 0;
 }
 
 void
-WorkerPool::request_exit(WorkerThread * worker)
+WorkerPool::add_exiting_worker(WorkerThread * worker)
 {
-    logger->debug("Sending stop request to worker");
     if (!remove_current_worker(worker)) {
 	logger->error("Couldn't remove worker - not in list of current "
 		      "workers.  Possible resource leak.");
     }
+    ContextLocker lock(exit_mutex);
     try {
 	exiting_workers.insert(worker);
     } catch(...) {
@@ -90,66 +87,273 @@ WorkerPool::request_exit(WorkerThread * worker)
 		      "Possible resource leak.");
 	throw;
     }
-    worker->stop();
+}
+
+int
+WorkerPool::group_id(const std::string & group_name)
+{
+    std::map<std::string, int>::const_iterator i = group_ids.find(group_name);
+    if (i != group_ids.end())
+	return i->second;
+
+    // Workers in groups without CPUs of their own mustn't inherit the CPUs
+    // of the connection handling thread which starts them.
+    std::vector<int> cpus;
+    (void) parse_cpu_list(dispatcher->worker_cpus(group_name), cpus);
+    if (cpus.empty() && !server->get_settings().reactor_cpus.empty())
+	cpus = topology.allowed_cpus();
+    int node = -1;
+    if (topology.node_count() > 1)
+	node = topology.node_of_cpus(cpus);
+
+    // Each group gets its own pages, so that groups never share a cache
+    // line, and the group's workers find it in local memory.
+    void * mem = alloc_on_node(sizeof(WorkerGroup), node);
+    if (mem == NULL)
+	throw std::bad_alloc();
+    int id = int(groups.size());
+    WorkerGroup * group = new (mem) WorkerGroup(group_name, id);
+    group->cpus = cpus;
+    group->node = node;
+    try {
+	groups.push_back(group);
+	group_ids[group_name] = id;
+    } catch(...) {
+	if (groups.size() > size_t(id))
+	    groups.pop_back();
+	group->~WorkerGroup();
+	free_on_node(mem, sizeof(WorkerGroup));
+	throw;
+    }
+    return id;
 }
 
 void
-WorkerPool::send_to_worker(const std::string & group,
-			   const Message & msg)
+WorkerPool::set_up_group(WorkerGroup & group)
 {
-    ContextLocker lock(workerlist_mutex);
-    // Look for a worker with no messages waiting.
-    std::map<WorkerThread *, WorkerDetails>::iterator k;
-    WorkerThread * workerthread = NULL;
+    if (group.queue != NULL)
+	return;
 
-    std::map<std::string, std::set<WorkerThread *> >::iterator i;
-    i = workers_by_group.find(group);
-    if (i != workers_by_group.end()) {
-	std::set<WorkerThread *>::iterator j;
-	for (j = i->second.begin(); j != i->second.end(); ++j) {
-	    k = workers.find(*j);
-	    assert(k != workers.end());
-	    if (k->second.messages == 0) {
-		workerthread = k->first;
-		break;
+    // The group can never have more workers than are allowed for the most
+    // urgent messages.
+    int slots = 1;
+    for (int priority = 0; priority != PRIORITY_LEVELS; ++priority) {
+	slots = std::max(slots, dispatcher->max_workers(group.name, priority));
+    }
+
+    if (!group.cpus.empty()) {
+	logger->info("Running workers in group '" + group.name +
+		     "' on CPUs " + format_cpu_list(group.cpus) +
+		     (group.node == -1 ? std::string() :
+		      " (node " + str(group.node) + ")"));
+    }
+    // Stalled workers may be replaced, up to doubling the group.
+    int queue_slots = slots;
+    if (server->get_settings().stall_timeout > 0)
+	queue_slots *= 2;
+    group.queue = new RunQueue(queue_slots,
+			       server->get_settings().queue_size,
+			       &server->get_stats(), group.cpus, group.node,
+			       !server->get_settings().fair_by.empty(),
+			       server->get_settings().affinity,
+			       server->get_settings().queue_order == "edf");
+    server->get_stats().add_source(&group.stats);
+    group.target = slots;
+    if (server->get_settings().autoscale_interval > 0) {
+	// Start small, and let the autoscaler grow the group.
+	group.target = std::max(dispatcher->min_workers(group.name), 1);
+	group.target = std::min(group.target, slots);
+	group.queue->sample_load(group.last_load);
+	server->get_stats().set("workers_target_" + group.name, group.target);
+    }
+
+    group.admission.set_target(
+	    server->get_settings().overload_delay * 1000LL);
+
+    int min_workers = std::min(dispatcher->min_workers(group.name), slots);
+    while (int(group.workers.size()) < min_workers) {
+	if (!start_worker(group))
+	    break;
+    }
+}
+
+bool
+WorkerPool::start_worker(WorkerGroup & group)
+{
+    int slot = group.queue->add_worker();
+    if (slot == -1)
+	return false;
+    logger->debug("Starting new worker");
+    Worker * worker = dispatcher->get_worker(group.name,
+					     group.workers.size());
+    if (worker == NULL) {
+	group.queue->remove_worker(slot);
+	return false;
+    }
+    WorkerThread * workerthread =
+	    new WorkerThread(server, this, worker, &group, slot);
+    worker->set_thread(workerthread);
+    try {
+	group.workers.insert(workerthread);
+    } catch(...) {
+	group.queue->remove_worker(slot);
+	delete workerthread;
+	throw;
+    }
+    if (!workerthread->start()) {
+	(void) remove_current_worker(workerthread);
+	group.queue->remove_worker(slot);
+	delete workerthread;
+	return false;
+    }
+    server->get_stats().incr("workers_started");
+    server->get_stats().adjust("workers", 1);
+    return true;
+}
+
+int
+WorkerPool::worker_limit(const WorkerGroup & group, int priority)
+{
+    int limit = dispatcher->max_workers(group.name, priority);
+    // The target replaces the limit for the most urgent messages; less
+    // urgent messages keep the same number of workers in reserve.
+    int reserved = dispatcher->max_workers(group.name, PRIORITY_INTERACTIVE) -
+	    limit;
+    return std::max(std::min(limit, group.target - reserved), 1);
+}
+
+void
+WorkerPool::send_to_worker(int group_id, const Message & msg)
+{
+    Message queued_msg(msg);
+    queued_msg.queued_at = get_monotonic_usec();
+    if (topology.node_count() > 1)
+	queued_msg.queued_cpu = get_current_cpu();
+
+    // The queue outlives the workers, so can be used without the lock.
+    WorkerGroup & group = *groups[group_id];
+    {
+	ContextLocker lock(group.mutex);
+	set_up_group(group);
+	if (group.workers.empty() && !start_worker(group)) {
+	    lock.unlock();
+	    logger->error("Unable to start a worker for group '" + group.name +
+			  "' - rejecting message");
+	    server->get_stats().incr("messages_rejected");
+	    dispatcher->message_rejected(queued_msg);
+	    return;
+	}
+    }
+
+    // The message goes to an idle worker if there is one, and is otherwise
+    // queued for the next one to become free.  The queue is ordered by
+    // priority, so urgent messages still go ahead of less urgent ones.
+    logger->debug("queueing request from connection " +
+		  str(msg.connection_num));
+    Message rejected;
+    bool reject = group.queue->push(queued_msg, rejected);
+
+    // Start a new worker if no idle worker is about to take the message.
+    // This is checked after the message is queued, so that a worker which
+    // is retiring either sees the message or is not counted as idle.
+    if (group.queue->backlog() != 0) {
+	ContextLocker lock(group.mutex);
+	if (group.usable_workers() < worker_limit(group, msg.priority)) {
+	    (void) start_worker(group);
+	}
+    }
+
+    if (reject) {
+	logger->error("Rejecting message '" + rejected.msgid +
+		      "' - queue for group '" + group.name + "' is full");
+	server->get_stats().incr("messages_rejected");
+	dispatcher->message_rejected(rejected);
+    }
+}
+
+bool
+WorkerPool::overloaded(int group_id, long long & retry_after_usec)
+{
+    WorkerGroup & group = *groups[group_id];
+    ContextLocker lock(group.mutex);
+    if (group.queue == NULL || !group.admission.enabled())
+	return false;
+
+    long long now = get_monotonic_usec();
+    if (group.admission.due(now)) {
+	long long min_wait = group.queue->take_min_wait();
+	bool backlogged = group.queue->backlog() != 0;
+	if (group.admission.update(now, min_wait, backlogged)) {
+	    if (group.admission.is_overloaded()) {
+		logger->info("Group '" + group.name + "' is overloaded - "
+			     "messages waited at least " +
+			     str(group.admission.get_standing_delay()) +
+			     "us for a worker");
+	    } else {
+		logger->info("Group '" + group.name +
+			     "' is no longer overloaded");
 	    }
 	}
     }
-    if (!workerthread) {
-	// FIXME - queue the message if can't, or shouldn't, make the
-	// worker.
-	logger->debug("Starting new worker");
-	Worker * worker = dispatcher->get_worker(group, 0);
-	workerthread = new WorkerThread(server, this, worker);
-	worker->set_thread(workerthread);
-	add_worker(workerthread, group);
-	k = workers.find(workerthread);
-	workerthread->start();
+    if (!group.admission.is_overloaded())
+	return false;
+    if (group.queue->backlog() < std::max(group.workers.size(), size_t(1)))
+	return false;
+    retry_after_usec = group.admission.retry_after();
+    return true;
+}
+
+CancelResult
+WorkerPool::cancel_message(int connection_num, const std::string & msgid)
+{
+    // Queues are only created by this thread, and never removed, so no
+    // lock is needed to find them.
+    CancelResult result = CANCEL_NOT_FOUND;
+    std::vector<WorkerGroup *>::const_iterator i;
+    for (i = groups.begin(); i != groups.end(); ++i) {
+	if ((*i)->queue == NULL)
+	    continue;
+	CancelResult group_result = (*i)->queue->cancel(connection_num, msgid);
+	if (group_result != CANCEL_NOT_FOUND) {
+	    result = group_result;
+	    if (!msgid.empty())
+		break;
+	}
     }
-    logger->debug("sending request from connection " + str(msg.connection_num) +
-		 " to worker");
-    ++(k->second.messages);
-    k->second.ready_to_exit = false;
-    workerthread->send_message(msg);
+    return result;
+}
+
+void
+WorkerPool::cancel_queued_messages(int connection_num)
+{
+    (void) cancel_message(connection_num, std::string());
 }
 
 WorkerPool::WorkerPool(Logger * logger_, Dispatcher * dispatcher_,
 		       ServerInternal * server_)
-	: logger(logger_), dispatcher(dispatcher_), server(server_)
+	: logger(logger_), dispatcher(dispatcher_), server(server_),
+	  topology(), groups(), group_ids(), exit_mutex("worker_exit"), exiting_workers(),
+	  exited_workers(), last_cpu_usec(0), last_autoscale_at(0)
 {
+    topology.load("/sys/devices/system/node");
 }
 
 WorkerPool::~WorkerPool()
 {
     {
 	// Cleanup current workers.
-	std::map<WorkerThread *, WorkerDetails>::iterator i;
-	for (i = workers.begin(); i != workers.end(); ++i) {
-	    i->first->stop();
+	std::vector<WorkerGroup *>::iterator i;
+	std::set<WorkerThread *>::iterator j;
+	for (i = groups.begin(); i != groups.end(); ++i) {
+	    for (j = (*i)->workers.begin(); j != (*i)->workers.end(); ++j) {
+		(*j)->stop();
+	    }
 	}
-	for (i = workers.begin(); i != workers.end(); ++i) {
-	    i->first->join();
-	    delete i->first;
+	for (i = groups.begin(); i != groups.end(); ++i) {
+	    for (j = (*i)->workers.begin(); j != (*i)->workers.end(); ++j) {
+		(*j)->join();
+		delete *j;
+	    }
 	}
     }
     {
@@ -168,56 +372,238 @@ WorkerPool::~WorkerPool()
 	    exited_workers.pop();
 	}
     }
+    {
+	// Cleanup the groups and their queues, now that no workers are using
+	// them.
+	std::vector<WorkerGroup *>::iterator i;
+	for (i = groups.begin(); i != groups.end(); ++i) {
+	    if ((*i)->queue != NULL)
+		server->get_stats().remove_source(&(*i)->stats);
+	    delete (*i)->queue;
+	    (*i)->~WorkerGroup();
+	    free_on_node(*i, sizeof(WorkerGroup));
+	}
+    }
 }
 
 void
 WorkerPool::worker_message_handled(WorkerThread * worker, bool ready_to_exit)
 {
-    ContextLocker lock(workerlist_mutex);
-
-    std::map<WorkerThread *, WorkerDetails>::iterator i;
-    i = workers.find(worker);
-    assert(i != workers.end());
-    assert(i->second.messages > 0);
-    --(i->second.messages);
-    if (ready_to_exit && i->second.messages == 0) {
-	i->second.ready_to_exit = true;
-    }
+    worker->set_ready_to_exit(ready_to_exit);
 }
 
 void
 WorkerPool::worker_exited(WorkerThread * worker)
 {
-    ContextLocker lock(workerlist_mutex);
+    WorkerGroup & group = *worker->get_group();
+    ContextLocker lock(group.mutex);
+    ContextLocker exit_lock(exit_mutex);
 
     if (!remove_current_worker(worker)) {
 	exiting_workers.erase(worker);
     }
+    // Any messages handed to the worker are passed on to the others.
+    group.queue->remove_worker(worker->get_slot());
     // FIXME - possible memory leak here if we get an exception.
     exited_workers.push(worker);
+    server->get_stats().adjust("workers", -1);
+    server->nudge_workers_exited();
+}
+
+bool
+WorkerPool::retire_idle_worker(WorkerThread * worker)
+{
+    WorkerGroup & group = *worker->get_group();
+    ContextLocker lock(group.mutex);
+
+    if (group.workers.find(worker) == group.workers.end())
+	return false;
+    if (int(group.workers.size()) <= dispatcher->min_workers(group.name))
+	return false;
+    if (!group.queue->retire(worker->get_slot()))
+	return false;
+
+    logger->debug("Stopping idle worker in group '" + group.name + "'");
+    server->get_stats().incr("workers_retired");
+    add_exiting_worker(worker);
+    return true;
 }
 
 void
-WorkerPool::stop()
+WorkerPool::stop_idle_workers(WorkerGroup & group, int count)
 {
-    ContextLocker lock(workerlist_mutex);
+    while (count-- > 0) {
+	int slot = group.queue->stop_idle_worker();
+	if (slot == -1)
+	    return;
+	std::set<WorkerThread *>::iterator i;
+	for (i = group.workers.begin(); i != group.workers.end(); ++i) {
+	    if ((*i)->get_slot() == slot)
+		break;
+	}
+	if (i == group.workers.end())
+	    return;
+	add_exiting_worker(*i);
+    }
+}
 
-    logger->debug("Stopping all workers");
+void
+WorkerPool::autoscale_group(WorkerGroup & group, double cpu_load)
+{
+    RunQueue::LoadSample load;
+    group.queue->sample_load(load);
+    long long elapsed = load.at - group.last_load.at;
+    if (elapsed <= 0)
+	return;
+    long long taken = load.taken - group.last_load.taken;
+    double wait = 0;
+    if (taken != 0)
+	wait = double(load.wait_usec - group.last_load.wait_usec) / taken;
+    int running = int(group.workers.size());
+    double busy = 1.0;
+    if (running != 0) {
+	busy = double(load.busy_usec - group.last_load.busy_usec) /
+		(double(elapsed) * running);
+    }
+    size_t backlog = group.queue->backlog();
+    group.last_load = load;
 
-    while (!workers.empty()) {
-	WorkerThread * worker = workers.begin()->first;
-	worker->stop();
+    int min_target = std::max(dispatcher->min_workers(group.name), 1);
+    int max_target = dispatcher->max_workers(group.name,
+					     PRIORITY_INTERACTIVE);
+    int old_target = group.target;
+    // Only grow groups which are using all the workers they may have.
+    if ((wait > AUTOSCALE_GROW_WAIT_USEC || busy > AUTOSCALE_GROW_BUSY ||
+	 backlog != 0) && running >= group.target &&
+	group.target < max_target) {
+	group.calm_samples = 0;
+	if (cpu_load > AUTOSCALE_CPU_SATURATED) {
+	    logger->debug("Autoscaler: not growing group '" + group.name +
+			  "' - CPU saturated");
+	    return;
+	}
+	// Grow by a quarter, so that large groups catch up quickly.
+	group.target += std::max(group.target / 4, 1);
+	group.target = std::min(group.target, max_target);
+	group.cooldown = AUTOSCALE_COOLDOWN_SAMPLES;
+	server->get_stats().incr("autoscale_grows");
+    } else if (busy < AUTOSCALE_SHRINK_BUSY &&
+	       wait < AUTOSCALE_SHRINK_WAIT_USEC && backlog == 0) {
+	if (group.cooldown > 0) {
+	    --group.cooldown;
+	    return;
+	}
+	if (++group.calm_samples < AUTOSCALE_SHRINK_SAMPLES ||
+	    group.target <= min_target)
+	    return;
+	group.calm_samples = 0;
+	// Never leave the target above the workers actually running.
+	group.target = std::max(std::min(group.target - 1, running),
+				min_target);
+	server->get_stats().incr("autoscale_shrinks");
+    } else {
+	group.calm_samples = 0;
+	return;
+    }
 
-	if (!remove_current_worker(worker)) {
-	    logger->error("Couldn't remove worker - not in list of current "
-			  "workers.  Possible resource leak.");
+    logger->info("Autoscaler: " +
+		 std::string(group.target > old_target ? "growing" : "shrinking") +
+		 " group '" + group.name + "' from " + str(old_target) +
+		 " to " + str(group.target) + " workers (mean queue wait " +
+		 str((long long)wait) + "us, busy " + str(int(busy * 100)) +
+		 "%, CPU " + str(int(cpu_load * 100)) + "%, backlog " +
+		 str(backlog) + ")");
+    server->get_stats().set("workers_target_" + group.name, group.target);
+    if (running > group.target) {
+	stop_idle_workers(group, running - group.target);
+    } else {
+	// Start workers for messages which are already waiting, rather than
+	// waiting for more to arrive.
+	while (backlog-- != 0 && group.usable_workers() < group.target) {
+	    if (!start_worker(group))
+		break;
 	}
-	try {
-	    exiting_workers.insert(worker);
-	} catch(...) {
-	    logger->error("Couldn't add worker to list of exiting workers. "
-			  "Possible resource leak.");
-	    throw;
+    }
+}
+
+void
+WorkerPool::autoscale()
+{
+    long long now = get_monotonic_usec();
+    long long cpu_usec = get_process_cpu_usec();
+    double cpu_load = 0;
+    size_t cpus = std::max(topology.allowed_cpus().size(), size_t(1));
+    if (last_autoscale_at != 0 && now > last_autoscale_at) {
+	cpu_load = double(cpu_usec - last_cpu_usec) /
+		(double(now - last_autoscale_at) * cpus);
+    }
+    last_cpu_usec = cpu_usec;
+    last_autoscale_at = now;
+
+    std::vector<WorkerGroup *>::iterator i;
+    for (i = groups.begin(); i != groups.end(); ++i) {
+	ContextLocker lock((*i)->mutex);
+	if ((*i)->queue != NULL)
+	    autoscale_group(**i, cpu_load);
+    }
+}
+
+void
+WorkerPool::check_stalls()
+{
+    long long limit = server->get_settings().stall_timeout * 1000LL;
+    int total = 0;
+    std::vector<WorkerGroup *>::iterator i;
+    for (i = groups.begin(); i != groups.end(); ++i) {
+	WorkerGroup & group = **i;
+	ContextLocker lock(group.mutex);
+	if (group.queue == NULL)
+	    continue;
+	std::vector<RunQueue::Stall> stalls;
+	group.stalled = group.queue->find_stalls(limit, stalls);
+	total += group.stalled;
+	std::vector<RunQueue::Stall>::const_iterator j;
+	for (j = stalls.begin(); j != stalls.end(); ++j) {
+	    logger->error("Worker " + str(j->slot) + " in group '" +
+			  group.name + "' stalled on message '" + j->msgid +
+			  "' (target '" + j->target + "'): running for " +
+			  str(j->running_usec / 1000) + "ms, last heartbeat " +
+			  str(j->heartbeat_usec / 1000) + "ms ago");
+	    server->get_stats().incr("worker_stalls");
+	    server->get_stats().incr("worker_stalls_" + group.name);
+	}
+
+	// Replace stalled workers if messages are waiting for them.
+	size_t backlog = group.queue->backlog();
+	while (backlog-- != 0 &&
+	       group.usable_workers() < worker_limit(group, PRIORITY_NORMAL)) {
+	    if (!start_worker(group))
+		break;
+	}
+    }
+    server->get_stats().set("workers_stalled", total);
+}
+
+void
+WorkerPool::start_group(const std::string & group_name)
+{
+    WorkerGroup & group = *groups[group_id(group_name)];
+    ContextLocker lock(group.mutex);
+    set_up_group(group);
+}
+
+void
+WorkerPool::stop()
+{
+    logger->debug("Stopping all workers");
+
+    std::vector<WorkerGroup *>::iterator i;
+    for (i = groups.begin(); i != groups.end(); ++i) {
+	ContextLocker lock((*i)->mutex);
+	while (!(*i)->workers.empty()) {
+	    WorkerThread * worker = *(*i)->workers.begin();
+	    worker->stop();
+	    add_exiting_worker(worker);
 	}
     }
 }
@@ -225,7 +611,7 @@ WorkerPool::stop()
 void
 WorkerPool::join()
 {
-    ContextLocker lock(workerlist_mutex);
+    ContextLocker lock(exit_mutex);
 
     logger->debug("Joining all workers");
 
@@ -242,13 +628,24 @@ WorkerPool::join()
 	}
     }
 
-    // Cleanup exited workers.
-    //
-    // No need to drop the lock while joining here, because workers shouldn't
-    // try to get the lock once they're in exited_workers.
-    while (!exited_workers.empty()) {
-	exited_workers.front()->join();
-	delete exited_workers.front();
-	exited_workers.pop();
+    lock.unlock();
+    join_exited();
+}
+
+void
+WorkerPool::join_exited()
+{
+    std::queue<WorkerThread *> exited;
+    {
+	ContextLocker lock(exit_mutex);
+	std::swap(exited, exited_workers);
+    }
+
+    // Workers don't use the pool once they're in exited_workers, so the
+    // lock needn't be held while joining them.
+    while (!exited.empty()) {
+	exited.front()->join();
+	delete exited.front();
+	exited.pop();
     }
 }
@@ -26,9 +26,13 @@
 #ifndef XAPSRV_INCLUDED_WORKERPOOL_H
 #define XAPSRV_INCLUDED_WORKERPOOL_H
 
+#include "admission.h"
 #include "locker.h"
 #include "logger.h"
+#include "runqueue.h"
 #include "server.h"
+#include "stats.h"
+#include "topology.h"
 #include <map>
 #include <queue>
 #include <set>
@@ -40,28 +44,107 @@ class Dispatcher;
 class ServerInternal;
 class WorkerThread;
 
-/** Details about a worker.
+/** Statistics about the messages handled by a group's workers.
+ *
+ *  These are updated for every message, so each group keeps its own
+ *  without locking, and they are added up when the server's statistics
+ *  are described.
  */
-struct WorkerDetails {
-    /** The group that the worker is in.
-     */
-    std::string group;
+struct WorkerGroupStats : public StatsSource {
+    /// The time messages waited in the queue, in microseconds.
+    AtomicHistogram queue_wait_us;
+
+    /// The number of messages taken on the NUMA node they were queued on.
+    volatile long long messages_local_node;
+
+    /// The number of messages taken on another NUMA node.
+    volatile long long messages_cross_node;
+
+    WorkerGroupStats()
+	    : queue_wait_us(), messages_local_node(0), messages_cross_node(0)
+    {}
+
+    void add_stats(Stats::Totals & totals) const;
+};
+
+/** A group of workers, and the messages waiting for them.
+ *
+ *  Each group has its own lock, and is allocated on its own pages (on the
+ *  NUMA node of its workers' CPUs, if they are all on one node), so that
+ *  workers in different groups never contend for a lock or a cache line.
+ */
+struct WorkerGroup {
+    /// Mutex which must be held when accessing the members below, other than
+    /// the name, id, CPUs and queue, which don't change once the group has
+    /// been set up.
+    Locker mutex;
+
+    /// The name of the group, as passed to the dispatcher.
+    const std::string name;
 
-    /** The number of outstanding messages that the worker has been sent.
+    /// The id of the group in the pool.
+    const int id;
+
+    /// The CPUs which the group's workers run on, or empty for any CPU.
+    std::vector<int> cpus;
+
+    /// The NUMA node which the group is placed on, or -1 for any.
+    int node;
+
+    /// The current workers in the group.
+    std::set<WorkerThread *> workers;
+
+    /** The queue which the group's workers take messages from.
+     *
+     *  This is owned by the pool, and is NULL until the first message for
+     *  the group arrives.
      */
-    int messages;
+    RunQueue * queue;
 
-    /** True iff the worker has no significant outstanding work to do before
-     *  exiting.
+    /** The number of workers which the group may grow to.
+     *
+     *  This is the maximum for the group unless autoscaling is enabled, in
+     *  which case the autoscaler moves it between the group's minimum and
+     *  maximum to suit the load.
      */
-    bool ready_to_exit;
+    int target;
+
+    /// The load on the queue when the autoscaler last sampled it.
+    RunQueue::LoadSample last_load;
+
+    /// The number of consecutive samples in which the group was underused.
+    int calm_samples;
+
+    /// The number of samples to wait after growing before shrinking.
+    int cooldown;
+
+    /// Decides when the group is too overloaded to accept new messages.
+    AdmissionControl admission;
 
-    /** Create a new WorkerDetails object.
+    /** The number of workers which have been handling a message for longer
+     *  than the stall timeout, when the watchdog last checked.
      *
-     *  @param group_ The group that the worker is in.
+     *  These don't count towards the number of workers the group may have,
+     *  so that a stuck message doesn't take up a worker indefinitely.
      */
-    WorkerDetails(const std::string & group_)
-	    : group(group_), messages(0), ready_to_exit(true) {}
+    int stalled;
+
+    /// Statistics about the messages handled by the group's workers.
+    WorkerGroupStats stats;
+
+    WorkerGroup(const std::string & name_, int id_)
+	    : mutex("group_" + name_), name(name_), id(id_), cpus(), node(-1), workers(),
+	      queue(NULL), target(0), last_load(), calm_samples(0),
+	      cooldown(0), admission(), stalled(0), stats()
+    {}
+
+    /// Get the number of workers in the group which aren't stalled.
+    int usable_workers() const { return int(workers.size()) - stalled; }
+
+  private:
+    // Don't allow copying or assignment.
+    WorkerGroup(const WorkerGroup & other);
+    void operator=(const WorkerGroup & other);
 };
 
 class WorkerPool {
@@ -73,21 +156,34 @@ class WorkerPool {
 
     ServerInternal * server;
 
-    /** Mutex which must be held when accessing the list of workers.
+    /** The NUMA topology of the machine, used to place the groups.
+     *
+     *  This is read when the pool is created, and not changed after.
      */
-    Locker workerlist_mutex;
+    CpuTopology topology;
 
-    /** For each current worker, the group that it is in, and the number of
-     *  outstanding messages it has been sent.
+    /** The groups of workers, by id.
+     *
+     *  Each worker handles one message at a time, taking it from the
+     *  group's queue: messages which arrive while all the workers in a
+     *  group are busy wait there until a worker is free.  Groups are never
+     *  removed, so their ids stay valid.
+     *
+     *  This is only used by the main server thread: workers find their
+     *  group through their WorkerThread.
      */
-    std::map<WorkerThread *, WorkerDetails> workers;
+    std::vector<WorkerGroup *> groups;
+
+    /// The id of each group, by name.  Only used by the main server thread.
+    std::map<std::string, int> group_ids;
 
-    /** All the current workers, in each group.
+    /** Mutex which must be held when accessing the lists of exiting and
+     *  exited workers.
      *
-     *  The set of workers in this structure is identical to the set in
-     *  `workers`.
+     *  This may be locked while a group's mutex is held, but not the other
+     *  way round.
      */
-    std::map<std::string, std::set<WorkerThread *> > workers_by_group;
+    Locker exit_mutex;
 
     /** Workers which have been asked to stop.
      */
@@ -99,26 +195,63 @@ class WorkerPool {
      */
     std::queue<WorkerThread *> exited_workers;
 
-    /** Add a new worker.
+    /// The CPU time used by the process when the autoscaler last ran.
+    long long last_cpu_usec;
+
+    /// The time the autoscaler last ran, from get_monotonic_usec().
+    long long last_autoscale_at;
+
+    /** Set up a group, and start its minimum number of workers, if it
+     *  hasn't been used before.
+     *
+     *  The group's mutex must be held when this is called.
+     */
+    void set_up_group(WorkerGroup & group);
+
+    /** Start a new worker in a group.
      *
-     *  workerlist_mutex must be held when this is called.
+     *  The group's mutex must be held when this is called.
+     *
+     *  @retval true if a worker was started.
      */
-    void add_worker(WorkerThread * worker, const std::string & group);
+    bool start_worker(WorkerGroup & group);
 
-    /** Remove a worker from the list of current workers.
+    /** Get the number of workers a group may grow to for a message.
      *
-     *  workerlist_mutex must be held when this is called.
+     *  The group's mutex must be held when this is called.
+     */
+    int worker_limit(const WorkerGroup & group, int priority);
+
+    /** Ask up to `count` idle workers in a group to stop.
+     *
+     *  The group's mutex must be held when this is called.
+     */
+    void stop_idle_workers(WorkerGroup & group, int count);
+
+    /** Decide whether a group should grow or shrink, given its load.
+     *
+     *  The group's mutex must be held when this is called.
+     *
+     *  @param cpu_load The fraction of the available CPU time which the
+     *  process used since the last sample.
+     */
+    void autoscale_group(WorkerGroup & group, double cpu_load);
+
+    /** Remove a worker from the list of current workers in its group.
+     *
+     *  The group's mutex must be held when this is called.
      *
      *  @returns true if the worker was in the list of current workers, false
      *  otherwise.
      */
     bool remove_current_worker(WorkerThread * worker);
 
-    /** Request that a worker stops.
+    /** Move a worker from its group's current workers to the exiting
+     *  workers.
      *
-     *  workerlist_mutex must be held when this is called.
+     *  The group's mutex must be held when this is called.
      */
-    void request_exit(WorkerThread * worker);
+    void add_exiting_worker(WorkerThread * worker);
 
     // Don't allow copying or assignment.
     WorkerPool(const WorkerPool & other);
@@ -127,28 +260,106 @@ class WorkerPool {
     WorkerPool(Logger * logger_, Dispatcher * dispatcher_, ServerInternal * server_);
     ~WorkerPool();
 
+    /// Get the NUMA topology of the machine.
+    const CpuTopology & get_topology() const { return topology; }
+
     /** Called by a worker to indicate that it has handled one message.
      *
      *  @param ready_to_exit true if the worker has no significant outstanding
      *  work to do (other than messages which it has not yet handled).
      *
-     *  The worker's mutex must not be held when this is called.
+     *  This doesn't lock anything, so finishing a message never contends
+     *  with messages being sent to workers.
      */
     void worker_message_handled(WorkerThread * worker, bool ready_to_exit);
 
     /** Called by a worker to indicate that it has exited.
      *
-     *  The worker's mutex must not be held when this is called.
+     *  The main server thread is nudged to join the worker.
      */
     void worker_exited(WorkerThread * worker);
 
+    /** Called by a worker which has been idle for the idle timeout.
+     *
+     *  If the worker's group has more than its minimum number of workers,
+     *  and no messages are waiting, the worker is removed from the list of
+     *  current workers and asked to stop.
+     *
+     *  @retval true if the worker should stop.
+     */
+    bool retire_idle_worker(WorkerThread * worker);
+
+    /** Get the id of a group, for sending messages to it.
+     *
+     *  The group is created if it doesn't exist yet, but isn't set up (and
+     *  no workers are started) until the first message is sent to it.
+     *
+     *  This must only be called from the main server thread.
+     */
+    int group_id(const std::string & group_name);
+
+    /** Start the minimum number of workers for a group.
+     *
+     *  Does nothing if the group has already been used.
+     */
+    void start_group(const std::string & group_name);
+
+    /** Join and delete any workers which have exited.
+     */
+    void join_exited();
+
+    /** Resize each group of workers to suit its recent load.
+     *
+     *  This samples the time messages waited in each group's queue, the
+     *  fraction of the time its workers were busy, and the CPU used by the
+     *  process, since the last call.  A group grows while messages wait or
+     *  its workers are nearly always busy, unless the CPUs are saturated,
+     *  and shrinks once it has been underused for several calls in a row.
+     *
+     *  This should be called regularly from the main server thread.
+     */
+    void autoscale();
+
+    /** Look for workers which have been handling a message for longer than
+     *  the stall timeout.
+     *
+     *  Each message found is logged and counted once, and each group may
+     *  start a new worker in place of each of its stalled workers, if
+     *  messages are waiting.
+     *
+     *  This should be called regularly from the main server thread.
+     */
+    void check_stalls();
+
     /** Try to send a message to a worker, creating one if needed.
      *
-     *  If the worker can't be created currently, the message will be queued
-     *  and passed to a worker later.
+     *  If all the workers which the message may use are busy, the message
+     *  is queued for the next worker in the group to become free.
+     *  If the group's queue is full, or no worker could be started for the
+     *  group, a message is rejected: the dispatcher's message_rejected()
+     *  method is called for it, after the list of workers has been unlocked.
+     *
+     *  This must only be called from the main server thread.
+     */
+    void send_to_worker(int group_id, const Message & msg);
+
+    /** Check whether a group is too overloaded to accept a new message.
+     *
+     *  A group is overloaded once messages have waited longer than the
+     *  --overload-delay setting for a whole interval, even the message
+     *  which waited least (see AdmissionControl).  While it is, new messages
+     *  are only accepted to keep a message queued for each of its workers,
+     *  so that the workers stay busy while the queue drains.
+     *
+     *  This must only be called from the main server thread.
+     *
+     *  @param group_id The group the message is for.
+     *  @param retry_after_usec Set to the time the sender should wait before
+     *  retrying the message, in microseconds, if the group is overloaded.
+     *
+     *  @retval true if the message should be rejected.
      */
-    void send_to_worker(const std::string & group,
-			const Message & msg);
+    bool overloaded(int group_id, long long & retry_after_usec);
 
     /** Stop all workers.
      */
@@ -158,11 +369,22 @@ class WorkerPool {
      */
     void join();
 
-#if 0 
+    /** Cancel a message sent to a worker.
+     *
+     *  Removes the message from its group's queue if it hasn't yet been
+     *  handled, or asks the worker to abandon it if it is being handled.
+     *
+     *  @param connection_num The connection which the message came from.
+     *  @param msgid The id of the message.
+     */
+    CancelResult cancel_message(int connection_num, const std::string & msgid);
+
     /** Cancel any queued messages for a given connection.
+     *
+     *  Any messages from the connection which are currently being handled
+     *  are also flagged as cancelled.
      */
     void cancel_queued_messages(int connection_num);
-#endif
 };
 
 #endif /* XAPSRV_INCLUDED_WORKERPOOL_H */
@@ -29,18 +29,70 @@
 #include <cstdlib>
 #include <getopt.h>
 #include <iostream>
+#include "server/topology.h"
+#include <vector>
 #include <xapian.h>
 
 /// Defines needed for makemanpage
 #define PROG_DESC "server for xapian"
 
+/** Parse a list of weights, such as "db1:3,db2:2".
+ *
+ *  @retval true if the list was valid.
+ */
+static bool
+parse_flow_weights(const std::string & spec,
+		   std::map<std::string, int> & weights)
+{
+    std::string::size_type pos = 0;
+    while (pos < spec.size()) {
+	std::string::size_type end = spec.find(',', pos);
+	if (end == std::string::npos)
+	    end = spec.size();
+	std::string::size_type colon = spec.rfind(':', end - 1);
+	if (colon == std::string::npos || colon < pos + 1 ||
+	    colon + 1 >= end)
+	    return false;
+	std::string weight(spec, colon + 1, end - (colon + 1));
+	if (weight.find_first_not_of("0123456789") != std::string::npos)
+	    return false;
+	int value = atoi(weight.c_str());
+	if (value < 1)
+	    return false;
+	weights[spec.substr(pos, colon - pos)] = value;
+	pos = end + 1;
+    }
+    return true;
+}
+
 ServerSettings::ServerSettings()
 	: use_stdio(false),
 	  interface("0.0.0.0"),
 	  log_filename("log"),
 	  port(8080),
+	  processes(0),
 	  search_workers(10),
-	  update_workers(1)
+	  update_workers(1),
+	  min_search_workers(1),
+	  min_update_workers(0),
+	  idle_timeout(300),
+	  autoscale_interval(0),
+	  reserved_workers(1),
+	  queue_size(1000),
+	  overload_delay(0),
+	  stall_timeout(0),
+	  lock_stats_interval(0),
+	  fair_by(),
+	  flow_weights(),
+	  queue_order("fifo"),
+	  affinity(0),
+	  worker_fibers(1),
+	  cache_size(0),
+	  stream_threshold(1024 * 1024),
+	  compress_threshold(1024),
+	  reactor_cpus(),
+	  search_cpus(),
+	  update_cpus()
 {
 }
 
@@ -52,15 +104,36 @@ ServerSettings::parse_args(int argc, char ** argv)
 	{ "version",    no_argument,            NULL, 'v' },
 	{ "interface",  required_argument,      NULL, 'i' },
 	{ "port",       required_argument,      NULL, 'p' },
+	{ "processes",  required_argument,      NULL, 'P' },
 	{ "searchers",  required_argument,      NULL, 's' },
 	{ "updaters",   required_argument,      NULL, 'u' },
+	{ "min-searchers", required_argument,   NULL, 'm' },
+	{ "min-updaters", required_argument,    NULL, 'M' },
+	{ "idle-timeout", required_argument,    NULL, 'T' },
+	{ "autoscale-interval", required_argument, NULL, 'a' },
+	{ "reserved",   required_argument,      NULL, 'r' },
+	{ "queue-size", required_argument,      NULL, 'q' },
+	{ "overload-delay", required_argument,  NULL, 'd' },
+	{ "stall-timeout", required_argument,   NULL, 'w' },
+	{ "lock-stats", required_argument,      NULL, 'L' },
+	{ "fair-by",    required_argument,      NULL, 'F' },
+	{ "flow-weights", required_argument,    NULL, 'W' },
+	{ "queue-order", required_argument,     NULL, 'O' },
+	{ "affinity",   required_argument,      NULL, 'A' },
+	{ "fibers",     required_argument,      NULL, 'f' },
+	{ "cache-size", required_argument,      NULL, 'c' },
+	{ "stream-threshold", required_argument, NULL, 't' },
+	{ "compress-threshold", required_argument, NULL, 'z' },
 	{ "log",        required_argument,      NULL, 'l' },
+	{ "reactor-cpus", required_argument,    NULL, 'R' },
+	{ "search-cpus", required_argument,     NULL, 'S' },
+	{ "update-cpus", required_argument,     NULL, 'U' },
 	{ "stdio",      no_argument,            NULL, 'o' },
 	{ 0, 0, NULL, 0 }
     };
 
     int getopt_ret;
-    while ((getopt_ret = getopt_long(argc, argv, "hvi:p:s:u:l:", longopts, NULL)) != -1)
+    while ((getopt_ret = getopt_long(argc, argv, "hvi:p:s:u:m:M:T:a:r:q:d:c:t:z:l:", longopts, NULL)) != -1)
     {
 	switch (getopt_ret) {
 	    case '?': {
@@ -73,8 +146,67 @@ ServerSettings::parse_args(int argc, char ** argv)
 "Options:\n"
 "  -i, --interface   Set the interface to listen on\n"
 "  -p, --port        Set the port to listen on\n"
+"  --processes       Run this many server processes sharing the port, each\n"
+"                    with its own workers, and restart any which exit\n"
+"                    unexpectedly (default 0, to handle every connection in\n"
+"                    one process)\n"
 "  -s, --searchers   Set the maximum number of concurrent search workers\n"
 "  -u, --updaters    Set the maximum number of concurrent update workers\n"
+"  -m, --min-searchers\n"
+"                    Set the number of search workers to keep running when\n"
+"                    idle (default 1)\n"
+"  -M, --min-updaters\n"
+"                    Set the number of update workers to keep running for\n"
+"                    each database when idle (default 0)\n"
+"  -T, --idle-timeout\n"
+"                    Set the number of seconds after which idle workers\n"
+"                    beyond the minimum are stopped (default 300, 0 for\n"
+"                    never)\n"
+"  -a, --autoscale-interval\n"
+"                    Set the number of seconds between resizing each group\n"
+"                    of workers to suit its load (default 0, for never)\n"
+"  -r, --reserved    Set the number of workers in each group reserved for\n"
+"                    interactive requests\n"
+"  -q, --queue-size  Set the maximum number of messages to queue for each\n"
+"                    group of workers (default 1000)\n"
+"  -d, --overload-delay\n"
+"                    Set the number of milliseconds messages may wait for a\n"
+"                    worker before new messages are rejected as overloaded\n"
+"                    (default 0, for never)\n"
+"  --stall-timeout   Set the number of milliseconds a worker may spend on\n"
+"                    one message before it is logged and replaced as\n"
+"                    stalled (default 0, for never)\n"
+"  --lock-stats      Profile contention for the server's locks, and log a\n"
+"                    summary every this many seconds (default 0, for no\n"
+"                    profiling)\n"
+"  --fair-by         Share workers fairly between each connection or each\n"
+"                    database, rather than taking queued messages in the\n"
+"                    order they arrived: one of connection or database\n"
+"  --flow-weights    Set the share of workers for messages for each\n"
+"                    database when sharing fairly, as a list such as\n"
+"                    db1:3,db2:2 (default 1 each)\n"
+"  --queue-order     Set the order to take queued messages of each priority\n"
+"                    in: fifo, or edf to take those with the earliest\n"
+"                    deadline first (default fifo)\n"
+"  --affinity        Set the number of search workers to prefer for reads\n"
+"                    of each database, so that each database is mostly\n"
+"                    opened by the same workers (default 0, for any worker)\n"
+"  --fibers          Set the number of messages each update worker can\n"
+"                    handle at once, switching between them while they wait\n"
+"                    for their payloads to arrive (default 1)\n"
+"  -c, --cache-size  Set the number of bytes to use for caching responses to\n"
+"                    reads (default 0, for no caching); can't be used with\n"
+"                    --processes\n"
+"  -t, --stream-threshold\n"
+"                    Set the size in bytes above which messages are passed\n"
+"                    to workers as they arrive (default 1048576)\n"
+"  -z, --compress-threshold\n"
+"                    Set the size in bytes below which responses aren't\n"
+"                    compressed (default 1024)\n"
+"  --reactor-cpus    Set the CPUs to handle connections on, as a list such\n"
+"                    as 0-3,8 (default any)\n"
+"  --search-cpus     Set the CPUs to run search workers on (default any)\n"
+"  --update-cpus     Set the CPUs to run update workers on (default any)\n"
 "  -l, --log         Set the filename to write log entries to\n"
 "  -h, --help        Display this help and exit\n"
 "  -v, --version     Output version information and exit\n"
@@ -100,6 +232,10 @@ ServerSettings::parse_args(int argc, char ** argv)
 		port = atoi(optarg);
 		break;
 	    }
+	    case 'P': {
+		processes = atoi(optarg);
+		break;
+	    }
 	    case 's': {
 		search_workers = atoi(optarg);
 		break;
@@ -108,6 +244,89 @@ ServerSettings::parse_args(int argc, char ** argv)
 		update_workers = atoi(optarg);
 		break;
 	    }
+	    case 'm': {
+		min_search_workers = atoi(optarg);
+		break;
+	    }
+	    case 'M': {
+		min_update_workers = atoi(optarg);
+		break;
+	    }
+	    case 'T': {
+		idle_timeout = atoi(optarg);
+		break;
+	    }
+	    case 'a': {
+		autoscale_interval = atoi(optarg);
+		break;
+	    }
+	    case 'r': {
+		reserved_workers = atoi(optarg);
+		break;
+	    }
+	    case 'q': {
+		queue_size = atoi(optarg);
+		break;
+	    }
+	    case 'd': {
+		overload_delay = atoi(optarg);
+		break;
+	    }
+	    case 'w': {
+		stall_timeout = atoi(optarg);
+		break;
+	    }
+	    case 'L': {
+		lock_stats_interval = atoi(optarg);
+		break;
+	    }
+	    case 'F': {
+		fair_by = optarg;
+		break;
+	    }
+	    case 'W': {
+		if (!parse_flow_weights(optarg, flow_weights)) {
+		    std::cerr << "Error: invalid flow weights - got " << optarg << std::endl;
+		    return 1;
+		}
+		break;
+	    }
+	    case 'O': {
+		queue_order = optarg;
+		break;
+	    }
+	    case 'A': {
+		affinity = atoi(optarg);
+		break;
+	    }
+	    case 'f': {
+		worker_fibers = atoi(optarg);
+		break;
+	    }
+	    case 'c': {
+		cache_size = atol(optarg);
+		break;
+	    }
+	    case 't': {
+		stream_threshold = atol(optarg);
+		break;
+	    }
+	    case 'z': {
+		compress_threshold = atol(optarg);
+		break;
+	    }
+	    case 'R': {
+		reactor_cpus = optarg;
+		break;
+	    }
+	    case 'S': {
+		search_cpus = optarg;
+		break;
+	    }
+	    case 'U': {
+		update_cpus = optarg;
+		break;
+	    }
 	    case 'l': {
 		log_filename = optarg;
 		break;
@@ -128,6 +347,14 @@ bool
 ServerSettings::validate() const
 {
     bool ok = true;
+    if (processes < 0) {
+	std::cerr << "Error: number of processes can't be negative - got " << processes << std::endl;
+	ok = false;
+    }
+    if (processes > 0 && use_stdio) {
+	std::cerr << "Error: can't share stdio between several processes" << std::endl;
+	ok = false;
+    }
     if (search_workers < 1) {
 	std::cerr << "Error: must have at least one search worker - got " << search_workers << std::endl;
 	ok = false;
@@ -136,5 +363,93 @@ ServerSettings::validate() const
 	std::cerr << "Error: must have at least one update worker - got " << update_workers << std::endl;
 	ok = false;
     }
+    if (min_search_workers < 0 || min_search_workers > search_workers) {
+	std::cerr << "Error: minimum search workers must be between 0 and " << search_workers << " - got " << min_search_workers << std::endl;
+	ok = false;
+    }
+    if (min_update_workers < 0 || min_update_workers > update_workers) {
+	std::cerr << "Error: minimum update workers must be between 0 and " << update_workers << " - got " << min_update_workers << std::endl;
+	ok = false;
+    }
+    if (idle_timeout < 0) {
+	std::cerr << "Error: idle timeout can't be negative - got " << idle_timeout << std::endl;
+	ok = false;
+    }
+    if (autoscale_interval < 0) {
+	std::cerr << "Error: autoscale interval can't be negative - got " << autoscale_interval << std::endl;
+	ok = false;
+    }
+    if (reserved_workers < 0) {
+	std::cerr << "Error: can't reserve a negative number of workers - got " << reserved_workers << std::endl;
+	ok = false;
+    }
+    if (queue_size < 0) {
+	std::cerr << "Error: queue size can't be negative - got " << queue_size << std::endl;
+	ok = false;
+    }
+    if (overload_delay < 0) {
+	std::cerr << "Error: overload delay can't be negative - got " << overload_delay << std::endl;
+	ok = false;
+    }
+    if (stall_timeout < 0) {
+	std::cerr << "Error: stall timeout can't be negative - got " << stall_timeout << std::endl;
+	ok = false;
+    }
+    if (lock_stats_interval < 0) {
+	std::cerr << "Error: lock stats interval can't be negative - got " << lock_stats_interval << std::endl;
+	ok = false;
+    }
+    if (!fair_by.empty() && fair_by != "connection" &&
+	fair_by != "database") {
+	std::cerr << "Error: can only share workers fairly by connection or database - got " << fair_by << std::endl;
+	ok = false;
+    }
+    if (queue_order != "fifo" && queue_order != "edf") {
+	std::cerr << "Error: queue order must be fifo or edf - got " << queue_order << std::endl;
+	ok = false;
+    }
+    if (queue_order == "edf" && !fair_by.empty()) {
+	std::cerr << "Error: can't order queues by deadline while sharing workers fairly" << std::endl;
+	ok = false;
+    }
+    if (affinity < 0) {
+	std::cerr << "Error: number of workers to prefer can't be negative - got " << affinity << std::endl;
+	ok = false;
+    }
+    if (worker_fibers < 1) {
+	std::cerr << "Error: workers must handle at least one message at once - got " << worker_fibers << std::endl;
+	ok = false;
+    }
+    if (cache_size < 0) {
+	std::cerr << "Error: cache size can't be negative - got " << cache_size << std::endl;
+	ok = false;
+    }
+    if (cache_size > 0 && processes > 0) {
+	// A write handled by one process wouldn't discard the responses
+	// cached by the others.
+	std::cerr << "Error: can't cache responses with several processes" << std::endl;
+	ok = false;
+    }
+    if (stream_threshold < 1) {
+	std::cerr << "Error: stream threshold must be at least 1 byte - got " << stream_threshold << std::endl;
+	ok = false;
+    }
+    if (compress_threshold < 0) {
+	std::cerr << "Error: compress threshold can't be negative - got " << compress_threshold << std::endl;
+	ok = false;
+    }
+    std::vector<int> cpus;
+    if (!parse_cpu_list(reactor_cpus, cpus)) {
+	std::cerr << "Error: invalid CPU list for connections - got " << reactor_cpus << std::endl;
+	ok = false;
+    }
+    if (!parse_cpu_list(search_cpus, cpus)) {
+	std::cerr << "Error: invalid CPU list for search workers - got " << search_cpus << std::endl;
+	ok = false;
+    }
+    if (!parse_cpu_list(update_cpus, cpus)) {
+	std::cerr << "Error: invalid CPU list for update workers - got " << update_cpus << std::endl;
+	ok = false;
+    }
     return ok;
 }
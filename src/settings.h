@@ -25,6 +25,7 @@
 #ifndef XAPSRV_INCLUDED_SETTINGS_H
 #define XAPSRV_INCLUDED_SETTINGS_H
 
+#include <map>
 #include <string>
 
 /** The settings used by the server.
@@ -42,12 +43,169 @@ struct ServerSettings {
     /// The port which the server listens on.
     int port;
 
+    /** Number of server processes to run, each accepting connections on
+     *  the shared port.
+     *
+     *  Each process has its own workers, so a crash only loses the
+     *  connections of that process, and processes which exit unexpectedly
+     *  are restarted.  If 0, connections are handled by this process.
+     */
+    int processes;
+
     /// Maximum number of search workers to allow simultaneously.
     int search_workers;
 
     /// Maximum number of update workers to allow simultaneously.
     int update_workers;
 
+    /** Number of search workers to keep running, even when idle.
+     *
+     *  These are started when the server starts.
+     */
+    int min_search_workers;
+
+    /** Number of update workers to keep running for each database, even
+     *  when idle.
+     *
+     *  These are started when the first update for the database arrives.
+     */
+    int min_update_workers;
+
+    /** Number of seconds a worker may be idle before it is stopped.
+     *
+     *  Workers are only stopped while their group has more than its minimum
+     *  number of workers.  If 0, idle workers are never stopped.
+     */
+    int idle_timeout;
+
+    /** Number of seconds between adjustments of the size of each group of
+     *  workers to its load.
+     *
+     *  If 0, groups aren't resized: workers are started whenever no worker
+     *  is free, up to the maximum for the group.
+     */
+    int autoscale_interval;
+
+    /** Number of workers in each group reserved for interactive requests.
+     *
+     *  Requests of lower priority won't cause a group to grow beyond its
+     *  maximum size less this number of workers.
+     */
+    int reserved_workers;
+
+    /** Maximum number of messages to queue for each group of workers.
+     *
+     *  Messages which arrive when all the workers in a group are busy are
+     *  queued until a worker is free.  Once this many are queued, further
+     *  messages are rejected with an error response.
+     */
+    int queue_size;
+
+    /** Target time in milliseconds for messages to wait for a worker.
+     *
+     *  Once even the messages which waited least for a group's workers have
+     *  waited longer than this for a while, new messages for the group are
+     *  rejected with an "overloaded" response until the queue drains.  If
+     *  0, messages are only rejected when the queue is full.
+     */
+    int overload_delay;
+
+    /** Number of milliseconds a worker may spend on one message before it
+     *  is treated as stalled.
+     *
+     *  Stalled workers are logged, counted, and replaced if messages are
+     *  waiting for them.  If 0, workers are never treated as stalled.
+     */
+    int stall_timeout;
+
+    /** Number of seconds between summaries of lock contention in the log.
+     *
+     *  If non-zero, the server's locks are profiled, and their statistics
+     *  are reported by the stats request as well as in the log.  If 0,
+     *  locks aren't profiled.
+     */
+    int lock_stats_interval;
+
+    /** What to share workers fairly between: "connection", "database", or
+     *  empty for neither.
+     *
+     *  If set, queued messages are taken from each connection (or for each
+     *  database) in turn, rather than in the order they arrived.
+     */
+    std::string fair_by;
+
+    /** The share of workers messages for each database get, relative to
+     *  others, when sharing workers fairly.
+     *
+     *  Databases which aren't listed have a weight of 1.
+     */
+    std::map<std::string, int> flow_weights;
+
+    /** The order to take each group's queued messages of each priority in:
+     *  "fifo" (the order they arrived) or "edf" (earliest deadline first).
+     *
+     *  Messages without a deadline come after those with one, in the order
+     *  they arrived.  Ignored when sharing workers fairly.
+     */
+    std::string queue_order;
+
+    /** Number of search workers to prefer for the reads of each database.
+     *
+     *  Reads of a database go to an idle worker among these if there is
+     *  one, so that each database is mostly opened and cached by the same
+     *  few workers.  If 0, reads go to any worker.
+     */
+    int affinity;
+
+    /** Number of messages each update worker can handle at once.
+     *
+     *  A worker handling more than one switches to another message while
+     *  one waits, such as for the rest of a large payload to arrive, rather
+     *  than blocking its thread.  Each message is handled by a fiber with
+     *  its own stack.
+     */
+    int worker_fibers;
+
+    /** Maximum number of bytes to use for caching responses to reads.
+     *
+     *  If 0, responses aren't cached.
+     */
+    long cache_size;
+
+    /** The size in bytes above which messages are streamed to workers.
+     *
+     *  Messages larger than this are passed to a worker in chunks as they
+     *  arrive, rather than being read into memory in full first.  This is
+     *  also the most data buffered for each streamed message.
+     */
+    long stream_threshold;
+
+    /** The size in bytes below which responses aren't compressed.
+     *
+     *  Responses are only compressed for connections which have asked for
+     *  compression.
+     */
+    long compress_threshold;
+
+    /** The CPUs to run the thread handling connections on, as a CPU list
+     *  such as "0-3,8".
+     *
+     *  If empty, the thread may run on any CPU.
+     */
+    std::string reactor_cpus;
+
+    /** The CPUs to run search workers on, as a CPU list.
+     *
+     *  If empty, search workers may run on any CPU.
+     */
+    std::string search_cpus;
+
+    /** The CPUs to run update workers on, as a CPU list.
+     *
+     *  If empty, update workers may run on any CPU.
+     */
+    std::string update_cpus;
+
     /// Initialise the settings to default values.
     ServerSettings();
 
@@ -29,6 +29,7 @@
 #include "str.h"
 #include <string>
 #include <string.h>
+#include <time.h>
 
 std::string
 get_sys_error(int errno_value)
@@ -54,6 +55,33 @@ get_sys_error(int errno_value)
 #endif
 }
 
+long long
+get_thread_cpu_usec()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+	return 0;
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long
+get_process_cpu_usec()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+	return 0;
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long
+get_monotonic_usec()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+	return 0;
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 std::string
 urlquote(const std::string & value)
 {
@@ -36,6 +36,15 @@ std::string urlquote(const std::string & value);
 /// Unquote a url string (ie, replace %XX values with characters)
 std::string urlunquote(const std::string & value);
 
+/// Get the CPU time used by the calling thread, in microseconds.
+long long get_thread_cpu_usec();
+
+/// Get the CPU time used by all threads of the process, in microseconds.
+long long get_process_cpu_usec();
+
+/// Get the time from a monotonic clock, in microseconds.
+long long get_monotonic_usec();
+
 /// Return true iff str starts with prefix.
 inline bool startswith(const std::string & str, const std::string & prefix) {
     return str.rfind(prefix, 0) == 0;
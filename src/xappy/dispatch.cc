@@ -27,8 +27,12 @@
 #include "dispatch.h"
 
 #include <algorithm>
+#include <assert.h>
+#include <climits>
+#include <cstdlib>
 #include <ctype.h>
 #include "json/json.h"
+#include "server/codec.h"
 #include "server/serverinternal.h"
 #include "server/worker.h"
 #include "server/workerpool.h"
@@ -37,9 +41,17 @@
 #include "xappy/indexerworker.h"
 #include "xappy/searchworker.h"
 
-// Maximum length of a message length.  9 = 10^9 bytes, and since we pull the
-// whole message into memory to deal with it, we almost certainly don't want to
-// allow this to be any larger.
+/** The connection number used for messages sent to workers on behalf of
+ *  flights.
+ *
+ *  Responses to these messages are passed on to the messages waiting for the
+ *  flight.
+ */
+#define FLIGHT_CONNECTION_NUM INT_MAX
+
+// Maximum length of a message length.  9 = 10^9 bytes.  Large messages are
+// streamed rather than pulled into memory, but any larger would overflow the
+// length.
 #define MAX_MSG_LEN_LEN 9
 
 void
@@ -65,19 +77,346 @@ XappyDispatcher::send_error_response(const Message & msg,
     send_msg_response(msg.connection_num, msg.msgid, 'E', writer.write(root));
 }
 
+bool
+XappyDispatcher::shed_if_overloaded(int group, const Message & msg)
+{
+    // Interactive messages go ahead of the queue, so don't wait behind it.
+    if (msg.priority == PRIORITY_INTERACTIVE) {
+	return false;
+    }
+    long long retry_after_usec;
+    if (!group_overloaded(group, retry_after_usec)) {
+	return false;
+    }
+    stats->incr("messages_overloaded");
+    Json::FastWriter writer;
+    Json::Value root;
+    root[Json::StaticString("ok")] = 0;
+    root[Json::StaticString("msg")] = "Server overloaded";
+    root[Json::StaticString("retry_after_ms")] =
+	    Json::Value(int((retry_after_usec + 999) / 1000));
+    send_msg_response(msg.connection_num, msg.msgid, 'O', writer.write(root));
+    return true;
+}
+
 void
 XappyDispatcher::send_msg_response(int connection_num,
 				   const std::string & msgid,
 				   char status,
 				   const std::string & payload)
+{
+    send_response(connection_num, format_msg_response(msgid, status, payload));
+}
+
+std::string
+XappyDispatcher::format_msg_response(const std::string & msgid,
+				     char status,
+				     const std::string & payload,
+				     const std::string & encoding)
 {
     logger->error(std::string("Sending response to msgid: '") + msgid + "'");
     std::string buf(" ");
     buf += msgid;
+    if (!encoding.empty()) {
+	buf += ";enc=";
+	buf += encoding;
+    }
     buf += " ";
     buf += status;
     buf += payload;
-    send_response(connection_num, str(buf.size() - 1) + buf);
+    return str(buf.size() - 1) + buf;
+}
+
+void
+XappyDispatcher::handle_response(const Response & response)
+{
+    if (response.connection_num != FLIGHT_CONNECTION_NUM) {
+	if (!pending_writes.empty()) {
+	    std::map<std::pair<int, std::string>, std::string>::iterator i;
+	    i = pending_writes.find(std::make_pair(response.connection_num,
+						   response.msgid));
+	    if (i != pending_writes.end()) {
+		finish_write(i);
+	    }
+	}
+	write_response(response.connection_num,
+		       format_msg_response(response.msgid, response.status,
+					   response.payload,
+					   response.encoding));
+	return;
+    }
+
+    // Pass the response to a flight on to every message waiting for it.
+    std::map<std::string, std::string>::iterator i;
+    i = flight_keys.find(response.msgid);
+    if (i == flight_keys.end()) {
+	logger->error("Response for unknown flight '" + response.msgid + "'");
+	return;
+    }
+    std::map<std::string, Flight>::iterator j = flights.find(i->second);
+    assert(j != flights.end());
+
+    // Only cache the response if no writes to the database have finished
+    // since the flight started, since it may not reflect them.
+    if (cache.enabled() && response.status == 'S' &&
+	db_revisions[j->second.dbname] == j->second.revision) {
+	// The flight's key is the cache key, prefixed by the priority.
+	cache.set(j->first.substr(1), j->second.dbname, j->second.revision,
+		  response.status, response.payload, response.encoding);
+	stats->set("cache_entries", cache.count());
+	stats->set("cache_bytes", cache.bytes());
+    }
+    std::vector<std::pair<int, std::string> >::const_iterator k;
+    for (k = j->second.waiters.begin(); k != j->second.waiters.end(); ++k) {
+	write_response(k->first,
+		       format_msg_response(k->second, response.status,
+					   response.payload,
+					   response.encoding));
+    }
+    flights.erase(j);
+    flight_keys.erase(i);
+}
+
+void
+XappyDispatcher::connection_closed(int connection_num)
+{
+    (void) remove_waiters(connection_num, std::string());
+    connection_encodings.erase(connection_num);
+
+    // Writes from the connection which are already being handled will
+    // finish without their responses being passed on, so treat them as
+    // finished now.
+    std::map<std::pair<int, std::string>, std::string>::iterator i;
+    i = pending_writes.lower_bound(std::make_pair(connection_num,
+						  std::string()));
+    while (i != pending_writes.end() && i->first.first == connection_num) {
+	finish_write(i++);
+    }
+}
+
+void
+XappyDispatcher::message_rejected(const Message & msg)
+{
+    if (msg.connection_num != FLIGHT_CONNECTION_NUM) {
+	// A rejected write never started, so the database hasn't changed.
+	pending_writes.erase(std::make_pair(msg.connection_num, msg.msgid));
+	send_error_response(msg, "Server busy");
+	return;
+    }
+
+    // Pass the rejection of a flight on to every message waiting for it.
+    std::map<std::string, std::string>::iterator i;
+    i = flight_keys.find(msg.msgid);
+    if (i == flight_keys.end()) {
+	logger->error("Rejection of unknown flight '" + msg.msgid + "'");
+	return;
+    }
+    std::map<std::string, Flight>::iterator j = flights.find(i->second);
+    assert(j != flights.end());
+    std::vector<std::pair<int, std::string> >::const_iterator k;
+    for (k = j->second.waiters.begin(); k != j->second.waiters.end(); ++k) {
+	Message waiter(k->first);
+	waiter.msgid = k->second;
+	send_error_response(waiter, "Server busy");
+    }
+    flights.erase(j);
+    flight_keys.erase(i);
+}
+
+void
+XappyDispatcher::finish_write(std::map<std::pair<int, std::string>,
+			      std::string>::iterator i)
+{
+    ++db_revisions[i->second];
+    pending_writes.erase(i);
+}
+
+void
+XappyDispatcher::set_flow(Message & msg, const std::string & dbname)
+{
+    if (settings->fair_by == "database") {
+	msg.flow = dbname;
+    } else if (settings->fair_by == "connection") {
+	msg.flow = str(msg.connection_num);
+    }
+    std::map<std::string, int>::const_iterator i;
+    i = settings->flow_weights.find(dbname);
+    if (i != settings->flow_weights.end()) {
+	msg.flow_weight = i->second;
+    }
+}
+
+bool
+XappyDispatcher::send_cached_response(const std::string & dbname,
+				      const Message & msg)
+{
+    if (settings->cache_size == 0) {
+	return false;
+    }
+    cache.set_max_bytes(settings->cache_size);
+
+    // Responses are cached compressed if they were compressed, so the
+    // encoding accepted is part of the key.
+    std::string key(msg.accept_encoding);
+    key += ' ';
+    key += msg.target;
+    key += ' ';
+    key += msg.payload;
+    char status;
+    std::string payload;
+    std::string encoding;
+    if (!cache.get(key, db_revisions[dbname], status, payload, encoding)) {
+	stats->incr("cache_misses");
+	return false;
+    }
+    stats->incr("cache_hits");
+    // Nothing else can be waiting to be sent in response to this message,
+    // so the response can be written straight away.
+    write_response(msg.connection_num,
+		   format_msg_response(msg.msgid, status, payload, encoding));
+    return true;
+}
+
+bool
+XappyDispatcher::decompress_payload(Message & msg, bool & too_large)
+{
+    too_large = false;
+    if (msg.encoding.empty()) {
+	return true;
+    }
+    Codec * codec = get_codec(msg.encoding);
+    assert(codec != NULL);
+    std::string payload;
+    size_t max_size = settings->stream_threshold;
+    long long start = get_thread_cpu_usec();
+    bool ok = codec->decompress(msg.payload, payload, max_size);
+    stats->incr("decompress_cpu_us", get_thread_cpu_usec() - start);
+    if (!ok) {
+	too_large = payload.size() > max_size;
+	return false;
+    }
+    stats->incr("decompressed_requests");
+    msg.payload.swap(payload);
+    msg.encoding.clear();
+    return true;
+}
+
+int
+XappyDispatcher::get_search_group()
+{
+    if (search_group == -1) {
+	search_group = group_id("search");
+    }
+    return search_group;
+}
+
+int
+XappyDispatcher::get_indexer_group(const std::string & dbname)
+{
+    std::map<std::string, int>::const_iterator i = indexer_groups.find(dbname);
+    if (i != indexer_groups.end()) {
+	return i->second;
+    }
+    int group = group_id("indexer_" + dbname);
+    indexer_groups[dbname] = group;
+    return group;
+}
+
+void
+XappyDispatcher::send_read_to_worker(int group, const std::string & dbname,
+				     const Message & msg)
+{
+    // The target can't contain a space, so this is unambiguous.  The
+    // priority is included so that urgent requests never wait for a flight
+    // which is queued behind less urgent work.
+    std::string key(1, char('0' + msg.priority));
+    key += msg.accept_encoding;
+    key += ' ';
+    key += msg.target;
+    key += ' ';
+    key += msg.payload;
+
+    std::map<std::string, Flight>::iterator i = flights.find(key);
+    if (i != flights.end()) {
+	// A flight which started before a write to the database finished may
+	// not reflect the write, which the client may already have been told
+	// about, so only messages sent before then can join it.  A flight is
+	// also dropped if its deadline passes before a worker takes it, so
+	// only messages whose own deadlines would have passed by then can
+	// join it.
+	if (i->second.revision == db_revisions[dbname] &&
+	    (i->second.deadline == 0 ||
+	     (msg.deadline != 0 && msg.deadline <= i->second.deadline))) {
+	    i->second.waiters.push_back(std::make_pair(msg.connection_num,
+						       msg.msgid));
+	    stats->incr("reads_coalesced");
+	    return;
+	}
+
+	// Only one flight can have the key, so handle this message by
+	// itself (and don't cache its response, which is left to the
+	// flight).
+	if (shed_if_overloaded(group, msg)) {
+	    return;
+	}
+	stats->incr("reads_executed");
+	send_to_worker(group, msg);
+	return;
+    }
+
+    // Only messages which add work are refused when the group is
+    // overloaded; joining a flight costs nothing.
+    if (shed_if_overloaded(group, msg)) {
+	return;
+    }
+
+    Message flight_msg(msg);
+    flight_msg.connection_num = FLIGHT_CONNECTION_NUM;
+    flight_msg.msgid = "f" + str(next_flight_num++);
+    Flight & flight = flights[key];
+    flight.flight_msgid = flight_msg.msgid;
+    flight.dbname = dbname;
+    flight.revision = db_revisions[dbname];
+    flight.deadline = msg.deadline;
+    flight.waiters.push_back(std::make_pair(msg.connection_num, msg.msgid));
+    flight_keys[flight_msg.msgid] = key;
+    stats->incr("reads_executed");
+    send_to_worker(group, flight_msg);
+}
+
+bool
+XappyDispatcher::remove_waiters(int connection_num, const std::string & msgid)
+{
+    bool removed = false;
+    std::map<std::string, Flight>::iterator i = flights.begin();
+    while (i != flights.end()) {
+	std::vector<std::pair<int, std::string> > & waiters = i->second.waiters;
+	std::vector<std::pair<int, std::string> >::iterator j = waiters.begin();
+	bool flight_removed = false;
+	while (j != waiters.end()) {
+	    if (j->first == connection_num &&
+		(msgid.empty() || j->second == msgid)) {
+		j = waiters.erase(j);
+		flight_removed = true;
+	    } else {
+		++j;
+	    }
+	}
+	removed = removed || flight_removed;
+
+	if (flight_removed && waiters.empty() &&
+	    cancel_message(FLIGHT_CONNECTION_NUM, i->second.flight_msgid) !=
+	    CANCEL_NOT_FOUND) {
+	    // No response will be sent for the flight.  (If the flight
+	    // couldn't be cancelled, its response is already on its way, so
+	    // the flight is left to be cleaned up when it arrives.)
+	    flight_keys.erase(i->second.flight_msgid);
+	    flights.erase(i++);
+	} else {
+	    ++i;
+	}
+    }
+    return removed;
 }
 
 Worker *
@@ -93,99 +432,339 @@ XappyDispatcher::get_worker(const std::string & group, int current_workers)
     return NULL;
 }
 
+int
+XappyDispatcher::max_workers(const std::string & group, int priority)
+{
+    int limit = settings->search_workers;
+    if (startswith(group, "indexer")) {
+	limit = settings->update_workers;
+    }
+    if (priority != PRIORITY_INTERACTIVE) {
+	limit -= settings->reserved_workers;
+    }
+    return std::max(limit, 1);
+}
+
+int
+XappyDispatcher::min_workers(const std::string & group)
+{
+    if (startswith(group, "indexer")) {
+	return settings->min_update_workers;
+    }
+    return settings->min_search_workers;
+}
+
+void
+XappyDispatcher::startup_groups(std::vector<std::string> & groups)
+{
+    // Update workers are per database, so can't be started until the
+    // database is first used.
+    groups.push_back("search");
+}
+
+std::string
+XappyDispatcher::worker_cpus(const std::string & group)
+{
+    if (startswith(group, "indexer")) {
+	return settings->update_cpus;
+    }
+    return settings->search_cpus;
+}
+
+bool
+XappyDispatcher::parse_msg_option(Message & msg, const std::string & option)
+{
+    std::string::size_type i = option.find('=');
+    if (i == option.npos)
+	return false;
+    std::string name(option, 0, i);
+    std::string value(option, i + 1);
+    if (name == "qos") {
+	if (value == "interactive") {
+	    msg.priority = PRIORITY_INTERACTIVE;
+	} else if (value == "normal") {
+	    msg.priority = PRIORITY_NORMAL;
+	} else if (value == "batch") {
+	    msg.priority = PRIORITY_BATCH;
+	} else {
+	    return false;
+	}
+	return true;
+    }
+    if (name == "deadline") {
+	// A number of milliseconds from now, limited so that it can't
+	// overflow.
+	if (value.empty() || value.size() > 9 ||
+	    value.find_first_not_of("0123456789") != value.npos) {
+	    return false;
+	}
+	msg.deadline = get_monotonic_usec() + atol(value.c_str()) * 1000LL;
+	return true;
+    }
+    if (name == "enc") {
+	if (get_codec(value) == NULL) {
+	    return false;
+	}
+	msg.encoding = value;
+	return true;
+    }
+    return false;
+}
+
 bool
 XappyDispatcher::build_message(Message & msg,
 			       const std::string & buf, size_t pos, size_t msglen)
 {
+    const char * data = buf.data();
     size_t end = pos + msglen;
-    size_t i = buf.find(' ', pos);
 
+    // The message id may be followed by options, each introduced by ';'.
+    // The message id is urlquoted, so can't itself contain a ';'.
+    FrameHeader header;
+    scanner.scan_header(data + pos, data + end, header);
+    size_t optpos = header.msgid_end - data;
+    size_t i = header.options_end - data;
     if (i >= end) {
 	logger->error("Invalid message: no target or payload");
 	send_fatal_error(msg.connection_num, "Invalid message");
 	return false;
     }
-    size_t j = buf.find(' ', i + 1);
+    size_t j = header.target_end - data;
     if (j >= end) {
 	logger->error("Invalid message: no payload");
 	send_fatal_error(msg.connection_num, "Invalid message");
 	return false;
     }
 
-    msg.msgid = buf.substr(pos, i - pos);
+    msg.msgid = buf.substr(pos, optpos - pos);
+    while (optpos < i) {
+	size_t optend = scanner.find_any(data + optpos + 1, data + i,
+					 ';', ';', ';', ';') - data;
+	std::string option(buf, optpos + 1, optend - (optpos + 1));
+	if (!parse_msg_option(msg, option)) {
+	    logger->error("Invalid message option: '" + option + "'");
+	    send_error_response(msg, "Invalid message option");
+	    return false;
+	}
+	optpos = optend;
+    }
     msg.target = buf.substr(i + 1, j - (i + 1));
     msg.payload = buf.substr(j + 1, end - (j + 1));
 
     return true;
 }
 
-static void
-split_target(const std::string & target,
-	     std::vector<std::string> & components) {
-    std::string::size_type i = 0, j;
-    while (true) {
-	j = target.find('/', i);
-	if (j == target.npos) {
-	    components.push_back(target.substr(i));
-	    return;
-	}
-	components.push_back(target.substr(i, j - i));
-	i = j + 1;
-    }
+/// Identifiers for the routes handled by the dispatcher.
+enum {
+    /// Get the server version.
+    ROUTE_VERSION,
+
+    /// Get statistics about the server.
+    ROUTE_STATS,
+
+    /// Set the encoding to compress responses on the connection with.
+    ROUTE_ENCODING,
+
+    /// Cancel an earlier message.
+    ROUTE_CANCEL,
+
+    /// Read from a database.
+    ROUTE_DB_READ,
+
+    /// Modify a database.
+    ROUTE_DB_WRITE
+};
+
+/// The routes handled by the dispatcher.
+static const RouteSpec routes[] = {
+    { 'G', "version", ROUTE_VERSION },
+    { 'G', "stats", ROUTE_STATS },
+    { 'U', "encoding", ROUTE_ENCODING },
+    { 'C', "{msgid}", ROUTE_CANCEL },
+    { 'G', "db/{name}", ROUTE_DB_READ },
+    { 'G', "db/{name}/_schema", ROUTE_DB_READ },
+    { 'G', "db/{name}/{type}/{docid}", ROUTE_DB_READ },
+    { 'U', "db/{name}/_schema", ROUTE_DB_WRITE },
+    { 'U', "db/{name}/{type}/{docid}", ROUTE_DB_WRITE },
+    { 'P', "db/{name}/{type}/", ROUTE_DB_WRITE },
+    { 'D', "db/{name}/{type}/{docid}", ROUTE_DB_WRITE },
+};
+
+XappyDispatcher::XappyDispatcher()
+	: router(),
+	  scanner(get_frame_scanner()),
+	  flights(),
+	  flight_keys(),
+	  next_flight_num(0),
+	  cache(),
+	  search_group(-1),
+	  indexer_groups(),
+	  db_revisions(),
+	  pending_writes(),
+	  connection_encodings()
+{
+    router.add(routes, sizeof(routes) / sizeof(routes[0]));
 }
 
 /** Route a message appropriately.
  */
 void
 XappyDispatcher::route_message(int connection_num,
-			       const std::string & buf, size_t pos, size_t msglen)
+			       const std::string & buf, size_t pos, size_t msglen,
+			       const PayloadStreamPtr & stream)
 {
     Message msg(connection_num);
     if (!build_message(msg, buf, pos, msglen)) return;
 
+    // Compressed payloads need to be complete to be decompressed.
+    if (stream.get() != NULL && !msg.encoding.empty()) {
+	logger->error("Compressed message too large: '" + msg.target + "'");
+	send_error_response(msg, "Message too large");
+	return;
+    }
+    bool too_large;
+    if (!decompress_payload(msg, too_large)) {
+	if (too_large) {
+	    logger->error("Compressed message too large: '" + msg.target +
+			  "'");
+	    send_error_response(msg, "Message too large");
+	} else {
+	    logger->error("Invalid compressed payload: '" + msg.target + "'");
+	    send_error_response(msg, "Invalid compressed payload");
+	}
+	return;
+    }
+    std::map<int, std::string>::const_iterator enc;
+    enc = connection_encodings.find(connection_num);
+    if (enc != connection_encodings.end()) {
+	msg.accept_encoding = enc->second;
+    }
+
     if (msg.target.empty()) {
 	logger->error("Invalid message: empty target");
 	send_error_response(msg, "Invalid message");
 	return;
     }
-    std::string target = msg.target.substr(1);
-    std::vector<std::string> components;
-    split_target(target, components);
-    switch (msg.target[0]) {
-	case 'G': // GET
+
+    // The first character of the target is the method, and the rest is the
+    // path.
+    RouteMatch match;
+    if (!router.match(msg.target[0], msg.target, 1, match)) {
+	if (std::string("GPUDC").find(msg.target[0]) == std::string::npos) {
+	    logger->error(std::string("Unknown message type: '") + msg.target[0] + "'");
+	    send_error_response(msg, "Invalid message");
+	    return;
+	}
+	send_error_response(msg, "Not found");
+	return;
+    }
+
+    // Only writes are worth streaming: other messages should be small.
+    if (stream.get() != NULL && match.route_id != ROUTE_DB_WRITE) {
+	logger->error("Message too large: '" + msg.target + "'");
+	send_error_response(msg, "Message too large");
+	return;
+    }
+
+    switch (match.route_id) {
+	case ROUTE_VERSION:
+	    send_msg_response(connection_num, msg.msgid, 'S', VERSION);
+	    return;
+	case ROUTE_STATS:
 	    {
-		if (target == "version") {
-		    send_msg_response(connection_num, msg.msgid, 'S', VERSION);
-		    return;
-		}
-		if (components.size() >= 2 && components[0] == "db") {
-		    logger->info("Got request on db '" + components[1] + "'");
-		    send_to_worker("search", msg);
+		Json::FastWriter writer;
+		Json::Value root(Json::objectValue);
+		stats->describe(root);
+		root[Json::StaticString("reads_in_flight")] =
+			Json::Value(int(flights.size()));
+		root[Json::StaticString("ok")] = Json::Value(1);
+		send_msg_response(connection_num, msg.msgid, 'J',
+				  writer.write(root));
+		return;
+	    }
+	case ROUTE_ENCODING:
+	    {
+		if (msg.payload == "identity") {
+		    connection_encodings.erase(connection_num);
+		} else if (get_codec(msg.payload) != NULL) {
+		    connection_encodings[connection_num] = msg.payload;
+		} else {
+		    send_error_response(msg, "Unknown encoding");
 		    return;
 		}
+		Json::FastWriter writer;
+		Json::Value root;
+		root[Json::StaticString("ok")] = 1;
+		root[Json::StaticString("encoding")] = msg.payload;
+		send_msg_response(connection_num, msg.msgid, 'J',
+				  writer.write(root));
+		return;
 	    }
-	    break;
-	case 'P': // POST
+	case ROUTE_CANCEL:
 	    {
+		std::string cancel_msgid(match.capture(msg.target, 0));
+		const char * cancelled = "none";
+		if (remove_waiters(connection_num, cancel_msgid)) {
+		    // The message was waiting for a flight, which may
+		    // continue for the benefit of other messages.
+		    cancelled = "queued";
+		} else {
+		    CancelResult result = cancel_message(connection_num,
+							 cancel_msgid);
+		    switch (result) {
+			case CANCEL_NOT_FOUND: break;
+			case CANCEL_QUEUED: cancelled = "queued"; break;
+			case CANCEL_RUNNING: cancelled = "running"; break;
+		    }
+		    if (result != CANCEL_NOT_FOUND) {
+			// If this was a write, it won't send a response.
+			std::map<std::pair<int, std::string>,
+				 std::string>::iterator i;
+			i = pending_writes.find(std::make_pair(connection_num,
+							       cancel_msgid));
+			if (i != pending_writes.end()) {
+			    finish_write(i);
+			}
+		    }
+		}
+		Json::FastWriter writer;
+		Json::Value root;
+		root[Json::StaticString("ok")] = 1;
+		root[Json::StaticString("cancelled")] = cancelled;
+		send_msg_response(connection_num, msg.msgid, 'J',
+				  writer.write(root));
+		return;
 	    }
-	    break;
-	case 'U': // PUT
+	case ROUTE_DB_READ:
 	    {
-		if (components.size() >= 2 && components[0] == "db") {
-		    logger->info("Got request on db '" + components[1] + "'");
-		    send_to_worker("indexer_" + components[1], msg);
-		    return;
+		std::string dbname(match.capture(msg.target, 0));
+		logger->info("Got request on db '" + dbname + "'");
+		set_flow(msg, dbname);
+		msg.affinity = dbname;
+		if (!send_cached_response(dbname, msg)) {
+		    send_read_to_worker(get_search_group(), dbname, msg);
 		}
+		return;
 	    }
-	    break;
-	case 'D': // DELETE
+	case ROUTE_DB_WRITE:
 	    {
+		std::string dbname(match.capture(msg.target, 0));
+		logger->info("Got request on db '" + dbname + "'");
+		int group = get_indexer_group(dbname);
+		if (shed_if_overloaded(group, msg)) {
+		    return;
+		}
+		set_flow(msg, dbname);
+		pending_writes[std::make_pair(connection_num, msg.msgid)] =
+			dbname;
+		if (stream.get() != NULL) {
+		    stream->write(msg.payload);
+		    msg.payload.clear();
+		    msg.stream = stream;
+		}
+		send_to_worker(group, msg);
+		return;
 	    }
-	    break;
-	default:
-	    logger->error(std::string("Unknown message type: '") + msg.target[0] + "'");
-	    send_error_response(msg, "Invalid message");
-	    return;
     }
     send_error_response(msg, "Not found");
 }
@@ -197,20 +776,19 @@ XappyDispatcher::dispatch_request(int connection_num, std::string & buf)
     std::string::size_type size = buf.size();
     std::string::size_type startpos = 0;
     bool found = false;
+    const char * data = buf.data();
 
     while(true) {
 	// Ignore whitespace between messages.
-	while (pos < size && isspace(buf[pos])) {
-	    ++pos;
-	}
+	pos = scanner.skip_space(data + pos, data + size) - data;
 	startpos = pos;
 
 	// Read the message length, in decimal
 	int msglen = 0;
-	size_t max_msg_len_len = MAX_MSG_LEN_LEN;
-	if (size < MAX_MSG_LEN_LEN) 
-	    max_msg_len_len = size;
-	while (pos < max_msg_len_len && isdigit(buf[pos])) {
+	size_t max_msg_len_end = startpos + MAX_MSG_LEN_LEN;
+	if (size < max_msg_len_end)
+	    max_msg_len_end = size;
+	while (pos < max_msg_len_end && isdigit(buf[pos])) {
 	    msglen = msglen * 10 + (buf[pos] - '0');
 	    ++pos;
 	}
@@ -219,8 +797,9 @@ XappyDispatcher::dispatch_request(int connection_num, std::string & buf)
 	if (pos >= size)
 	    break;
 	if (buf[pos] != ' ') {
-	    pos = buf.find_first_of("\n\r", pos, 2);
-	    if (pos != buf.npos) {
+	    pos = scanner.find_any(data + pos, data + size,
+				   '\n', '\r', '\n', '\r') - data;
+	    if (pos != size) {
 		logger->error("Resyncing - skipping " + str(pos - startpos) +
 			      " characters: \"" +
 			      buf.substr(startpos, pos - startpos) + "\"");
@@ -234,8 +813,21 @@ XappyDispatcher::dispatch_request(int connection_num, std::string & buf)
 	++pos;
 
 	// Check if we've got the whole message now.
-	if (pos + msglen > size)
+	if (pos + msglen > size) {
+	    // Pass the rest of large messages on as it arrives, once the
+	    // message id and target have arrived.
+	    if (msglen <= settings->stream_threshold)
+		break;
+	    FrameHeader header;
+	    scanner.scan_header(data + pos, data + size, header);
+	    if (header.target_end == data + size)
+		break;
+	    PayloadStreamPtr stream = stream_payload(connection_num,
+						     pos + msglen - size);
+	    route_message(connection_num, buf, pos, size - pos, stream);
+	    startpos = size;
 	    break;
+	}
 
 	route_message(connection_num, buf, pos, msglen);
 	found = true;
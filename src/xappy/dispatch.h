@@ -26,12 +26,162 @@
 #ifndef XAPSRV_INCLUDED_DISPATCH_H
 #define XAPSRV_INCLUDED_DISPATCH_H
 
+#include <map>
+#include "responsecache.h"
+#include "server/framescan.h"
+#include "server/router.h"
 #include "server/server.h"
+#include <string>
+#include <utility>
+#include <vector>
 
 class XappyDispatcher : public Dispatcher {
+    /// The routes for incoming messages.
+    Router router;
+
+    /// The scanner used to find the parts of incoming messages.
+    const FrameScanner & scanner;
+
+    /** A read request being handled on behalf of one or more messages.
+     *
+     *  Identical read requests which arrive while a flight is outstanding
+     *  join the flight instead of being handled separately, and all receive
+     *  the response to the flight.
+     */
+    struct Flight {
+	/// The id of the message sent to a worker for the flight.
+	std::string flight_msgid;
+
+	/// The database which the flight reads from.
+	std::string dbname;
+
+	/// The revision of the database when the flight started.
+	unsigned long revision;
+
+	/// The deadline of the message sent for the flight, or 0 if none.
+	long long deadline;
+
+	/// The connection number and message id of each waiting message.
+	std::vector<std::pair<int, std::string> > waiters;
+    };
+
+    /// The outstanding flights, keyed by the request they are handling.
+    std::map<std::string, Flight> flights;
+
+    /// The key in `flights` for each outstanding flight, by flight_msgid.
+    std::map<std::string, std::string> flight_keys;
+
+    /// The number used to make the next flight_msgid.
+    unsigned long next_flight_num;
+
+    /// Cached responses to read requests.
+    ResponseCache cache;
+
+    /// The id of the group of search workers, or -1 until first used.
+    int search_group;
+
+    /// The id of the group of update workers for each database, by name.
+    std::map<std::string, int> indexer_groups;
+
+    /// Get the id of the group of search workers.
+    int get_search_group();
+
+    /// Get the id of the group of update workers for a database.
+    int get_indexer_group(const std::string & dbname);
+
+    /** The revision of each database.
+     *
+     *  This isn't the revision of the underlying Xapian database: it is
+     *  incremented whenever a write to the database finishes, and used to
+     *  discard cached responses which may be out of date.
+     */
+    std::map<std::string, unsigned long> db_revisions;
+
+    /// The database modified by each outstanding write, by connection and
+    /// message id.
+    std::map<std::pair<int, std::string>, std::string> pending_writes;
+
+    /** The encoding which each connection accepts responses in.
+     *
+     *  Connections which haven't asked for compressed responses aren't
+     *  listed.
+     */
+    std::map<int, std::string> connection_encodings;
+
+    /** Decompress the payload of a message, if it's compressed.
+     *
+     *  Payloads may decompress to at most the stream threshold, since any
+     *  larger would have been streamed if sent uncompressed.
+     *
+     *  @param msg The message.
+     *  @param too_large Set to true if the payload would decompress to more
+     *  than the stream threshold.
+     *
+     *  @retval true if the payload was decompressed, or wasn't compressed.
+     */
+    bool decompress_payload(Message & msg, bool & too_large);
+
+    /** Send a read request to a worker, sharing the work with any identical
+     *  outstanding request.
+     *
+     *  @param group The id of the group of workers to send the request to.
+     *  @param dbname The database which the request reads from.
+     *  @param msg The request.
+     */
+    void send_read_to_worker(int group, const std::string & dbname,
+			     const Message & msg);
+
+    /** Refuse a message with an "overloaded" response, if the group of
+     *  workers it needs is overloaded.
+     *
+     *  Interactive messages are never refused.
+     *
+     *  @retval true if the message was refused.
+     */
+    bool shed_if_overloaded(int group, const Message & msg);
+
+    /** Set the flow of a message for a database, for sharing workers
+     *  fairly between flows.
+     */
+    void set_flow(Message & msg, const std::string & dbname);
+
+    /** Answer a read request from the cache, if possible.
+     *
+     *  @retval true if the request was answered.
+     */
+    bool send_cached_response(const std::string & dbname, const Message & msg);
+
+    /** Note that a write to a database has finished (or been abandoned).
+     *
+     *  Cached responses for the database are invalidated.
+     */
+    void finish_write(std::map<std::pair<int, std::string>,
+		      std::string>::iterator i);
+
+    /** Remove waiting messages from flights.
+     *
+     *  Flights which are left with no waiters are cancelled.
+     *
+     *  @param connection_num The connection of the messages to remove.
+     *  @param msgid The id of the message to remove, or empty to remove all
+     *  messages from the connection.
+     *
+     *  @retval true if any messages were removed.
+     */
+    bool remove_waiters(int connection_num, const std::string & msgid);
+
   public:
+    XappyDispatcher();
+
     bool dispatch_request(int connection_num, std::string & buf);
+    void handle_response(const Response & response);
+    void connection_closed(int connection_num);
+    void message_rejected(const Message & msg);
     Worker * get_worker(const std::string & group, int current_workers);
+    int max_workers(const std::string & group, int priority);
+    int min_workers(const std::string & group);
+    void startup_groups(std::vector<std::string> & groups);
+    std::string worker_cpus(const std::string & group);
 
     /** Send a response indicating a protocol error.
      *
@@ -45,10 +195,40 @@ class XappyDispatcher : public Dispatcher {
     void send_msg_response(int connection_num, const std::string & msgid,
 			   char status, const std::string & payload);
 
+    /** Format a response to a message, ready to be written to a connection.
+     *
+     *  @param encoding The encoding the payload is compressed with, or empty
+     *  if it isn't compressed.
+     */
+    std::string format_msg_response(const std::string & msgid, char status,
+				     const std::string & payload,
+				     const std::string & encoding = std::string());
+
+    /** Apply an option given with a message id to a message.
+     *
+     *  Options are of the form "name=value".
+     *
+     *  @retval true if the option was valid, false otherwise.
+     */
+    bool parse_msg_option(Message & msg, const std::string & option);
+
     bool build_message(Message & msg,
 		       const std::string & buf, size_t pos, size_t msglen);
+
+    /** Route a message.
+     *
+     *  @param connection_num The connection the message came from.
+     *  @param buf The buffer holding the message.
+     *  @param pos The position of the message in the buffer.
+     *  @param msglen The length of the message in the buffer.
+     *  @param stream If set, the rest of the message's payload, which is
+     *  still arriving.  Messages on routes which can't accept a streamed
+     *  payload receive an error response, and the rest of the payload is
+     *  discarded.
+     */
     void route_message(int connection_num,
-		       const std::string & buf, size_t pos, size_t msglen);
+		       const std::string & buf, size_t pos, size_t msglen,
+		       const PayloadStreamPtr & stream = PayloadStreamPtr());
 };
 
 #endif /* XAPSRV_INCLUDED_DISPATCH_H */
@@ -26,6 +26,9 @@
 #include <config.h>
 #include "indexerworker.h"
 
+#include "json/json.h"
+#include <string>
+
 void
 IndexerWorker::run()
 {
@@ -33,6 +36,40 @@ IndexerWorker::run()
 	Message msg = wait_for_message(true);
 	if (msg.connection_num < 0)
 	    break;
-	send_response(msg.connection_num, msg.payload);
+	if (msg.stream.get() == NULL) {
+	    send_response(msg, 'S', msg.payload);
+	    continue;
+	}
+
+	// Large payloads are read a chunk at a time as they arrive, so that
+	// they never need to be held in memory all at once.
+	size_t length = 0;
+	std::string chunk;
+	while (msg.stream->read(chunk)) {
+	    length += chunk.size();
+	}
+	if (msg.stream->is_aborted()) {
+	    // The connection closed before the whole message arrived.
+	    continue;
+	}
+	Json::FastWriter writer;
+	Json::Value root;
+	root[Json::StaticString("ok")] = 1;
+	// Lengths too large for an unsigned int are written as doubles,
+	// which hold them exactly up to 2^53.
+	if (length <= size_t(Json::Value::maxUInt)) {
+	    root[Json::StaticString("length")] = Json::UInt(length);
+	} else {
+	    root[Json::StaticString("length")] = double(length);
+	}
+	send_response(msg, 'J', writer.write(root));
     }
 }
+
+bool
+IndexerWorker::multiplexes() const
+{
+    // Each message's state is on the stack, so a worker can switch to
+    // another update while a large payload arrives.
+    return true;
+}
@@ -33,6 +33,7 @@ class IndexerWorker : public Worker {
   public:
     IndexerWorker(const std::string & dbname_) : Worker(), dbname(dbname_) {}
     void run();
+    bool multiplexes() const;
 };
 
 #endif /* XAPSRV_INCLUDED_IO_INDEXERWORKER_H */
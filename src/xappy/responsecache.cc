@@ -0,0 +1,107 @@
+/** @file responsecache.cc
+ * @brief Cache of responses to read requests.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "responsecache.h"
+
+ResponseCache::ResponseCache()
+	: entries(), index(), max_bytes(0), used_bytes(0)
+{
+}
+
+void
+ResponseCache::remove(std::map<std::string,
+		      std::list<Entry>::iterator>::iterator i)
+{
+    used_bytes -= i->second->size;
+    entries.erase(i->second);
+    index.erase(i);
+}
+
+void
+ResponseCache::set_max_bytes(size_t max_bytes_)
+{
+    max_bytes = max_bytes_;
+    while (used_bytes > max_bytes) {
+	remove(index.find(entries.back().key));
+    }
+}
+
+bool
+ResponseCache::get(const std::string & key, unsigned long revision,
+		   char & status, std::string & payload,
+		   std::string & encoding)
+{
+    std::map<std::string, std::list<Entry>::iterator>::iterator i;
+    i = index.find(key);
+    if (i == index.end()) {
+	return false;
+    }
+    if (i->second->revision != revision) {
+	// The database has changed since the response was read.
+	remove(i);
+	return false;
+    }
+    entries.splice(entries.begin(), entries, i->second);
+    status = i->second->status;
+    payload = i->second->payload;
+    encoding = i->second->encoding;
+    return true;
+}
+
+void
+ResponseCache::set(const std::string & key, const std::string & dbname,
+		   unsigned long revision,
+		   char status, const std::string & payload,
+		   const std::string & encoding)
+{
+    std::map<std::string, std::list<Entry>::iterator>::iterator i;
+    i = index.find(key);
+    if (i != index.end()) {
+	remove(i);
+    }
+
+    // The key is stored twice: once in the entry, and once in the index.
+    size_t size = sizeof(Entry) + 2 * key.size() + dbname.size() +
+	    payload.size() + encoding.size();
+    if (size > max_bytes) {
+	return;
+    }
+    while (used_bytes + size > max_bytes) {
+	remove(index.find(entries.back().key));
+    }
+
+    entries.push_front(Entry());
+    Entry & entry = entries.front();
+    entry.key = key;
+    entry.dbname = dbname;
+    entry.revision = revision;
+    entry.status = status;
+    entry.payload = payload;
+    entry.encoding = encoding;
+    entry.size = size;
+    index[key] = entries.begin();
+    used_bytes += size;
+}
@@ -0,0 +1,137 @@
+/** @file responsecache.h
+ * @brief Cache of responses to read requests.
+ */
+/*
+ * Copyright (c) 2010 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef XAPSRV_INCLUDED_RESPONSECACHE_H
+#define XAPSRV_INCLUDED_RESPONSECACHE_H
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+
+/** A cache of responses to read requests, bounded by size.
+ *
+ *  Each response is tagged with the revision of the database it was read
+ *  from, and is only returned while the database is still at that revision.
+ *  The least recently used responses are discarded when the cache is full.
+ *
+ *  This isn't thread-safe - it is only used from the main server thread.
+ */
+class ResponseCache {
+    /// A cached response.
+    struct Entry {
+	/// The key of the request which the response is for.
+	std::string key;
+
+	/// The database which the response was read from.
+	std::string dbname;
+
+	/// The revision of the database which the response was read from.
+	unsigned long revision;
+
+	/// The status code of the response.
+	char status;
+
+	/// The encoding the body is compressed with, or empty if it isn't.
+	std::string encoding;
+
+	/// The body of the response.
+	std::string payload;
+
+	/// The approximate number of bytes of memory used by the entry.
+	size_t size;
+    };
+
+    /// The entries, most recently used first.
+    std::list<Entry> entries;
+
+    /// The entries, by key.
+    std::map<std::string, std::list<Entry>::iterator> index;
+
+    /// The maximum number of bytes to use.
+    size_t max_bytes;
+
+    /// The number of bytes currently used.
+    size_t used_bytes;
+
+    /// Remove an entry from the cache.
+    void remove(std::map<std::string, std::list<Entry>::iterator>::iterator i);
+
+    // Don't allow copying or assignment.
+    ResponseCache(const ResponseCache & other);
+    void operator=(const ResponseCache & other);
+  public:
+    ResponseCache();
+
+    /** Set the maximum number of bytes to use.
+     *
+     *  If 0, the cache is disabled.
+     */
+    void set_max_bytes(size_t max_bytes_);
+
+    /// Return true if the cache is enabled.
+    bool enabled() const { return max_bytes != 0; }
+
+    /** Look up a response.
+     *
+     *  @param key The key of the request.
+     *  @param revision The current revision of the database which the
+     *  request reads from.  Responses read from any other revision are
+     *  discarded.
+     *  @param status Set to the status code of the response, if found.
+     *  @param payload Set to the body of the response, if found.
+     *  @param encoding Set to the encoding of the body, if found.
+     *
+     *  @retval true if a response was found.
+     */
+    bool get(const std::string & key, unsigned long revision,
+	     char & status, std::string & payload, std::string & encoding);
+
+    /** Store a response.
+     *
+     *  Responses which are too big to fit in the cache are ignored.
+     *
+     *  @param key The key of the request.
+     *  @param dbname The database which the response was read from.
+     *  @param revision The revision of the database which the response was
+     *  read from.
+     *  @param status The status code of the response.
+     *  @param payload The body of the response.
+     *  @param encoding The encoding of the body, or empty if it isn't
+     *  compressed.
+     */
+    void set(const std::string & key, const std::string & dbname,
+	     unsigned long revision,
+	     char status, const std::string & payload,
+	     const std::string & encoding);
+
+    /// Get the number of responses in the cache.
+    size_t count() const { return index.size(); }
+
+    /// Get the approximate number of bytes used by the cache.
+    size_t bytes() const { return used_bytes; }
+};
+
+#endif /* XAPSRV_INCLUDED_RESPONSECACHE_H */
@@ -33,6 +33,10 @@ SearchWorker::run()
 	Message msg = wait_for_message(true);
 	if (msg.connection_num < 0)
 	    break;
-	send_response(msg.connection_num, msg.payload);
+	if (cancelled()) {
+	    // The client has given up on this request.
+	    continue;
+	}
+	send_response(msg, 'S', msg.payload);
     }
 }